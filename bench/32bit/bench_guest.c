@@ -0,0 +1,85 @@
+
+int host_nop0( void );
+int host_nop1( int a );
+int host_nop2( int a, int b );
+int host_nop3( int a, int b, int c );
+int host_nop4( int a, int b, int c, int d );
+int host_nop6( int a, int b, int c, int d, int e, int f );
+
+int nop0( void )
+{
+    return 0;
+}
+
+int nop1( int a )
+{
+    return a;
+}
+
+int nop2( int a, int b )
+{
+    return a + b;
+}
+
+int nop3( int a, int b, int c )
+{
+    return a + b + c;
+}
+
+int nop4( int a, int b, int c, int d )
+{
+    return a + b + c + d;
+}
+
+int nop6( int a, int b, int c, int d, int e, int f )
+{
+    return a + b + c + d + e + f;
+}
+
+int call_host0( int n )
+{
+    int ans = 0;
+    for ( int i = 0; i < n; ++i )
+        ans += host_nop0();
+    return ans;
+}
+
+int call_host1( int n )
+{
+    int ans = 0;
+    for ( int i = 0; i < n; ++i )
+        ans += host_nop1( i );
+    return ans;
+}
+
+int call_host2( int n )
+{
+    int ans = 0;
+    for ( int i = 0; i < n; ++i )
+        ans += host_nop2( i, i );
+    return ans;
+}
+
+int call_host3( int n )
+{
+    int ans = 0;
+    for ( int i = 0; i < n; ++i )
+        ans += host_nop3( i, i, i );
+    return ans;
+}
+
+int call_host4( int n )
+{
+    int ans = 0;
+    for ( int i = 0; i < n; ++i )
+        ans += host_nop4( i, i, i, i );
+    return ans;
+}
+
+int call_host6( int n )
+{
+    int ans = 0;
+    for ( int i = 0; i < n; ++i )
+        ans += host_nop6( i, i, i, i, i, i );
+    return ans;
+}
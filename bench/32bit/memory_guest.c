@@ -0,0 +1,130 @@
+
+#include <stddef.h>
+
+#include <emmintrin.h>
+
+// Resolved to the e32libc thunks by the host
+void * memcpy( void * dest, const void * src, size_t n );
+void * memset( void * s, int c, size_t n );
+size_t strlen( const char * s );
+
+/**
+ * @brief Copy with string instructions, as in a generic i386 libc
+ */
+static void * guest_memcpy_rep( void * dest, const void * src, size_t n )
+{
+    void * d = dest;
+    size_t words = n / 4;
+    size_t bytes = n % 4;
+
+    asm volatile ( "rep movsl\n\t"
+                   "mov %3, %%ecx\n\t"
+                   "rep movsb"
+                   : "+D"(d), "+S"(src), "+c"(words)
+                   : "r"(bytes)
+                   : "memory" );
+
+    return dest;
+}
+
+/**
+ * @brief Copy with unaligned 16-byte SSE2 moves
+ */
+__attribute__((target("sse2")))
+static void * guest_memcpy_sse2( void * dest, const void * src, size_t n )
+{
+    char * d = dest;
+    const char * s = src;
+
+    for ( ; n >= 64; n -= 64, d += 64, s += 64 )
+    {
+        const __m128i a = _mm_loadu_si128( (const __m128i *)s );
+        const __m128i b = _mm_loadu_si128( (const __m128i *)( s + 16 ) );
+        const __m128i c = _mm_loadu_si128( (const __m128i *)( s + 32 ) );
+        const __m128i e = _mm_loadu_si128( (const __m128i *)( s + 48 ) );
+        _mm_storeu_si128( (__m128i *)d, a );
+        _mm_storeu_si128( (__m128i *)( d + 16 ), b );
+        _mm_storeu_si128( (__m128i *)( d + 32 ), c );
+        _mm_storeu_si128( (__m128i *)( d + 48 ), e );
+    }
+
+    for ( ; n >= 16; n -= 16, d += 16, s += 16 )
+    {
+        _mm_storeu_si128( (__m128i *)d, _mm_loadu_si128( (const __m128i *)s ) );
+    }
+
+    guest_memcpy_rep( d, s, n );
+
+    return dest;
+}
+
+static size_t guest_strlen( const char * s )
+{
+    const char * p = s;
+    while ( *p )
+    {
+        ++p;
+    }
+    return p - s;
+}
+
+int copy_rep( char * dest, const char * src, int n, int iterations )
+{
+    for ( int i = 0; i < iterations; ++i )
+        guest_memcpy_rep( dest, src, n );
+    return dest[0];
+}
+
+int copy_sse2( char * dest, const char * src, int n, int iterations )
+{
+    for ( int i = 0; i < iterations; ++i )
+    {
+        guest_memcpy_sse2( dest, src, n );
+        asm volatile ( "" ::: "memory" );
+    }
+    return dest[0];
+}
+
+int copy_host( char * dest, const char * src, int n, int iterations )
+{
+    for ( int i = 0; i < iterations; ++i )
+        memcpy( dest, src, n );
+    return dest[0];
+}
+
+int fill_rep( char * dest, int c, int n, int iterations )
+{
+    for ( int i = 0; i < iterations; ++i )
+    {
+        void * d = dest;
+        size_t count = n;
+        asm volatile ( "rep stosb" : "+D"(d), "+c"(count) : "a"(c) : "memory" );
+    }
+    return dest[0];
+}
+
+int fill_host( char * dest, int c, int n, int iterations )
+{
+    for ( int i = 0; i < iterations; ++i )
+        memset( dest, c, n );
+    return dest[0];
+}
+
+int length_guest( const char * s, int iterations )
+{
+    int ans = 0;
+    for ( int i = 0; i < iterations; ++i )
+    {
+        ans += guest_strlen( s );
+        asm volatile ( "" ::: "memory" ); // Do not hoist the pure call
+    }
+    return ans;
+}
+
+int length_host( const char * s, int iterations )
+{
+    int ans = 0;
+    for ( int i = 0; i < iterations; ++i )
+        ans += strlen( s );
+    return ans;
+}
@@ -0,0 +1,72 @@
+
+#ifndef E32_BENCH_BENCH_UTIL_H
+#define E32_BENCH_BENCH_UTIL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <x86intrin.h>
+
+#include <e32_libc.h>
+
+namespace bench
+{
+
+inline uint64_t rdtsc()
+{
+    _mm_lfence();
+    const uint64_t ans = __rdtsc();
+    _mm_lfence();
+    return ans;
+}
+
+/**
+ * @brief Run \ref f on the thread's guest stack.
+ */
+inline void on_guest_stack( std::function<void()> const & f )
+{
+    e32_thread_stack_jump( +[]( void * data )
+                           {
+                               (*reinterpret_cast< std::function<void()> const * >(data))();
+                           },
+                           const_cast< std::function<void()> * >(&f) );
+}
+
+/**
+ * @brief Sorted samples of the cycles per operation.
+ * @param f Runs one round of \ref ops operations
+ * @param ops Operations performed by each call of \ref f.
+ * @param rounds Number of samples
+ */
+inline std::vector< double > measure( std::function<void()> const & f, unsigned ops, unsigned rounds )
+{
+    std::vector< double > samples;
+    samples.reserve( rounds );
+
+    // Warm up
+    f();
+
+    for ( unsigned i = 0; i < rounds; ++i )
+    {
+        const uint64_t start = rdtsc();
+        f();
+        const uint64_t stop = rdtsc();
+
+        samples.push_back( double(stop - start) / ops );
+    }
+
+    std::sort( samples.begin(), samples.end() );
+
+    return samples;
+}
+
+inline double percentile( std::vector< double > const & samples, double p )
+{
+    return samples[ std::size_t( p * ( samples.size() - 1 ) ) ];
+}
+
+} //namespace bench
+
+#endif //E32_BENCH_BENCH_UTIL_H
@@ -0,0 +1,120 @@
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include <e32_libc.h>
+#include <loader.h>
+
+#include "bench_util.h"
+
+namespace
+{
+
+const unsigned rounds = 50;
+
+uint32_t get_symmemory( std::experimental::string_view name )
+{
+    if ( name == "memcpy" )
+    {
+        return e32_memcpy;
+    }
+
+    if ( name == "memset" )
+    {
+        return e32_memset;
+    }
+
+    if ( name == "strlen" )
+    {
+        return e32_strlen;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Median cycles per call of a guest loop \ref method( args..., iterations ).
+ */
+double cycles( e32_function_ptr method, std::vector< int > args, unsigned iterations )
+{
+    args.push_back( iterations );
+
+    double ans = 0;
+
+    bench::on_guest_stack( [&]
+    {
+        ans = bench::percentile( bench::measure( [&]
+                                                 {
+                                                     e32_enter32_iv( method, args.data(), args.size() );
+                                                 },
+                                                 iterations,
+                                                 rounds ),
+                                 0.5 );
+    } );
+
+    return ans;
+}
+
+/**
+ * @brief Enough calls to amortize the entry, without taking forever on large sizes.
+ */
+unsigned iterations_for( std::size_t size )
+{
+    return size < 4096 ? 1000 : std::max< std::size_t >( 4, 4 * 1024 * 1024 / size );
+}
+
+} //namespace
+
+int main( int argc, char ** argv )
+{
+    elf::loader loader( argc > 1 ? argv[1] : "32bit/libmemory_guest.so", get_symmemory );
+
+    const std::size_t max_size = 4 * 1024 * 1024;
+
+    char * src = static_cast<char*>( e32_heap_malloc( max_size + 1 ) );
+    char * dest = static_cast<char*>( e32_heap_malloc( max_size + 1 ) );
+
+    std::memset( src, 'x', max_size );
+    src[max_size] = '\0';
+
+    std::printf( "median cycles/call\n" );
+    std::printf( "%-10s %12s %12s %12s | %12s %12s | %12s %12s\n",
+                 "size", "memcpy rep", "memcpy sse2", "memcpy host", "memset rep", "memset host", "strlen guest", "strlen host" );
+
+    const e32_function_ptr copy_rep = loader.get_sym( "copy_rep" );
+    const e32_function_ptr copy_sse2 = loader.get_sym( "copy_sse2" );
+    const e32_function_ptr copy_host = loader.get_sym( "copy_host" );
+    const e32_function_ptr fill_rep = loader.get_sym( "fill_rep" );
+    const e32_function_ptr fill_host = loader.get_sym( "fill_host" );
+    const e32_function_ptr length_guest = loader.get_sym( "length_guest" );
+    const e32_function_ptr length_host = loader.get_sym( "length_host" );
+
+    for ( std::size_t size = 16; size <= max_size; size *= 4 )
+    {
+        const unsigned iterations = iterations_for( size );
+        const int n = int(size);
+
+        // A terminator at size for strlen
+        const char saved = src[size];
+        src[size] = '\0';
+
+        std::printf( "%-10zu %12.1f %12.1f %12.1f | %12.1f %12.1f | %12.1f %12.1f\n",
+                     size,
+                     cycles( copy_rep, { int(e32_ptr(dest)), int(e32_ptr(src)), n }, iterations ),
+                     cycles( copy_sse2, { int(e32_ptr(dest)), int(e32_ptr(src)), n }, iterations ),
+                     cycles( copy_host, { int(e32_ptr(dest)), int(e32_ptr(src)), n }, iterations ),
+                     cycles( fill_rep, { int(e32_ptr(dest)), 'y', n }, iterations ),
+                     cycles( fill_host, { int(e32_ptr(dest)), 'y', n }, iterations ),
+                     cycles( length_guest, { int(e32_ptr(src)) }, iterations ),
+                     cycles( length_host, { int(e32_ptr(src)) }, iterations ) );
+
+        src[size] = saved;
+    }
+
+    e32_heap_free( src );
+    e32_heap_free( dest );
+
+    return 0;
+}
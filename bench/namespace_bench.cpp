@@ -0,0 +1,117 @@
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <e32_libc.h>
+#include <loader.h>
+#include <symbol_namespace.h>
+
+namespace
+{
+
+const unsigned lookups = 1000000;
+
+uint32_t get_symbench( std::experimental::string_view )
+{
+    return 0;
+}
+
+/**
+ * @brief Lookups per second of \ref threads threads calling \ref find( names[i] ) concurrently.
+ */
+double throughput( unsigned threads,
+                   std::vector< std::string > const & names,
+                   std::function< uint32_t( std::experimental::string_view ) > const & find )
+{
+    std::atomic< unsigned > ready( 0 );
+    std::atomic< bool > go( false );
+    std::atomic< uint32_t > sink( 0 );
+    std::vector< std::thread > workers;
+
+    for ( unsigned t = 0; t < threads; ++t )
+    {
+        workers.emplace_back( [&, t]
+        {
+            ++ready;
+            while ( !go )
+            {
+                std::this_thread::yield();
+            }
+
+            uint32_t sum = 0;
+            for ( unsigned i = 0; i < lookups; ++i )
+            {
+                sum += find( names[ ( i + t ) % names.size() ] );
+            }
+            sink += sum;
+        } );
+    }
+
+    while ( ready < threads )
+    {
+        std::this_thread::yield();
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    go = true;
+
+    for ( std::thread & w : workers )
+    {
+        w.join();
+    }
+
+    const std::chrono::duration< double > elapsed = std::chrono::steady_clock::now() - start;
+
+    return threads * double(lookups) / elapsed.count();
+}
+
+} //namespace
+
+int main( int argc, char ** argv )
+{
+    elf::loader loader( argc > 1 ? argv[1] : "32bit/libbench_guest.so", get_symbench );
+
+    elf::symbol_namespace ns;
+    ns.add( "bench_guest", loader );
+
+    // What a host does without the namespace
+    std::mutex lock;
+    std::unordered_map< std::string, uint32_t > locked_map( loader.exports().begin(), loader.exports().end() );
+
+    std::vector< std::string > names;
+    for ( auto const & s : loader.exports() )
+    {
+        names.push_back( s.first );
+    }
+
+    const unsigned max_threads = std::max( 1u, std::thread::hardware_concurrency() );
+
+    std::printf( "million lookups/s\n" );
+    std::printf( "%-8s %12s %12s\n", "threads", "mutex map", "namespace" );
+
+    for ( unsigned threads = 1; threads <= max_threads; threads *= 2 )
+    {
+        const double mutex_rate = throughput( threads, names, [&]( std::experimental::string_view name ) -> uint32_t
+        {
+            std::lock_guard< std::mutex > guard( lock );
+            auto iter = locked_map.find( name.to_string() );
+            return iter != locked_map.end() ? iter->second : 0;
+        } );
+
+        const double ns_rate = throughput( threads, names, [&]( std::experimental::string_view name )
+        {
+            return ns.find( name );
+        } );
+
+        std::printf( "%-8u %12.1f %12.1f\n", threads, mutex_rate / 1e6, ns_rate / 1e6 );
+    }
+
+    return 0;
+}
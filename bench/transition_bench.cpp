@@ -0,0 +1,260 @@
+
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include <e32_libc.h>
+#include <loader.h>
+
+#include "bench_util.h"
+
+namespace
+{
+
+const unsigned rounds = 200;
+const unsigned iterations = 1000;
+
+int host_nop0() { return 0; }
+int host_nop1( int a ) { return a; }
+int host_nop2( int a, int ) { return a; }
+int host_nop3( int a, int, int ) { return a; }
+int host_nop4( int a, int, int, int ) { return a; }
+int host_nop6( int a, int, int, int, int, int ) { return a; }
+
+struct host_function
+{
+    const char * name;
+    void * target;
+    unsigned argc;
+    e32_function_ptr wrapper;
+};
+
+host_function host_functions[] =
+{
+    { "host_nop0", reinterpret_cast<void*>(&host_nop0), 0, 0 },
+    { "host_nop1", reinterpret_cast<void*>(&host_nop1), 1, 0 },
+    { "host_nop2", reinterpret_cast<void*>(&host_nop2), 2, 0 },
+    { "host_nop3", reinterpret_cast<void*>(&host_nop3), 3, 0 },
+    { "host_nop4", reinterpret_cast<void*>(&host_nop4), 4, 0 },
+    { "host_nop6", reinterpret_cast<void*>(&host_nop6), 6, 0 },
+};
+
+uint32_t get_symbench( std::experimental::string_view name )
+{
+    for ( const host_function & f : host_functions )
+    {
+        if ( name == f.name )
+        {
+            return f.wrapper;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Print the distribution of cycles per operation.
+ * @param name Label of the benchmark
+ * @param f Runs one round of \ref ops operations
+ * @param ops Operations performed by each call of \ref f.
+ */
+void report( const char * name, std::function<void()> const & f, unsigned ops )
+{
+    const std::vector< double > samples = bench::measure( f, ops, rounds );
+
+    auto percentile = [&samples]( double p ) { return bench::percentile( samples, p ); };
+
+    std::printf( "%-28s %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                 name,
+                 samples.front(),
+                 percentile(0.5),
+                 percentile(0.9),
+                 percentile(0.99),
+                 samples.back() );
+}
+
+} //namespace
+
+int main( int argc, char ** argv )
+{
+    for ( host_function & f : host_functions )
+    {
+        f.wrapper = e32_make_wrapper( f.target, f.argc );
+    }
+
+    elf::loader loader( argc > 1 ? argv[1] : "32bit/libbench_guest.so", get_symbench );
+
+    std::printf( "%-28s %10s %10s %10s %10s %10s\n", "cycles/op", "min", "p50", "p90", "p99", "max" );
+
+    // Stack switching
+    report( "e32_stack_jump",
+            []
+            {
+                for ( unsigned i = 0; i < iterations; ++i )
+                {
+                    e32_stack_jump( 64 * 1024, +[]( void * ) {}, nullptr );
+                }
+            },
+            iterations );
+
+    report( "e32_thread_stack_jump",
+            []
+            {
+                for ( unsigned i = 0; i < iterations; ++i )
+                {
+                    e32_thread_stack_jump( +[]( void * ) {}, nullptr );
+                }
+            },
+            iterations );
+
+    // 64->32->64
+    const e32_function_ptr nop1 = loader.get_sym("nop1");
+
+    bench::on_guest_stack( [nop1]
+    {
+        report( "e32_enter32_i",
+                [nop1]
+                {
+                    for ( unsigned i = 0; i < iterations; ++i )
+                    {
+                        e32_enter32_i( nop1, i );
+                    }
+                },
+                iterations );
+    } );
+
+    // 64->32->64 with every switch mechanism, * marks the selected one
+    const int selected = e32_switch_current();
+
+    for ( int m = 0; m < E32_SWITCH_COUNT; ++m )
+    {
+        char name[64];
+        std::snprintf( name, sizeof(name), "e32_enter32_i (%s%s)", e32_switch_name( m ), m == selected ? "*" : "" );
+
+        if ( e32_switch_select( m ) != 0 )
+        {
+            std::printf( "%-28s invalid on this machine\n", name );
+            continue;
+        }
+
+        bench::on_guest_stack( [&]
+        {
+            report( name,
+                    [nop1]
+                    {
+                        for ( unsigned i = 0; i < iterations; ++i )
+                        {
+                            e32_enter32_i( nop1, i );
+                        }
+                    },
+                    iterations );
+        } );
+    }
+
+    e32_switch_select( selected );
+
+    // 64->32, then a 32-bit loop over the inputs
+    bench::on_guest_stack( [nop1]
+    {
+        std::vector< int > args( iterations, 1 );
+        std::vector< int > results( iterations );
+
+        report( "e32_enter32_batch (1 arg)",
+                [nop1, &args, &results]
+                {
+                    e32_enter32_batch( nop1, args.data(), 1, results.data(), iterations );
+                },
+                iterations );
+    } );
+
+    const char * guest_nops[] = { "nop0", "nop1", "nop2", "nop3", "nop4", "nop6" };
+    const unsigned guest_argc[] = { 0, 1, 2, 3, 4, 6 };
+
+    for ( unsigned k = 0; k < sizeof(guest_nops) / sizeof(guest_nops[0]); ++k )
+    {
+        const e32_function_ptr method = loader.get_sym( guest_nops[k] );
+        const unsigned n = guest_argc[k];
+
+        char name[64];
+        std::snprintf( name, sizeof(name), "e32_enter32_iv (%u args)", n );
+
+        bench::on_guest_stack( [&]
+        {
+            report( name,
+                    [method, n]
+                    {
+                        const int args[6] = { 1, 2, 3, 4, 5, 6 };
+                        for ( unsigned i = 0; i < iterations; ++i )
+                        {
+                            e32_enter32_iv( method, args, n );
+                        }
+                    },
+                    iterations );
+        } );
+    }
+
+    // 32->64->32, amortized over a guest loop
+    const char * guest_loops[] = { "call_host0", "call_host1", "call_host2", "call_host3", "call_host4", "call_host6" };
+
+    for ( unsigned k = 0; k < sizeof(guest_loops) / sizeof(guest_loops[0]); ++k )
+    {
+        const e32_function_ptr method = loader.get_sym( guest_loops[k] );
+
+        char name[64];
+        std::snprintf( name, sizeof(name), "host thunk (%u args)", guest_argc[k] );
+
+        bench::on_guest_stack( [&]
+        {
+            report( name,
+                    [method]
+                    {
+                        e32_enter32_i( method, iterations );
+                    },
+                    iterations );
+        } );
+    }
+
+    // Submitted from this thread, run by an executor thread
+    e32_executor * executor = e32_executor_create( 1, 1024, nullptr );
+
+    if ( executor )
+    {
+        std::vector< e32_call > calls( iterations );
+
+        for ( e32_call & c : calls )
+        {
+            c = e32_call();
+            c.method = nop1;
+            c.argc = 1;
+        }
+
+        report( "executor (round trip)",
+                [executor, &calls]
+                {
+                    for ( e32_call & c : calls )
+                    {
+                        e32_executor_submit( executor, &c );
+                        e32_call_wait( &c );
+                    }
+                },
+                iterations );
+
+        report( "executor (pipelined)",
+                [executor, &calls]
+                {
+                    for ( e32_call & c : calls )
+                    {
+                        e32_executor_submit( executor, &c );
+                    }
+                    for ( e32_call & c : calls )
+                    {
+                        e32_call_wait( &c );
+                    }
+                },
+                iterations );
+
+        e32_executor_destroy( executor );
+    }
+
+    return 0;
+}
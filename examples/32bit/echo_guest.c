@@ -0,0 +1,33 @@
+
+// Resolved by the host, may suspend the calling fiber until fd is readable
+int guest_read( int fd, char * buf, int count );
+
+/**
+ * @brief Read \ref fd until end of file, written as plain blocking code.
+ * @return A checksum of the data, or -1 on error.
+ */
+int handle( int fd )
+{
+    char buf[256];
+    unsigned sum = 0;
+
+    for ( ;; )
+    {
+        const int n = guest_read( fd, buf, sizeof(buf) );
+
+        if ( n < 0 )
+        {
+            return -1;
+        }
+
+        if ( n == 0 )
+        {
+            return sum & 0x7fffffff;
+        }
+
+        for ( int i = 0; i < n; ++i )
+        {
+            sum = sum * 31 + (unsigned char)buf[i];
+        }
+    }
+}
@@ -0,0 +1,193 @@
+
+/*
+ * Serve many connections with one thread: every connection runs the
+ * blocking-style guest function handle(fd) on its own fiber, and the host
+ * implementation of guest_read parks the fiber on epoll instead of blocking.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <e32_libc.h>
+#include <loader.h>
+
+namespace
+{
+
+const int connections = 64;
+const int messages = 16;
+
+int epoll_fd = -1;
+
+struct connection
+{
+    e32_function_ptr handle;
+    int fd;
+    int result;
+    e32_fiber * fiber;
+};
+
+/**
+ * @brief Host side of guest_read, yields the current fiber until fd is readable.
+ */
+int guest_read( int fd, int buf, int count )
+{
+    for ( ;; )
+    {
+        const ssize_t n = read( fd, reinterpret_cast<void*>( uintptr_t( uint32_t( buf ) ) ), count );
+
+        if ( n >= 0 || errno != EAGAIN )
+        {
+            return n;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = e32_fiber_current();
+
+        if ( epoll_ctl( epoll_fd, EPOLL_CTL_MOD, fd, &ev ) != 0 &&
+             ( errno != ENOENT || epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &ev ) != 0 ) )
+        {
+            return -1;
+        }
+
+        if ( e32_fiber_yield() != 0 )
+        {
+            return -1;
+        }
+    }
+}
+
+e32_function_ptr guest_read_thunk;
+
+uint32_t get_symexample( std::experimental::string_view name )
+{
+    if ( name == "guest_read" )
+    {
+        return guest_read_thunk;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Resume the fibers whose file descriptor became readable.
+ */
+int dispatch( int timeout )
+{
+    epoll_event events[connections];
+
+    const int n = epoll_wait( epoll_fd, events, connections, timeout );
+
+    for ( int i = 0; i < n; ++i )
+    {
+        e32_fiber_resume( static_cast<e32_fiber*>( events[i].data.ptr ) );
+    }
+
+    return n;
+}
+
+} //namespace
+
+int main( int argc, char ** argv )
+{
+    guest_read_thunk = e32_make_wrapper( reinterpret_cast<void*>( &guest_read ), 3 );
+
+    elf::loader loader( argc > 1 ? argv[1] : "32bit/libecho_guest.so", get_symexample );
+
+    epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+
+    std::vector< connection > conns( connections );
+    std::vector< int > writers( connections );
+
+    for ( int i = 0; i < connections; ++i )
+    {
+        int fds[2];
+
+        if ( pipe2( fds, O_NONBLOCK | O_CLOEXEC ) != 0 )
+        {
+            std::perror( "pipe2" );
+            return 1;
+        }
+
+        writers[i] = fds[1];
+        conns[i] = connection{ loader.get_sym( "handle" ), fds[0], 0, nullptr };
+
+        conns[i].fiber = e32_fiber_create( +[]( void * data )
+                                           {
+                                               connection & c = *static_cast<connection*>(data);
+                                               c.result = e32_enter32_i( c.handle, c.fd );
+                                           },
+                                           &conns[i],
+                                           64 * 1024 );
+
+        // Runs until the first read would block
+        e32_fiber_resume( conns[i].fiber );
+    }
+
+    unsigned expected[connections] = {};
+
+    for ( int m = 0; m < messages; ++m )
+    {
+        for ( int i = 0; i < connections; ++i )
+        {
+            char line[64];
+            const int length = std::snprintf( line, sizeof(line), "message %d for connection %d\n", m, i );
+
+            if ( write( writers[i], line, length ) != length )
+            {
+                std::perror( "write" );
+                return 1;
+            }
+
+            for ( int k = 0; k < length; ++k )
+            {
+                expected[i] = expected[i] * 31 + static_cast<unsigned char>( line[k] );
+            }
+        }
+
+        while ( dispatch( 0 ) > 0 )
+        {
+        }
+    }
+
+    // End of file on every connection
+    for ( int w : writers )
+    {
+        close( w );
+    }
+
+    int running = connections;
+
+    while ( running > 0 && dispatch( -1 ) > 0 )
+    {
+        running = 0;
+        for ( const connection & c : conns )
+        {
+            running += !e32_fiber_done( c.fiber );
+        }
+    }
+
+    int failed = 0;
+
+    for ( int i = 0; i < connections; ++i )
+    {
+        failed += conns[i].result != int( expected[i] & 0x7fffffff );
+
+        e32_fiber_destroy( conns[i].fiber );
+        close( conns[i].fd );
+    }
+
+    std::printf( "%d connections, %d messages each, %d mismatched\n", connections, messages, failed );
+
+    close( epoll_fd );
+
+    return failed != 0;
+}
@@ -0,0 +1,332 @@
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "e32_libc.h"
+
+#define S_E32_BUFFER_HEAP   0
+#define S_E32_BUFFER_MAPPED 1
+
+#define S_E32_ARENA_ALIGN   16
+
+/**
+ * @brief Header right before the data of every buffer
+ */
+struct __attribute__((aligned(16))) s_e32_buffer
+{
+    uint32_t refs;
+    uint32_t kind;
+    size_t size;
+};
+
+/**
+ * @brief A block of memory an arena allocates from
+ */
+struct s_e32_arena_chunk
+{
+    struct s_e32_arena_chunk * next;
+    size_t capacity;
+};
+
+struct e32_arena
+{
+    struct s_e32_arena_chunk * chunks;
+    char * top;
+    char * end;
+    size_t chunk_size;
+};
+
+static __thread struct e32_arena * e32_scratch;
+
+static pthread_key_t e32_scratch_key;
+static pthread_once_t e32_scratch_once = PTHREAD_ONCE_INIT;
+
+static struct s_e32_buffer * s_e32_buffer_header( const void * buffer )
+{
+    return (struct s_e32_buffer *)buffer - 1;
+}
+
+void * e32_buffer_alloc( size_t size )
+{
+    if ( size > SIZE_MAX - sizeof(struct s_e32_buffer) )
+    {
+        return NULL;
+    }
+
+    struct s_e32_buffer * header = e32_heap_malloc( sizeof(struct s_e32_buffer) + size );
+
+    if ( !header )
+    {
+        return NULL;
+    }
+
+    header->refs = 1;
+    header->kind = S_E32_BUFFER_HEAP;
+    header->size = size;
+
+    return header + 1;
+}
+
+void * e32_buffer_ref( void * buffer )
+{
+    __atomic_add_fetch( &s_e32_buffer_header( buffer )->refs, 1, __ATOMIC_RELAXED );
+    return buffer;
+}
+
+void e32_buffer_unref( void * buffer )
+{
+    if ( !buffer )
+    {
+        return;
+    }
+
+    struct s_e32_buffer * header = s_e32_buffer_header( buffer );
+
+    if ( __atomic_sub_fetch( &header->refs, 1, __ATOMIC_ACQ_REL ) != 0 )
+    {
+        return;
+    }
+
+    if ( header->kind == S_E32_BUFFER_MAPPED )
+    {
+        // The header sits at the end of the page preceding the file
+        const size_t pagesize = getpagesize();
+        munmap( (char*)buffer - pagesize, pagesize + header->size );
+    }
+    else
+    {
+        e32_heap_free( header );
+    }
+}
+
+size_t e32_buffer_size( const void * buffer )
+{
+    return s_e32_buffer_header( buffer )->size;
+}
+
+void * e32_buffer_map( int fd, size_t * size )
+{
+    struct stat st;
+
+    if ( fstat( fd, &st ) != 0 )
+    {
+        return NULL;
+    }
+
+    const size_t pagesize = getpagesize();
+    const size_t length = st.st_size;
+
+    // Reserve one page for the header, followed by the file
+    char * p = mmap( NULL, pagesize + length,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_32BIT | MAP_ANONYMOUS,
+                     -1, 0 );
+
+    if ( p == MAP_FAILED )
+    {
+        return NULL;
+    }
+
+    if ( length > 0 &&
+         mmap( p + pagesize, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0 ) == MAP_FAILED )
+    {
+        munmap( p, pagesize + length );
+        return NULL;
+    }
+
+    char * buffer = p + pagesize;
+
+    struct s_e32_buffer * header = s_e32_buffer_header( buffer );
+    header->refs = 1;
+    header->kind = S_E32_BUFFER_MAPPED;
+    header->size = length;
+
+    if ( size )
+    {
+        *size = length;
+    }
+
+    return buffer;
+}
+
+ssize_t e32_buffer_read( int fd, void * buffer, size_t offset, size_t count )
+{
+    char * dest = (char*)buffer + offset;
+    size_t done = 0;
+
+    while ( done < count )
+    {
+        const ssize_t n = read( fd, dest + done, count - done );
+
+        if ( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+
+        if ( n < 0 )
+        {
+            return -1;
+        }
+
+        if ( n == 0 )
+        {
+            break;
+        }
+
+        done += n;
+    }
+
+    return done;
+}
+
+/**
+ * @brief Add a chunk of at least \ref size usable bytes to \ref arena.
+ */
+static int s_e32_arena_grow( struct e32_arena * arena, size_t size )
+{
+    const size_t header = ( sizeof(struct s_e32_arena_chunk) + S_E32_ARENA_ALIGN - 1 ) & ~(size_t)(S_E32_ARENA_ALIGN - 1);
+    const size_t capacity = size > arena->chunk_size ? size : arena->chunk_size;
+
+    if ( capacity > SIZE_MAX - header )
+    {
+        return -1;
+    }
+
+    struct s_e32_arena_chunk * chunk = e32_heap_malloc( header + capacity );
+
+    if ( !chunk )
+    {
+        return -1;
+    }
+
+    chunk->next = arena->chunks;
+    chunk->capacity = capacity;
+    arena->chunks = chunk;
+
+    arena->top = (char*)chunk + header;
+    arena->end = arena->top + capacity;
+
+    return 0;
+}
+
+struct e32_arena * e32_arena_create( size_t chunk_size )
+{
+    struct e32_arena * arena = calloc( 1, sizeof(*arena) );
+
+    if ( !arena )
+    {
+        return NULL;
+    }
+
+    arena->chunk_size = chunk_size;
+
+    return arena;
+}
+
+void * e32_arena_alloc( struct e32_arena * arena, size_t size )
+{
+    if ( size > SIZE_MAX - S_E32_ARENA_ALIGN )
+    {
+        return NULL;
+    }
+
+    // An empty allocation still gets its own address, in a chunk
+    size = size ? ( size + S_E32_ARENA_ALIGN - 1 ) & ~(size_t)(S_E32_ARENA_ALIGN - 1) : S_E32_ARENA_ALIGN;
+
+    if ( (size_t)( arena->end - arena->top ) < size && s_e32_arena_grow( arena, size ) != 0 )
+    {
+        return NULL;
+    }
+
+    void * ans = arena->top;
+    arena->top += size;
+
+    return ans;
+}
+
+void e32_arena_reset( struct e32_arena * arena )
+{
+    if ( !arena->chunks )
+    {
+        return;
+    }
+
+    // Keep the most recent chunk
+    struct s_e32_arena_chunk * chunk = arena->chunks->next;
+
+    while ( chunk )
+    {
+        struct s_e32_arena_chunk * next = chunk->next;
+        e32_heap_free( chunk );
+        chunk = next;
+    }
+
+    arena->chunks->next = NULL;
+    arena->top = arena->end - arena->chunks->capacity;
+}
+
+void e32_arena_destroy( struct e32_arena * arena )
+{
+    if ( !arena )
+    {
+        return;
+    }
+
+    struct s_e32_arena_chunk * chunk = arena->chunks;
+
+    while ( chunk )
+    {
+        struct s_e32_arena_chunk * next = chunk->next;
+        e32_heap_free( chunk );
+        chunk = next;
+    }
+
+    free( arena );
+}
+
+/**
+ * @brief Release the scratch arena of an exiting thread
+ */
+static void s_e32_scratch_release( void * arena )
+{
+    e32_arena_destroy( arena );
+    e32_scratch = NULL;
+}
+
+static void s_e32_scratch_key_init()
+{
+    pthread_key_create( &e32_scratch_key, &s_e32_scratch_release );
+}
+
+void * e32_scratch_alloc( size_t size )
+{
+    if ( !e32_scratch )
+    {
+        pthread_once( &e32_scratch_once, &s_e32_scratch_key_init );
+
+        e32_scratch = e32_arena_create( 64 * 1024 );
+
+        if ( !e32_scratch )
+        {
+            return NULL;
+        }
+
+        pthread_setspecific( e32_scratch_key, e32_scratch );
+    }
+
+    return e32_arena_alloc( e32_scratch, size );
+}
+
+void e32_scratch_reset()
+{
+    if ( e32_scratch )
+    {
+        e32_arena_reset( e32_scratch );
+    }
+}
@@ -0,0 +1,455 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "e32_counters.h"
+#include "e32_libc.h"
+
+// Guest functions per table, calls to functions beyond that are not counted
+#define S_E32_COUNTERS_SLOTS 1024
+
+struct s_e32_counters_entry
+{
+    e32_function_ptr method; ///< 0 while the slot is free
+    unsigned available;
+    uint64_t calls;
+    uint64_t tsc;
+    uint64_t counters[E32_COUNTER_COUNT];
+};
+
+/**
+ * @brief Counters of one thread, only written by that thread
+ */
+struct s_e32_counters_thread
+{
+    struct s_e32_counters_entry entries[S_E32_COUNTERS_SLOTS];
+
+    int fds[E32_COUNTER_COUNT];
+    struct perf_event_mmap_page * pages[E32_COUNTER_COUNT]; ///< NULL if the counter can not be mapped
+    unsigned available;
+
+    struct s_e32_counters_thread * prev;
+    struct s_e32_counters_thread * next;
+};
+
+int e32_counters_on;
+
+// Live threads, and counters of the exited ones
+static struct s_e32_counters_thread * e32_counters_threads;
+static struct s_e32_counters_entry e32_counters_totals[S_E32_COUNTERS_SLOTS];
+
+static pthread_mutex_t e32_counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t e32_counters_once = PTHREAD_ONCE_INIT;
+
+static __thread struct s_e32_counters_thread * e32_counters_thread;
+static pthread_key_t e32_counters_thread_key;
+
+/**
+ * @brief perf_event_attr type and config of each counter.
+ */
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} s_e32_counters_events[E32_COUNTER_COUNT] =
+{
+    [E32_COUNTER_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [E32_COUNTER_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [E32_COUNTER_LLC_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [E32_COUNTER_ITLB_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB |
+                                                      PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                                      PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+};
+
+static unsigned s_e32_counters_slot( e32_function_ptr method )
+{
+    // Fibonacci hashing, functions are at least 16 bytes apart
+    return (unsigned)( ( (uint64_t)method >> 4 ) * 0x9e3779b97f4a7c15ull >> 54 ) & ( S_E32_COUNTERS_SLOTS - 1 );
+}
+
+/**
+ * @brief Entry of \ref method in \ref table, claimed with \ref available if it is not there yet.
+ * @return NULL if the table is full.
+ */
+static struct s_e32_counters_entry * s_e32_counters_find( struct s_e32_counters_entry * table,
+                                                          e32_function_ptr method,
+                                                          unsigned available )
+{
+    unsigned slot = s_e32_counters_slot( method );
+
+    for ( unsigned i = 0; i < S_E32_COUNTERS_SLOTS; ++i, slot = ( slot + 1 ) & ( S_E32_COUNTERS_SLOTS - 1 ) )
+    {
+        struct s_e32_counters_entry * entry = &table[slot];
+
+        if ( entry->method == method )
+        {
+            return entry;
+        }
+
+        if ( !entry->method )
+        {
+            entry->available = available;
+
+            // Published last, e32_counters_snapshot may be reading the table
+            __atomic_store_n( &entry->method, method, __ATOMIC_RELEASE );
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Add \ref src to the totals of the same function in \ref dest.
+ */
+static void s_e32_counters_merge( struct s_e32_counters_entry * dest, const struct s_e32_counters_entry * src )
+{
+    const e32_function_ptr method = __atomic_load_n( &src->method, __ATOMIC_ACQUIRE );
+
+    if ( !method )
+    {
+        return;
+    }
+
+    struct s_e32_counters_entry * entry = s_e32_counters_find( dest, method, src->available );
+
+    if ( !entry )
+    {
+        return;
+    }
+
+    entry->available &= src->available;
+    entry->calls += __atomic_load_n( &src->calls, __ATOMIC_RELAXED );
+    entry->tsc += __atomic_load_n( &src->tsc, __ATOMIC_RELAXED );
+
+    for ( unsigned k = 0; k < E32_COUNTER_COUNT; ++k )
+    {
+        entry->counters[k] += __atomic_load_n( &src->counters[k], __ATOMIC_RELAXED );
+    }
+}
+
+/**
+ * @brief Close the counters of an exiting thread, after adding them to the totals.
+ */
+static void s_e32_counters_thread_release( void * data )
+{
+    struct s_e32_counters_thread * thread = data;
+
+    pthread_mutex_lock( &e32_counters_lock );
+
+    for ( unsigned i = 0; i < S_E32_COUNTERS_SLOTS; ++i )
+    {
+        s_e32_counters_merge( e32_counters_totals, &thread->entries[i] );
+    }
+
+    if ( thread->prev )
+    {
+        thread->prev->next = thread->next;
+    }
+    else
+    {
+        e32_counters_threads = thread->next;
+    }
+
+    if ( thread->next )
+    {
+        thread->next->prev = thread->prev;
+    }
+
+    pthread_mutex_unlock( &e32_counters_lock );
+
+    for ( unsigned k = 0; k < E32_COUNTER_COUNT; ++k )
+    {
+        if ( thread->pages[k] )
+        {
+            munmap( thread->pages[k], sysconf( _SC_PAGESIZE ) );
+        }
+
+        if ( thread->fds[k] >= 0 )
+        {
+            close( thread->fds[k] );
+        }
+    }
+
+    free( thread );
+    e32_counters_thread = NULL;
+}
+
+/**
+ * @brief E32_COUNTERS=1 in the environment measures the guest calls from the start.
+ */
+static void s_e32_counters_init()
+{
+    pthread_key_create( &e32_counters_thread_key, &s_e32_counters_thread_release );
+
+    const char * env = getenv( "E32_COUNTERS" );
+
+    if ( env && strcmp( env, "1" ) == 0 )
+    {
+        __atomic_store_n( &e32_counters_on, 1, __ATOMIC_RELAXED );
+    }
+}
+
+// The calls check e32_counters_on alone, so the environment is read before any of them
+__attribute__((constructor)) static void s_e32_counters_startup()
+{
+    pthread_once( &e32_counters_once, &s_e32_counters_init );
+}
+
+void e32_counters_enable()
+{
+    pthread_once( &e32_counters_once, &s_e32_counters_init );
+    __atomic_store_n( &e32_counters_on, 1, __ATOMIC_RELAXED );
+}
+
+void e32_counters_disable()
+{
+    pthread_once( &e32_counters_once, &s_e32_counters_init );
+    __atomic_store_n( &e32_counters_on, 0, __ATOMIC_RELAXED );
+}
+
+int e32_counters_enabled()
+{
+    pthread_once( &e32_counters_once, &s_e32_counters_init );
+    return __atomic_load_n( &e32_counters_on, __ATOMIC_RELAXED );
+}
+
+/**
+ * @brief Open a user space counter of the calling thread.
+ *
+ * Each counter is opened on its own rather than as a group, so that the
+ * ones the PMU or perf_event_paranoid refuse do not take the others down.
+ * @return 0 on success, -1 if the counter is not available.
+ */
+static int s_e32_counters_open( struct s_e32_counters_thread * thread, unsigned k )
+{
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+
+    attr.size = sizeof(attr);
+    attr.type = s_e32_counters_events[k].type;
+    attr.config = s_e32_counters_events[k].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    const int fd = (int)syscall( SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC );
+
+    if ( fd < 0 )
+    {
+        return -1;
+    }
+
+    thread->fds[k] = fd;
+
+    // The first page tells whether rdpmc is allowed, and which hardware counter to read
+    void * page = mmap( NULL, sysconf( _SC_PAGESIZE ), PROT_READ, MAP_SHARED, fd, 0 );
+
+    thread->pages[k] = page == MAP_FAILED ? NULL : page;
+
+    return 0;
+}
+
+static struct s_e32_counters_thread * s_e32_counters_thread()
+{
+    if ( e32_counters_thread )
+    {
+        return e32_counters_thread;
+    }
+
+    pthread_once( &e32_counters_once, &s_e32_counters_init );
+
+    struct s_e32_counters_thread * thread = calloc( 1, sizeof(*thread) );
+
+    if ( !thread )
+    {
+        return NULL;
+    }
+
+    for ( unsigned k = 0; k < E32_COUNTER_COUNT; ++k )
+    {
+        thread->fds[k] = -1;
+
+        if ( s_e32_counters_open( thread, k ) == 0 )
+        {
+            thread->available |= 1u << k;
+        }
+    }
+
+    pthread_mutex_lock( &e32_counters_lock );
+
+    thread->next = e32_counters_threads;
+    if ( e32_counters_threads )
+    {
+        e32_counters_threads->prev = thread;
+    }
+    e32_counters_threads = thread;
+
+    pthread_mutex_unlock( &e32_counters_lock );
+
+    pthread_setspecific( e32_counters_thread_key, thread );
+
+    return e32_counters_thread = thread;
+}
+
+unsigned e32_counters_available()
+{
+    const struct s_e32_counters_thread * thread = s_e32_counters_thread();
+
+    return thread ? thread->available : 0;
+}
+
+/**
+ * @brief Current value of counter \ref k, with rdpmc if the kernel lets user space read it.
+ */
+static uint64_t s_e32_counters_read( const struct s_e32_counters_thread * thread, unsigned k )
+{
+    const struct perf_event_mmap_page * page = thread->pages[k];
+
+    while ( page )
+    {
+        // The kernel bumps lock around every update of the page
+        const uint32_t seq = __atomic_load_n( &page->lock, __ATOMIC_ACQUIRE );
+        const uint32_t index = page->index;
+
+        if ( !page->cap_user_rdpmc || index == 0 )
+        {
+            break;
+        }
+
+        const unsigned shift = 64 - page->pmc_width;
+        const int64_t pmc = (int64_t)( __rdpmc( index - 1 ) << shift ) >> shift;
+        const uint64_t value = page->offset + pmc;
+
+        __atomic_signal_fence( __ATOMIC_SEQ_CST );
+
+        if ( __atomic_load_n( &page->lock, __ATOMIC_ACQUIRE ) == seq )
+        {
+            return value;
+        }
+    }
+
+    uint64_t value = 0;
+
+    if ( read( thread->fds[k], &value, sizeof(value) ) != sizeof(value) )
+    {
+        return 0;
+    }
+
+    return value;
+}
+
+void e32_counters_begin( struct e32_counters_sample * start )
+{
+    const struct s_e32_counters_thread * thread = s_e32_counters_thread();
+
+    for ( unsigned k = 0; k < E32_COUNTER_COUNT; ++k )
+    {
+        start->counters[k] = thread && ( thread->available & ( 1u << k ) ) ? s_e32_counters_read( thread, k ) : 0;
+    }
+
+    // Last, so that reading the counters is not timed
+    start->tsc = __rdtsc();
+}
+
+/**
+ * @brief Add to a counter of the current thread, read concurrently by e32_counters_snapshot.
+ */
+static void s_e32_counters_count( uint64_t * counter, uint64_t value )
+{
+    __atomic_store_n( counter, *counter + value, __ATOMIC_RELAXED );
+}
+
+void e32_counters_end( e32_function_ptr method, const struct e32_counters_sample * start, uint64_t calls )
+{
+    const uint64_t tsc = __rdtsc() - start->tsc;
+
+    struct s_e32_counters_thread * thread = e32_counters_thread;
+
+    if ( !thread )
+    {
+        return;
+    }
+
+    uint64_t counters[E32_COUNTER_COUNT];
+
+    for ( unsigned k = 0; k < E32_COUNTER_COUNT; ++k )
+    {
+        counters[k] = thread->available & ( 1u << k ) ? s_e32_counters_read( thread, k ) - start->counters[k] : 0;
+    }
+
+    struct s_e32_counters_entry * entry = s_e32_counters_find( thread->entries, method, thread->available );
+
+    if ( !entry )
+    {
+        return;
+    }
+
+    s_e32_counters_count( &entry->calls, calls );
+    s_e32_counters_count( &entry->tsc, tsc );
+
+    for ( unsigned k = 0; k < E32_COUNTER_COUNT; ++k )
+    {
+        s_e32_counters_count( &entry->counters[k], counters[k] );
+    }
+}
+
+size_t e32_counters_snapshot( struct e32_counters_stats * stats, size_t max )
+{
+    struct s_e32_counters_entry * table = calloc( S_E32_COUNTERS_SLOTS, sizeof(*table) );
+
+    if ( !table )
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock( &e32_counters_lock );
+
+    for ( unsigned i = 0; i < S_E32_COUNTERS_SLOTS; ++i )
+    {
+        s_e32_counters_merge( table, &e32_counters_totals[i] );
+
+        for ( const struct s_e32_counters_thread * thread = e32_counters_threads; thread; thread = thread->next )
+        {
+            s_e32_counters_merge( table, &thread->entries[i] );
+        }
+    }
+
+    pthread_mutex_unlock( &e32_counters_lock );
+
+    size_t n = 0;
+
+    for ( unsigned i = 0; i < S_E32_COUNTERS_SLOTS; ++i )
+    {
+        const struct s_e32_counters_entry * entry = &table[i];
+
+        if ( !entry->method )
+        {
+            continue;
+        }
+
+        if ( n < max )
+        {
+            stats[n].method = entry->method;
+            stats[n].calls = entry->calls;
+            stats[n].tsc = entry->tsc;
+            memcpy( stats[n].counters, entry->counters, sizeof(stats[n].counters) );
+            stats[n].available = entry->available;
+        }
+
+        ++n;
+    }
+
+    free( table );
+
+    return n;
+}
@@ -0,0 +1,47 @@
+
+#ifndef E32LIBC_E32_COUNTERS_H
+#define E32LIBC_E32_COUNTERS_H
+
+#include <stdint.h>
+
+#include "e32_libc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+/**
+ * @brief Values of the counters when a guest call starts.
+ */
+struct e32_counters_sample
+{
+    uint64_t tsc;
+    uint64_t counters[E32_COUNTER_COUNT];
+};
+
+extern int e32_counters_on;
+
+/**
+ * @return Non-zero if guest calls must be measured.
+ */
+static inline int e32_counters_active()
+{
+    return __atomic_load_n( &e32_counters_on, __ATOMIC_RELAXED );
+}
+
+/**
+ * @brief Read the counters of the calling thread, opening them on first use.
+ */
+void e32_counters_begin( struct e32_counters_sample * start );
+
+/**
+ * @brief Attribute the counts since \ref start to \ref method.
+ * @param calls Number of guest calls made since \ref start
+ */
+void e32_counters_end( e32_function_ptr method, const struct e32_counters_sample * start, uint64_t calls );
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif //E32LIBC_E32_COUNTERS_H
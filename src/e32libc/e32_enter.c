@@ -1,32 +1,35 @@
+
 #include <stddef.h>
+#include <string.h>
 
-#include <sys/mman.h>
+#include <pthread.h>
 #include <sys/personality.h>
 
+#include "e32_counters.h"
 #include "e32_libc.h"
+#include "e32_stack.h"
+#include "e32_switch.h"
+#include "e32_tls.h"
 
-int e32_stack_jump( size_t stack_size, void (*f)(void*), void * param )
-{
-    void * stack = mmap(NULL, 
-                        stack_size,
-                        PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE | MAP_32BIT | MAP_ANONYMOUS,
-                        -1, 0 );
+// Per-thread guest stack, allocated on first use
+static __thread void * e32_thread_stack;
+static __thread int e32_thread_stack_busy;
 
-    if ( !stack )
-    {
-        return -1;
-    }
-    
-    void * stack_base = (char*)stack + stack_size;
+static pthread_key_t e32_thread_stack_key;
+static pthread_once_t e32_thread_stack_once = PTHREAD_ONCE_INIT;
 
-    asm ( 
+/**
+ * @brief Call f(param) with the stack pointer set to \ref stack_base.
+ */
+static void s_e32_stack_call( void * stack_base, void (*f)(void*), void * param )
+{
+    asm volatile (
         "mov %%rsp, %%rdx\n\t" //save old RSP
         "mov %2, %%rsp\n\t" // Replace stack
-          
+
         "push %%rdx\n\t"
         "push %%rbp\n\t" // Save some stuff
-        
+
         "mov %1, %%rdi\n\t" // Load param
         "call *%0\n\t" // Call f(param)
 
@@ -35,49 +38,543 @@ int e32_stack_jump( size_t stack_size, void (*f)(void*), void * param )
         :
         :
         "r"(f), "r"(param), "r"(stack_base) :
-        "rdx", "rsp", "rdi"  );
+        "rax", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "memory", "cc" );
+}
+
+int e32_stack_jump( size_t stack_size, void (*f)(void*), void * param )
+{
+    void * stack = e32_stack_alloc( stack_size );
+
+    if ( !stack )
+    {
+        return -1;
+    }
+
+    s_e32_stack_call( (char*)stack + stack_size, f, param );
+
+    e32_stack_free( stack, stack_size );
 
-    munmap(stack, stack_size);
-    
     return 0;
 }
 
-int e32_enter32_i(e32_function_ptr method, int arg0)
-{        
-    struct __attribute__((packed, aligned(16))) {
-        uint32_t address;
-        int16_t segment;
-    } target = {method, 0x23};
-
-//     const unsigned long prev_pers = personality(PER_LINUX32);
-    int ret;
-
-    asm (       
-          "movl (%1), %%edi\n\t"            //Save address in EDI  
-          "movl $trampoline%=, (%1)\n\t"      // Replace address in "target" 
-          "mov %2, %%esi\n\t"               // Mov arg0 into esi.
-          "lcall *(%1)\n\t"                 // Call the trampoline.
-          "jmp exit%=\n\t"                    // On return jump to the end
-          
-          "trampoline%=:\n\t"         // trampoline
-          
-          ".byte 0x56\n\t" // push esi
-          ".byte 0x56\n\t" // push esi
-          ".byte 0x56\n\t" // push esi
-          ".byte 0x56\n\t" // push esi
-          
-          "callq *%%rdi\n\t"
-          ".byte 0x83, 0xc4, 0x10\n\t" // add $0x10, %esp
-          "lret\n\t"
-          
-          "exit%=:\n\t"
-        : 
-        "=a"(ret)
-        :
-        "r"(&target), "r"(arg0)
-        :
-        "rsi", "rdi", "memory" );
-    
-//     personality(prev_pers);
-    return ret;
+/**
+ * @brief Release the guest stack of an exiting thread
+ */
+static void s_e32_thread_stack_release( void * stack )
+{
+    e32_stack_free( stack, E32_THREAD_STACK_SIZE );
+}
+
+static void s_e32_thread_stack_key_init()
+{
+    pthread_key_create( &e32_thread_stack_key, &s_e32_thread_stack_release );
+}
+
+int e32_thread_stack_jump( void (*f)(void*), void * param )
+{
+    if ( e32_thread_stack_busy )
+    {
+        // Already running on this thread's guest stack
+        f( param );
+        return 0;
+    }
+
+    if ( !e32_thread_stack )
+    {
+        pthread_once( &e32_thread_stack_once, &s_e32_thread_stack_key_init );
+
+        e32_thread_stack = e32_stack_alloc( E32_THREAD_STACK_SIZE );
+
+        if ( !e32_thread_stack )
+        {
+            return -1;
+        }
+
+        pthread_setspecific( e32_thread_stack_key, e32_thread_stack );
+    }
+
+    e32_thread_stack_busy = 1;
+    s_e32_stack_call( (char*)e32_thread_stack + E32_THREAD_STACK_SIZE, f, param );
+    e32_thread_stack_busy = 0;
+
+    return 0;
+}
+
+/*
+ * Far transfers to the 32-bit code segment and back. Every mechanism leaves
+ * the stack in the same state on entry, a 32-bit far return frame to the
+ * exit label as pushed by lcall, so the trampolines are shared and only
+ * the instructions that switch mode differ. The exit label must be in the
+ * low 4GB, like the trampolines.
+ *
+ * The ENTER sequences can use %r11 as scratch, and preserve the registers
+ * that are visible in 32-bit mode. LEAVE runs in 32-bit mode.
+ */
+
+// A 32-bit far return frame to the exit label
+#define S_E32_SWITCH_FRAME \
+    "sub $8, %%rsp\n\t" \
+    "movl $exit%=, (%%rsp)\n\t" \
+    "movl $0x33, 4(%%rsp)\n\t"
+
+// lcall through the memory operand, lret
+#define S_E32_SWITCH_LCALL_ENTER \
+    "lcall *(%[target])\n\t"
+
+#define S_E32_SWITCH_LRET_LEAVE \
+    "lretl\n\t"
+
+// ljmp through the memory operand, direct ljmp back to the exit label
+#define S_E32_SWITCH_LJMP_ENTER \
+    "sub $8, %%rsp\n\t" \
+    "ljmp *(%[target])\n\t"
+
+#define S_E32_SWITCH_LJMP_LEAVE \
+    ".byte 0x83, 0xc4, 0x08\n\t" /* add $8, %esp */ \
+    ".byte 0xea\n\t" /* ljmp $0x33, $exit */ \
+    ".long exit%=\n\t" \
+    ".word 0x33\n\t"
+
+// Far frame of the trampoline pushed by hand, lretq
+#define S_E32_SWITCH_LRETQ_ENTER \
+    S_E32_SWITCH_FRAME \
+    "pushq $0x23\n\t" \
+    "movl (%[target]), %%r11d\n\t" \
+    "push %%r11\n\t" \
+    "lretq\n\t"
+
+// Interrupt frame of the trampoline pushed by hand, iretq
+#define S_E32_SWITCH_IRETQ_ENTER \
+    S_E32_SWITCH_FRAME \
+    "mov %%ss, %%r11d\n\t" \
+    "push %%r11\n\t" \
+    "lea 8(%%rsp), %%r11\n\t" \
+    "push %%r11\n\t" \
+    "pushfq\n\t" \
+    "pushq $0x23\n\t" \
+    "movl (%[target]), %%r11d\n\t" \
+    "push %%r11\n\t" \
+    "iretq\n\t"
+
+#define S_E32_ENTER32_I( mechanism, ENTER, LEAVE ) \
+static int s_e32_enter32_i_##mechanism( e32_function_ptr method, int arg0 ) \
+{ \
+    struct __attribute__((packed, aligned(16))) { \
+        uint32_t address; \
+        int16_t segment; \
+    } target = {method, 0x23}; \
+ \
+    int ret; \
+ \
+    asm volatile ( \
+          "lea -128(%%rsp), %%rsp\n\t"      /* Skip the red zone */ \
+          "movl (%[target]), %%edi\n\t"     /* Save address in EDI */ \
+          "movl $trampoline%=, (%[target])\n\t" /* Replace address in "target" */ \
+          "mov %[arg0], %%esi\n\t"          /* Mov arg0 into esi. */ \
+          ENTER                             /* Switch to the trampoline. */ \
+          "jmp exit%=\n\t"                  /* On return jump to the end */ \
+ \
+          "trampoline%=:\n\t" \
+ \
+          ".byte 0x16, 0x1f\n\t" /* push ss; pop ds */ \
+          ".byte 0x16, 0x07\n\t" /* push ss; pop es */ \
+          ".byte 0x56\n\t" /* push esi */ \
+          ".byte 0x56\n\t" /* push esi */ \
+          ".byte 0x56\n\t" /* push esi */ \
+          ".byte 0x56\n\t" /* push esi */ \
+ \
+          "callq *%%rdi\n\t" \
+          ".byte 0x83, 0xc4, 0x10\n\t" /* add $0x10, %esp */ \
+          LEAVE \
+ \
+          "exit%=:\n\t" \
+          "lea 128(%%rsp), %%rsp\n\t" \
+        : \
+        "=&a"(ret) \
+        : \
+        [target]"r"(&target), [arg0]"r"(arg0) \
+        : \
+        "rbx", "rcx", "rdx", "rsi", "rdi", "r11", "memory", "cc" ); \
+ \
+    return ret; \
+}
+
+#define S_E32_ENTER32_IV( mechanism, ENTER, LEAVE ) \
+static int s_e32_enter32_iv_##mechanism( e32_function_ptr method, const int * args, unsigned argc ) \
+{ \
+    struct __attribute__((packed, aligned(16))) { \
+        uint32_t address; \
+        int16_t segment; \
+    } target = {method, 0x23}; \
+ \
+    int ret; \
+ \
+    asm volatile ( \
+          "lea -128(%%rsp), %%rsp\n\t"      /* Skip the red zone */ \
+          "push %%rbp\n\t" \
+          "mov %%rsp, %%r12\n\t"            /* Save RSP */ \
+ \
+          "movl (%[target]), %%ebx\n\t"     /* Save address in EBX */ \
+          "movl $trampoline%=, (%[target])\n\t" /* Replace address in "target" */ \
+ \
+          "mov %[argc], %%ecx\n\t"          /* Reserve 16-byte aligned room for the arguments */ \
+          "lea (,%%rcx,4), %%rax\n\t" \
+          "sub %%rax, %%rsp\n\t" \
+          "and $-16, %%rsp\n\t" \
+          "mov %[args], %%rsi\n\t"          /* Copy the arguments */ \
+          "mov %%rsp, %%rdi\n\t" \
+          "rep movsl\n\t" \
+ \
+          ENTER                             /* Switch to the trampoline. */ \
+          "jmp exit%=\n\t"                  /* On return jump to the end */ \
+ \
+          "trampoline%=:\n\t" \
+ \
+          ".byte 0x16, 0x1f\n\t" /* push ss; pop ds */ \
+          ".byte 0x16, 0x07\n\t" /* push ss; pop es */ \
+          ".byte 0x5f\n\t" /* pop edi (return address) */ \
+          ".byte 0x5e\n\t" /* pop esi (return segment) */ \
+ \
+          "callq *%%rbx\n\t"                /* call *%ebx, the arguments are on top of the stack */ \
+ \
+          ".byte 0x56\n\t" /* push esi */ \
+          ".byte 0x57\n\t" /* push edi */ \
+          LEAVE \
+ \
+          "exit%=:\n\t" \
+          "mov %%r12, %%rsp\n\t" \
+          "pop %%rbp\n\t" \
+          "lea 128(%%rsp), %%rsp\n\t" \
+        : \
+        "=&a"(ret) \
+        : \
+        [target]"r"(&target), [args]"r"(args), [argc]"r"(argc) \
+        : \
+        "rbx", "rcx", "rdx", "rsi", "rdi", "r11", "r12", "memory", "cc" ); \
+ \
+    return ret; \
+}
+
+/**
+ * @brief Call with regs[0..2] in EAX, EDX, ECX and \ref nstack arguments on the stack.
+ * 
+ * The stack pointer is restored from EBP after the call, so the callee can
+ * pop its arguments (fastcall).
+ */
+#define S_E32_ENTER32_CC( mechanism, ENTER, LEAVE ) \
+static int s_e32_enter32_cc_##mechanism( e32_function_ptr method, const int * regs, const int * args, unsigned nstack ) \
+{ \
+    struct __attribute__((packed, aligned(16))) { \
+        uint32_t address; \
+        int16_t segment; \
+    } target = {method, 0x23}; \
+ \
+    int ret; \
+ \
+    asm volatile ( \
+          "lea -128(%%rsp), %%rsp\n\t"      /* Skip the red zone */ \
+          "push %%rbp\n\t" \
+          "mov %%rsp, %%r12\n\t"            /* Save RSP */ \
+ \
+          "movl (%[target]), %%ebx\n\t"     /* Save address in EBX */ \
+          "movl $trampoline%=, (%[target])\n\t" /* Replace address in "target" */ \
+ \
+          "mov %[nstack], %%ecx\n\t"        /* Reserve 16-byte aligned room for the stack arguments */ \
+          "lea (,%%rcx,4), %%rax\n\t" \
+          "sub %%rax, %%rsp\n\t" \
+          "and $-16, %%rsp\n\t" \
+          "mov %[args], %%rsi\n\t"          /* Copy them */ \
+          "mov %%rsp, %%rdi\n\t" \
+          "rep movsl\n\t" \
+ \
+          "movl (%[regs]), %%eax\n\t"       /* Register arguments, preserved by the mode switch */ \
+          "movl 4(%[regs]), %%edx\n\t" \
+          "movl 8(%[regs]), %%ecx\n\t" \
+ \
+          ENTER                             /* Switch to the trampoline. */ \
+          "jmp exit%=\n\t"                  /* On return jump to the end */ \
+ \
+          "trampoline%=:\n\t" \
+ \
+          ".byte 0x16, 0x1f\n\t" /* push ss; pop ds */ \
+          ".byte 0x16, 0x07\n\t" /* push ss; pop es */ \
+          ".byte 0x5f\n\t" /* pop edi (return address) */ \
+          ".byte 0x5e\n\t" /* pop esi (return segment) */ \
+          "mov %%esp, %%ebp\n\t" \
+ \
+          "callq *%%rbx\n\t"                /* call *%ebx */ \
+ \
+          "mov %%ebp, %%esp\n\t"            /* Undo the pops of a callee-pop convention */ \
+          ".byte 0x56\n\t" /* push esi */ \
+          ".byte 0x57\n\t" /* push edi */ \
+          LEAVE \
+ \
+          "exit%=:\n\t" \
+          "mov %%r12, %%rsp\n\t" \
+          "pop %%rbp\n\t" \
+          "lea 128(%%rsp), %%rsp\n\t" \
+        : \
+        "=&a"(ret) \
+        : \
+        [target]"r"(&target), [regs]"r"(regs), [args]"r"(args), [nstack]"r"(nstack) \
+        : \
+        "rbx", "rcx", "rdx", "rsi", "rdi", "r11", "r12", "memory", "cc" ); \
+ \
+    return ret; \
+}
+
+/**
+ * @brief Run the batch loop in 32-bit mode, \ref args and \ref results must be in the low 4GB.
+ */
+#define S_E32_ENTER32_BATCH( mechanism, ENTER, LEAVE ) \
+static void s_e32_enter32_batch_##mechanism( e32_function_ptr method, const int * args, unsigned argc, int * results, uint32_t count ) \
+{ \
+    struct __attribute__((packed, aligned(16))) { \
+        uint32_t address; \
+        int16_t segment; \
+    } target = {method, 0x23}; \
+ \
+    asm volatile ( \
+          "lea -128(%%rsp), %%rsp\n\t"      /* Skip the red zone */ \
+          "push %%rbp\n\t" \
+          "mov %%rsp, %%r12\n\t"            /* Save RSP */ \
+ \
+          "and $-16, %%rsp\n\t"             /* argc and count, right above the far return address */ \
+          "sub $16, %%rsp\n\t" \
+          "movl %[argc], (%%rsp)\n\t" \
+          "movl %[count], 4(%%rsp)\n\t" \
+ \
+          "movl (%[target]), %%ebx\n\t"     /* Save address in EBX */ \
+          "movl $trampoline%=, (%[target])\n\t" /* Replace address in "target" */ \
+          "mov %[args], %%rsi\n\t"          /* Arguments in ESI, results in EDI */ \
+          "mov %[results], %%rdi\n\t" \
+ \
+          ENTER                             /* Switch to the trampoline. */ \
+          "jmp exit%=\n\t"                  /* On return jump to the end */ \
+ \
+          "trampoline%=:\n\t"               /* 32-bit driver loop, only uses callee-saved registers across calls */ \
+ \
+          ".byte 0x16, 0x1f\n\t" /* push ss; pop ds */ \
+          ".byte 0x16, 0x07\n\t" /* push ss; pop es */ \
+          "mov %%esp, %%ebp\n\t"            /* argc at 8(%ebp), count at 12(%ebp) */ \
+          "jmp check%=\n\t" \
+ \
+          "body%=:\n\t" \
+          "mov 8(%%rbp), %%ecx\n\t"         /* Copy one row of arguments on a 16-byte aligned stack */ \
+          "lea (,%%rcx,4), %%eax\n\t" \
+          "sub %%eax, %%esp\n\t" \
+          "and $-16, %%esp\n\t" \
+          "mov %%edi, %%edx\n\t" \
+          "mov %%esp, %%edi\n\t" \
+          "rep movsl\n\t"                   /* ESI now points to the next row */ \
+          "mov %%edx, %%edi\n\t" \
+ \
+          "callq *%%rbx\n\t"                /* call *%ebx */ \
+ \
+          "mov %%eax, (%%rdi)\n\t"          /* Store the result */ \
+          "add $4, %%edi\n\t" \
+          "mov %%ebp, %%esp\n\t" \
+ \
+          "check%=:\n\t" \
+          "subl $1, 12(%%rbp)\n\t"          /* Until count wraps around */ \
+          "jae body%=\n\t" \
+          LEAVE \
+ \
+          "exit%=:\n\t" \
+          "mov %%r12, %%rsp\n\t" \
+          "pop %%rbp\n\t" \
+          "lea 128(%%rsp), %%rsp\n\t" \
+        : \
+        : \
+        [target]"r"(&target), [args]"r"(args), [results]"r"(results), [argc]"r"(argc), [count]"r"(count) \
+        : \
+        "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "r11", "r12", "memory", "cc" ); \
+}
+
+#define S_E32_SWITCH_MECHANISM( mechanism, ENTER, LEAVE ) \
+    S_E32_ENTER32_I( mechanism, ENTER, LEAVE ) \
+    S_E32_ENTER32_IV( mechanism, ENTER, LEAVE ) \
+    S_E32_ENTER32_CC( mechanism, ENTER, LEAVE ) \
+    S_E32_ENTER32_BATCH( mechanism, ENTER, LEAVE )
+
+S_E32_SWITCH_MECHANISM( lcall, S_E32_SWITCH_LCALL_ENTER, S_E32_SWITCH_LRET_LEAVE )
+S_E32_SWITCH_MECHANISM( ljmp, S_E32_SWITCH_LJMP_ENTER, S_E32_SWITCH_LJMP_LEAVE )
+S_E32_SWITCH_MECHANISM( lretq, S_E32_SWITCH_LRETQ_ENTER, S_E32_SWITCH_LRET_LEAVE )
+S_E32_SWITCH_MECHANISM( iretq, S_E32_SWITCH_IRETQ_ENTER, S_E32_SWITCH_LRET_LEAVE )
+
+const struct e32_switch_ops e32_switch_table[E32_SWITCH_COUNT] =
+{
+    [E32_SWITCH_LCALL] = { "lcall", &s_e32_enter32_i_lcall, &s_e32_enter32_iv_lcall, &s_e32_enter32_cc_lcall, &s_e32_enter32_batch_lcall },
+    [E32_SWITCH_LJMP] = { "ljmp", &s_e32_enter32_i_ljmp, &s_e32_enter32_iv_ljmp, &s_e32_enter32_cc_ljmp, &s_e32_enter32_batch_ljmp },
+    [E32_SWITCH_LRETQ] = { "lretq", &s_e32_enter32_i_lretq, &s_e32_enter32_iv_lretq, &s_e32_enter32_cc_lretq, &s_e32_enter32_batch_lretq },
+    [E32_SWITCH_IRETQ] = { "iretq", &s_e32_enter32_i_iretq, &s_e32_enter32_iv_iretq, &s_e32_enter32_cc_iretq, &s_e32_enter32_batch_iretq },
+};
+
+/**
+ * @return The active mechanism, or NULL if the thread can not get the guest TLS.
+ */
+static const struct e32_switch_ops * s_e32_switch_ops()
+{
+    if ( e32_tls_thread_check() != 0 )
+    {
+        return NULL;
+    }
+
+    const struct e32_switch_ops * ops = __atomic_load_n( &e32_switch_active, __ATOMIC_ACQUIRE );
+
+    return ops ? ops : e32_switch_init();
+}
+
+int e32_enter32_i( e32_function_ptr method, int arg0 )
+{
+    const struct e32_switch_ops * ops = s_e32_switch_ops();
+
+    if ( !ops )
+    {
+        return -1;
+    }
+
+    if ( !e32_counters_active() )
+    {
+        return ops->enter32_i( method, arg0 );
+    }
+
+    struct e32_counters_sample start;
+    e32_counters_begin( &start );
+    const int ans = ops->enter32_i( method, arg0 );
+    e32_counters_end( method, &start, 1 );
+
+    return ans;
+}
+
+int e32_enter32_iv( e32_function_ptr method, const int * args, unsigned argc )
+{
+    const struct e32_switch_ops * ops = s_e32_switch_ops();
+
+    if ( !ops )
+    {
+        return -1;
+    }
+
+    if ( !e32_counters_active() )
+    {
+        return ops->enter32_iv( method, args, argc );
+    }
+
+    struct e32_counters_sample start;
+    e32_counters_begin( &start );
+    const int ans = ops->enter32_iv( method, args, argc );
+    e32_counters_end( method, &start, 1 );
+
+    return ans;
+}
+
+int e32_enter32_cc( e32_function_ptr method, int callconv, const int * args, unsigned argc )
+{
+    // EAX, EDX, ECX
+    int regs[3] = { 0, 0, 0 };
+    unsigned nregs;
+
+    switch ( callconv )
+    {
+    case E32_CC_CDECL:
+    case E32_CC_REGPARM1:
+    case E32_CC_REGPARM2:
+    case E32_CC_REGPARM3:
+        nregs = argc < (unsigned)callconv ? argc : (unsigned)callconv;
+        for ( unsigned i = 0; i < nregs; ++i )
+        {
+            regs[i] = args[i];
+        }
+        break;
+    case E32_CC_FASTCALL:
+        nregs = argc < 2 ? argc : 2;
+        regs[2] = nregs > 0 ? args[0] : 0;
+        regs[1] = nregs > 1 ? args[1] : 0;
+        break;
+    default:
+        return -1;
+    }
+
+    const struct e32_switch_ops * ops = s_e32_switch_ops();
+
+    if ( !ops )
+    {
+        return -1;
+    }
+
+    if ( !e32_counters_active() )
+    {
+        return ops->enter32_cc( method, regs, args + nregs, argc - nregs );
+    }
+
+    struct e32_counters_sample start;
+    e32_counters_begin( &start );
+    const int ans = ops->enter32_cc( method, regs, args + nregs, argc - nregs );
+    e32_counters_end( method, &start, 1 );
+
+    return ans;
+}
+
+// Calls per chunk when the arrays must be staged through the guest stack
+#define S_E32_BATCH_CHUNK 256
+
+int e32_enter32_batch( e32_function_ptr method, const int * args, unsigned argc, int * results, size_t count )
+{
+    if ( argc > E32_BATCH_MAX_ARGS )
+    {
+        return -1;
+    }
+
+    const struct e32_switch_ops * ops = s_e32_switch_ops();
+
+    if ( !ops )
+    {
+        return -1;
+    }
+
+    // The whole batch counts as \ref count calls
+    struct e32_counters_sample start;
+    const int measured = e32_counters_active();
+
+    if ( measured )
+    {
+        e32_counters_begin( &start );
+    }
+
+    const uint64_t args_end = (uint64_t)( args + argc * count );
+    const uint64_t results_end = (uint64_t)( results + count );
+
+    if ( args_end <= UINT32_MAX && results_end <= UINT32_MAX )
+    {
+        // Both arrays fit below 4GB, so count does too
+        ops->enter32_batch( method, args, argc, results, count );
+    }
+    else
+    {
+        int stage_args[S_E32_BATCH_CHUNK * E32_BATCH_MAX_ARGS];
+        int stage_results[S_E32_BATCH_CHUNK];
+
+        (void)e32_ptr( stage_args ); // Debug check that we run on a guest stack
+
+        for ( size_t left = count; left > 0; )
+        {
+            const size_t n = left < S_E32_BATCH_CHUNK ? left : S_E32_BATCH_CHUNK;
+
+            memcpy( stage_args, args, n * argc * sizeof(int) );
+            ops->enter32_batch( method, stage_args, argc, stage_results, n );
+            memcpy( results, stage_results, n * sizeof(int) );
+
+            args += n * argc;
+            results += n;
+            left -= n;
+        }
+    }
+
+    if ( measured )
+    {
+        e32_counters_end( method, &start, count );
+    }
+
+    return 0;
 }
@@ -0,0 +1,361 @@
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "e32_libc.h"
+
+// Polls of an empty queue before an executor goes to sleep
+#define S_E32_EXECUTOR_SPIN 2000
+
+// Polls of an incomplete call before the waiter goes to sleep
+#define S_E32_CALL_SPIN     2000
+
+enum
+{
+    S_E32_CALL_PENDING = 0,
+    S_E32_CALL_WAITING = 1, ///< The submitter sleeps on the state
+    S_E32_CALL_DONE = 2
+};
+
+/**
+ * @brief A slot of the ring, see Vyukov's bounded MPMC queue.
+ *
+ * sequence == position: free for the producer of that position.
+ * sequence == position + 1: holds a call for the consumer of that position.
+ */
+struct s_e32_cell
+{
+    uint64_t sequence;
+    struct e32_call * call;
+};
+
+struct e32_executor
+{
+    struct s_e32_cell * cells;
+    uint64_t mask;
+
+    // Producers and consumers write different lines
+    uint64_t enqueue_pos __attribute__((aligned(64)));
+    uint64_t dequeue_pos __attribute__((aligned(64)));
+
+    // Futex of the sleeping executors, bumped by the producers that see one
+    uint32_t work __attribute__((aligned(64)));
+    uint32_t sleepers;
+    int stop;
+
+    unsigned nthreads;
+    pthread_t threads[];
+};
+
+/**
+ * @brief Polls before sleeping, none if the other side can not run meanwhile.
+ */
+static unsigned s_e32_spin_limit( unsigned spin )
+{
+    static int cpus;
+
+    int n = __atomic_load_n( &cpus, __ATOMIC_RELAXED );
+
+    if ( n == 0 )
+    {
+        n = (int)sysconf( _SC_NPROCESSORS_ONLN );
+        __atomic_store_n( &cpus, n, __ATOMIC_RELAXED );
+    }
+
+    return n > 1 ? spin : 0;
+}
+
+static long s_e32_futex( uint32_t * addr, int op, uint32_t value )
+{
+    return syscall( SYS_futex, addr, op, value, NULL, NULL, 0 );
+}
+
+static int s_e32_executor_push( struct e32_executor * executor, struct e32_call * call )
+{
+    uint64_t pos = __atomic_load_n( &executor->enqueue_pos, __ATOMIC_RELAXED );
+
+    for ( ;; )
+    {
+        struct s_e32_cell * cell = &executor->cells[ pos & executor->mask ];
+        const int64_t diff = (int64_t)__atomic_load_n( &cell->sequence, __ATOMIC_ACQUIRE ) - (int64_t)pos;
+
+        if ( diff == 0 )
+        {
+            if ( __atomic_compare_exchange_n( &executor->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            {
+                cell->call = call;
+                __atomic_store_n( &cell->sequence, pos + 1, __ATOMIC_RELEASE );
+                return 0;
+            }
+        }
+        else if ( diff < 0 )
+        {
+            // Full
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n( &executor->enqueue_pos, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+static struct e32_call * s_e32_executor_pop( struct e32_executor * executor )
+{
+    uint64_t pos = __atomic_load_n( &executor->dequeue_pos, __ATOMIC_RELAXED );
+
+    for ( ;; )
+    {
+        struct s_e32_cell * cell = &executor->cells[ pos & executor->mask ];
+        const int64_t diff = (int64_t)__atomic_load_n( &cell->sequence, __ATOMIC_ACQUIRE ) - (int64_t)( pos + 1 );
+
+        if ( diff == 0 )
+        {
+            if ( __atomic_compare_exchange_n( &executor->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            {
+                struct e32_call * call = cell->call;
+                __atomic_store_n( &cell->sequence, pos + executor->mask + 1, __ATOMIC_RELEASE );
+                return call;
+            }
+        }
+        else if ( diff < 0 )
+        {
+            // Empty
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n( &executor->dequeue_pos, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+static void s_e32_call_complete( struct e32_call * call, int result )
+{
+    call->result = result;
+
+    if ( __atomic_exchange_n( &call->state, S_E32_CALL_DONE, __ATOMIC_ACQ_REL ) == S_E32_CALL_WAITING )
+    {
+        s_e32_futex( &call->state, FUTEX_WAKE_PRIVATE, INT_MAX );
+    }
+}
+
+/**
+ * @brief Next call, sleeping while the queue is empty. NULL once the executor stops.
+ */
+static struct e32_call * s_e32_executor_next( struct e32_executor * executor )
+{
+    const unsigned spin = s_e32_spin_limit( S_E32_EXECUTOR_SPIN );
+
+    for ( ;; )
+    {
+        for ( unsigned i = 0; i < spin; ++i )
+        {
+            struct e32_call * call = s_e32_executor_pop( executor );
+
+            if ( call )
+            {
+                return call;
+            }
+
+            __builtin_ia32_pause();
+        }
+
+        if ( __atomic_load_n( &executor->stop, __ATOMIC_ACQUIRE ) )
+        {
+            return s_e32_executor_pop( executor );
+        }
+
+        // Announce the sleep before the last look, producers check sleepers after their push
+        __atomic_add_fetch( &executor->sleepers, 1, __ATOMIC_SEQ_CST );
+
+        const uint32_t work = __atomic_load_n( &executor->work, __ATOMIC_SEQ_CST );
+        struct e32_call * call = s_e32_executor_pop( executor );
+
+        if ( !call && !__atomic_load_n( &executor->stop, __ATOMIC_ACQUIRE ) )
+        {
+            s_e32_futex( &executor->work, FUTEX_WAIT_PRIVATE, work );
+        }
+
+        __atomic_sub_fetch( &executor->sleepers, 1, __ATOMIC_RELAXED );
+
+        if ( call )
+        {
+            return call;
+        }
+    }
+}
+
+/**
+ * @brief Body of an executor, on the guest stack of its thread.
+ *
+ * Never leaves the guest stack between calls, the queue is drained as long
+ * as it is not empty.
+ */
+static void s_e32_executor_loop( void * data )
+{
+    struct e32_executor * executor = data;
+    struct e32_call * call;
+
+    while ( ( call = s_e32_executor_next( executor ) ) )
+    {
+        s_e32_call_complete( call, e32_enter32_cc( call->method, call->callconv, call->args, call->argc ) );
+    }
+}
+
+static void * s_e32_executor_thread( void * data )
+{
+    if ( e32_thread_stack_jump( &s_e32_executor_loop, data ) != 0 )
+    {
+        // No guest stack, fail the calls instead of leaving their submitters waiting
+        struct e32_executor * executor = data;
+        struct e32_call * call;
+
+        while ( ( call = s_e32_executor_next( executor ) ) )
+        {
+            s_e32_call_complete( call, -1 );
+        }
+    }
+
+    return NULL;
+}
+
+struct e32_executor * e32_executor_create( unsigned threads, size_t capacity, const int * cpus )
+{
+    if ( threads == 0 || capacity < 2 || ( capacity & ( capacity - 1 ) ) != 0 )
+    {
+        return NULL;
+    }
+
+    // Keep the aligned members on lines of their own
+    const size_t size = ( sizeof(struct e32_executor) + threads * sizeof(pthread_t) + 63 ) & ~(size_t)63;
+    struct e32_executor * executor = aligned_alloc( 64, size );
+
+    if ( !executor )
+    {
+        return NULL;
+    }
+
+    memset( executor, 0, size );
+
+    executor->cells = calloc( capacity, sizeof(struct s_e32_cell) );
+
+    if ( !executor->cells )
+    {
+        free( executor );
+        return NULL;
+    }
+
+    executor->mask = capacity - 1;
+
+    for ( size_t i = 0; i < capacity; ++i )
+    {
+        executor->cells[i].sequence = i;
+    }
+
+    for ( unsigned i = 0; i < threads; ++i )
+    {
+        pthread_attr_t attr;
+        pthread_attr_init( &attr );
+
+        if ( cpus )
+        {
+            cpu_set_t set;
+            CPU_ZERO( &set );
+            CPU_SET( cpus[i], &set );
+            pthread_attr_setaffinity_np( &attr, sizeof(set), &set );
+        }
+
+        const int error = pthread_create( &executor->threads[i], &attr, &s_e32_executor_thread, executor );
+        pthread_attr_destroy( &attr );
+
+        if ( error != 0 )
+        {
+            e32_executor_destroy( executor );
+            return NULL;
+        }
+
+        executor->nthreads = i + 1;
+    }
+
+    return executor;
+}
+
+int e32_executor_submit( struct e32_executor * executor, struct e32_call * call )
+{
+    call->state = S_E32_CALL_PENDING;
+
+    if ( s_e32_executor_push( executor, call ) != 0 )
+    {
+        return -1;
+    }
+
+    // Pairs with the sleepers increment in s_e32_executor_next
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+
+    if ( __atomic_load_n( &executor->sleepers, __ATOMIC_RELAXED ) > 0 )
+    {
+        __atomic_add_fetch( &executor->work, 1, __ATOMIC_SEQ_CST );
+        s_e32_futex( &executor->work, FUTEX_WAKE_PRIVATE, 1 );
+    }
+
+    return 0;
+}
+
+int e32_call_done( const struct e32_call * call )
+{
+    return __atomic_load_n( &call->state, __ATOMIC_ACQUIRE ) == S_E32_CALL_DONE;
+}
+
+int e32_call_wait( struct e32_call * call )
+{
+    const unsigned spin = s_e32_spin_limit( S_E32_CALL_SPIN );
+
+    for ( unsigned i = 0; i < spin && !e32_call_done( call ); ++i )
+    {
+        __builtin_ia32_pause();
+    }
+
+    uint32_t state = S_E32_CALL_PENDING;
+
+    if ( __atomic_compare_exchange_n( &call->state, &state, S_E32_CALL_WAITING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE ) ||
+         state == S_E32_CALL_WAITING )
+    {
+        while ( __atomic_load_n( &call->state, __ATOMIC_ACQUIRE ) != S_E32_CALL_DONE )
+        {
+            s_e32_futex( &call->state, FUTEX_WAIT_PRIVATE, S_E32_CALL_WAITING );
+        }
+    }
+
+    return call->result;
+}
+
+void e32_executor_destroy( struct e32_executor * executor )
+{
+    if ( !executor )
+    {
+        return;
+    }
+
+    __atomic_store_n( &executor->stop, 1, __ATOMIC_RELEASE );
+    __atomic_add_fetch( &executor->work, 1, __ATOMIC_SEQ_CST );
+    s_e32_futex( &executor->work, FUTEX_WAKE_PRIVATE, INT_MAX );
+
+    for ( unsigned i = 0; i < executor->nthreads; ++i )
+    {
+        pthread_join( executor->threads[i], NULL );
+    }
+
+    free( executor->cells );
+    free( executor );
+}
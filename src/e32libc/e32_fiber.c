@@ -0,0 +1,194 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "e32_libc.h"
+#include "e32_stack.h"
+#include "e32_tls.h"
+
+struct e32_fiber
+{
+    void * sp; ///< Saved context of the fiber, while suspended
+    void * caller_sp; ///< Saved context of the resumer, while running
+    struct e32_fiber * caller; ///< Fiber that resumed this one, NULL for a plain thread
+
+    void * stack;
+    size_t stack_size;
+
+    void (*entry)(void*);
+    void * param;
+    int done;
+};
+
+static __thread struct e32_fiber * e32_fiber_running;
+
+/**
+ * @brief Save the context on the current stack in *save_sp, and resume the one at new_sp.
+ *
+ * The context is the SysV callee-saved registers, MXCSR and the x87 control
+ * word. The i386 callee-saved registers are a subset of them, and the rest
+ * of a suspended guest frame lives on the fiber stack.
+ */
+void s_e32_fiber_switch( void ** save_sp, void * new_sp );
+
+/**
+ * @brief First return address of a new fiber, the fiber is in %r12.
+ */
+void s_e32_fiber_start();
+
+asm (
+    ".pushsection .text\n\t"
+    ".local s_e32_fiber_switch\n\t"
+    ".type s_e32_fiber_switch, @function\n"
+    "s_e32_fiber_switch:\n\t"
+    "push %rbp\n\t"
+    "push %rbx\n\t"
+    "push %r12\n\t"
+    "push %r13\n\t"
+    "push %r14\n\t"
+    "push %r15\n\t"
+    "sub $8, %rsp\n\t"
+    "stmxcsr (%rsp)\n\t"
+    "fnstcw 4(%rsp)\n\t"
+    "mov %rsp, (%rdi)\n\t"
+
+    "mov %rsi, %rsp\n\t"
+    "ldmxcsr (%rsp)\n\t"
+    "fldcw 4(%rsp)\n\t"
+    "add $8, %rsp\n\t"
+    "pop %r15\n\t"
+    "pop %r14\n\t"
+    "pop %r13\n\t"
+    "pop %r12\n\t"
+    "pop %rbx\n\t"
+    "pop %rbp\n\t"
+    "ret\n\t"
+    ".size s_e32_fiber_switch, .-s_e32_fiber_switch\n\t"
+
+    ".local s_e32_fiber_start\n\t"
+    ".type s_e32_fiber_start, @function\n"
+    "s_e32_fiber_start:\n\t"
+    "mov %r12, %rdi\n\t"
+    "call s_e32_fiber_main\n\t"
+    "ud2\n\t"
+    ".size s_e32_fiber_start, .-s_e32_fiber_start\n\t"
+    ".popsection\n\t"
+);
+
+/**
+ * @brief Body of every fiber, only called from s_e32_fiber_start
+ */
+__attribute__((used, noreturn)) static void s_e32_fiber_main( struct e32_fiber * fiber )
+{
+    fiber->entry( fiber->param );
+    fiber->done = 1;
+
+    s_e32_fiber_switch( &fiber->sp, fiber->caller_sp );
+
+    // A finished fiber is never resumed
+    abort();
+}
+
+struct e32_fiber * e32_fiber_create( void (*f)(void*), void * param, size_t stack_size )
+{
+    struct e32_fiber * fiber = calloc( 1, sizeof(*fiber) );
+
+    if ( !fiber )
+    {
+        return NULL;
+    }
+
+    fiber->stack = e32_stack_alloc( stack_size );
+
+    if ( !fiber->stack )
+    {
+        free( fiber );
+        return NULL;
+    }
+
+    fiber->stack_size = stack_size;
+    fiber->entry = f;
+    fiber->param = param;
+
+    // Initial frame, as left by s_e32_fiber_switch: control words, r15..r12, rbx, rbp and the return address
+    const uint64_t top = ( (uint64_t)fiber->stack + stack_size ) & ~(uint64_t)15;
+    uint64_t * frame = (uint64_t *)( top - 80 );
+
+    uint32_t control[2];
+    asm volatile ( "stmxcsr %0\n\t"
+                   "fnstcw %1"
+                   : "=m"(control[0]), "=m"(control[1]) );
+
+    frame[0] = control[0] | (uint64_t)( control[1] & 0xffff ) << 32;
+    frame[1] = 0; // r15
+    frame[2] = 0; // r14
+    frame[3] = 0; // r13
+    frame[4] = (uint64_t)fiber; // r12
+    frame[5] = 0; // rbx
+    frame[6] = 0; // rbp
+    frame[7] = (uint64_t)&s_e32_fiber_start;
+
+    fiber->sp = frame;
+
+    return fiber;
+}
+
+int e32_fiber_resume( struct e32_fiber * fiber )
+{
+    if ( fiber->done || fiber == e32_fiber_running || fiber->caller_sp )
+    {
+        return -1;
+    }
+
+    // The fiber may be suspended in guest code that uses TLS
+    if ( e32_tls_thread_check() != 0 )
+    {
+        return -1;
+    }
+
+    fiber->caller = e32_fiber_running;
+    e32_fiber_running = fiber;
+
+    s_e32_fiber_switch( &fiber->caller_sp, fiber->sp );
+
+    e32_fiber_running = fiber->caller;
+    fiber->caller = NULL;
+    fiber->caller_sp = NULL;
+
+    return fiber->done ? 0 : 1;
+}
+
+int e32_fiber_yield()
+{
+    struct e32_fiber * fiber = e32_fiber_running;
+
+    if ( !fiber )
+    {
+        return -1;
+    }
+
+    s_e32_fiber_switch( &fiber->sp, fiber->caller_sp );
+
+    return 0;
+}
+
+struct e32_fiber * e32_fiber_current()
+{
+    return e32_fiber_running;
+}
+
+int e32_fiber_done( const struct e32_fiber * fiber )
+{
+    return fiber->done;
+}
+
+void e32_fiber_destroy( struct e32_fiber * fiber )
+{
+    if ( !fiber )
+    {
+        return;
+    }
+
+    e32_stack_free( fiber->stack, fiber->stack_size );
+    free( fiber );
+}
@@ -0,0 +1,510 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "e32_libc.h"
+
+#define S_E32_HEAP_SPAN_SIZE    0x10000
+#define S_E32_HEAP_HEADER_SIZE  64
+#define S_E32_HEAP_MAGIC        0xe32a110c
+#define S_E32_HEAP_LARGE        ((uint32_t)-1)
+#define S_E32_HEAP_NCLASSES     18
+#define S_E32_HEAP_MAX_SMALL    8192
+
+// Blocks moved between a thread cache and the central lists at once
+#define S_E32_HEAP_BATCH        32
+
+/**
+ * @brief Header at the start of every span.
+ *
+ * Spans are aligned to S_E32_HEAP_SPAN_SIZE, so the header of any small block
+ * is found by rounding its address down. Large allocations get a span of
+ * their own and start right after the header.
+ */
+struct s_e32_span
+{
+    uint32_t magic;
+    uint32_t size_class;
+    size_t size;
+};
+
+/**
+ * @brief A free block
+ */
+struct s_e32_block
+{
+    struct s_e32_block * next;
+};
+
+/**
+ * @brief Per-thread free lists and counters
+ */
+struct s_e32_thread_cache
+{
+    struct s_e32_block * head[S_E32_HEAP_NCLASSES];
+    unsigned count[S_E32_HEAP_NCLASSES];
+
+    // Only written by the owning thread
+    size_t mallocs;
+    size_t frees;
+    size_t allocated;
+    size_t released;
+
+    struct s_e32_thread_cache * prev;
+    struct s_e32_thread_cache * next;
+};
+
+static const uint32_t e32_heap_class_size[S_E32_HEAP_NCLASSES] =
+{
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192
+};
+
+// Central free lists
+static struct s_e32_block * e32_heap_free_list[S_E32_HEAP_NCLASSES];
+
+// Live thread caches, and totals of the exited ones
+static struct s_e32_thread_cache * e32_heap_caches;
+static struct e32_heap_stats e32_heap_totals;
+
+static pthread_mutex_t e32_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct s_e32_thread_cache * e32_heap_cache;
+
+static pthread_key_t e32_heap_cache_key;
+static pthread_once_t e32_heap_cache_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Map \ref size bytes in the low 4GB, aligned to S_E32_HEAP_SPAN_SIZE.
+ */
+static void * s_e32_heap_map( size_t size )
+{
+    char * p = mmap( NULL, size + S_E32_HEAP_SPAN_SIZE,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_32BIT | MAP_ANONYMOUS,
+                     -1, 0 );
+
+    if ( p == MAP_FAILED )
+    {
+        return NULL;
+    }
+
+    const size_t head = ( S_E32_HEAP_SPAN_SIZE - (uint64_t)p % S_E32_HEAP_SPAN_SIZE ) % S_E32_HEAP_SPAN_SIZE;
+
+    if ( head > 0 )
+    {
+        munmap( p, head );
+    }
+
+    munmap( p + head + size, S_E32_HEAP_SPAN_SIZE - head );
+
+    return p + head;
+}
+
+static unsigned s_e32_heap_size_class( size_t size )
+{
+    unsigned c = 0;
+    while ( e32_heap_class_size[c] < size )
+    {
+        ++c;
+    }
+    return c;
+}
+
+static struct s_e32_span * s_e32_heap_span( void * ptr )
+{
+    struct s_e32_span * span = (struct s_e32_span *)( (uint64_t)ptr & ~(uint64_t)(S_E32_HEAP_SPAN_SIZE - 1) );
+
+    if ( span->magic != S_E32_HEAP_MAGIC )
+    {
+        abort();
+    }
+
+    return span;
+}
+
+/**
+ * @brief Carve a new span into blocks of the given class. Called with e32_heap_lock held.
+ */
+static int s_e32_heap_refill_central( unsigned c )
+{
+    struct s_e32_span * span = s_e32_heap_map( S_E32_HEAP_SPAN_SIZE );
+
+    if ( !span )
+    {
+        return -1;
+    }
+
+    span->magic = S_E32_HEAP_MAGIC;
+    span->size_class = c;
+    span->size = S_E32_HEAP_SPAN_SIZE;
+
+    const size_t block_size = e32_heap_class_size[c];
+
+    char * block = (char*)span + S_E32_HEAP_HEADER_SIZE;
+    char * const end = (char*)span + S_E32_HEAP_SPAN_SIZE;
+
+    for ( ; block + block_size <= end; block += block_size )
+    {
+        struct s_e32_block * b = (struct s_e32_block *)block;
+        b->next = e32_heap_free_list[c];
+        e32_heap_free_list[c] = b;
+    }
+
+    ++e32_heap_totals.spans;
+    e32_heap_totals.mapped += S_E32_HEAP_SPAN_SIZE;
+
+    return 0;
+}
+
+/**
+ * @brief Give \ref n blocks of class \ref c back to the central list.
+ */
+static void s_e32_heap_flush( struct s_e32_thread_cache * cache, unsigned c, unsigned n )
+{
+    pthread_mutex_lock( &e32_heap_lock );
+
+    while ( n-- > 0 && cache->head[c] )
+    {
+        struct s_e32_block * b = cache->head[c];
+        cache->head[c] = b->next;
+        --cache->count[c];
+
+        b->next = e32_heap_free_list[c];
+        e32_heap_free_list[c] = b;
+    }
+
+    pthread_mutex_unlock( &e32_heap_lock );
+}
+
+/**
+ * @brief Release the cache of an exiting thread
+ */
+static void s_e32_heap_cache_release( void * data )
+{
+    struct s_e32_thread_cache * cache = data;
+
+    for ( unsigned c = 0; c < S_E32_HEAP_NCLASSES; ++c )
+    {
+        s_e32_heap_flush( cache, c, cache->count[c] );
+    }
+
+    pthread_mutex_lock( &e32_heap_lock );
+
+    e32_heap_totals.mallocs += cache->mallocs;
+    e32_heap_totals.frees += cache->frees;
+    e32_heap_totals.in_use += cache->allocated - cache->released;
+
+    if ( cache->prev )
+    {
+        cache->prev->next = cache->next;
+    }
+    else
+    {
+        e32_heap_caches = cache->next;
+    }
+
+    if ( cache->next )
+    {
+        cache->next->prev = cache->prev;
+    }
+
+    pthread_mutex_unlock( &e32_heap_lock );
+
+    free( cache );
+    e32_heap_cache = NULL;
+}
+
+static void s_e32_heap_cache_key_init()
+{
+    pthread_key_create( &e32_heap_cache_key, &s_e32_heap_cache_release );
+}
+
+static struct s_e32_thread_cache * s_e32_heap_thread_cache()
+{
+    if ( e32_heap_cache )
+    {
+        return e32_heap_cache;
+    }
+
+    pthread_once( &e32_heap_cache_once, &s_e32_heap_cache_key_init );
+
+    struct s_e32_thread_cache * cache = calloc( 1, sizeof(*cache) );
+
+    if ( !cache )
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock( &e32_heap_lock );
+
+    cache->next = e32_heap_caches;
+    if ( e32_heap_caches )
+    {
+        e32_heap_caches->prev = cache;
+    }
+    e32_heap_caches = cache;
+
+    pthread_mutex_unlock( &e32_heap_lock );
+
+    pthread_setspecific( e32_heap_cache_key, cache );
+
+    return e32_heap_cache = cache;
+}
+
+/**
+ * @brief Move up to S_E32_HEAP_BATCH blocks from the central list to \ref cache.
+ */
+static void s_e32_heap_refill( struct s_e32_thread_cache * cache, unsigned c )
+{
+    pthread_mutex_lock( &e32_heap_lock );
+
+    for ( unsigned i = 0; i < S_E32_HEAP_BATCH; ++i )
+    {
+        if ( !e32_heap_free_list[c] && s_e32_heap_refill_central(c) != 0 )
+        {
+            break;
+        }
+
+        struct s_e32_block * b = e32_heap_free_list[c];
+        e32_heap_free_list[c] = b->next;
+
+        b->next = cache->head[c];
+        cache->head[c] = b;
+        ++cache->count[c];
+    }
+
+    pthread_mutex_unlock( &e32_heap_lock );
+}
+
+static void * s_e32_heap_malloc_large( size_t size )
+{
+    const size_t pagesize = getpagesize();
+
+    if ( size > SIZE_MAX - S_E32_HEAP_HEADER_SIZE - pagesize )
+    {
+        return NULL;
+    }
+
+    const size_t mapped = ( size + S_E32_HEAP_HEADER_SIZE + pagesize - 1 ) / pagesize * pagesize;
+
+    struct s_e32_span * span = s_e32_heap_map( mapped );
+
+    if ( !span )
+    {
+        return NULL;
+    }
+
+    span->magic = S_E32_HEAP_MAGIC;
+    span->size_class = S_E32_HEAP_LARGE;
+    span->size = mapped;
+
+    pthread_mutex_lock( &e32_heap_lock );
+    ++e32_heap_totals.large_spans;
+    e32_heap_totals.mapped += mapped;
+    pthread_mutex_unlock( &e32_heap_lock );
+
+    return (char*)span + S_E32_HEAP_HEADER_SIZE;
+}
+
+/**
+ * @brief Add to a counter of the thread cache, which is read concurrently by e32_heap_stats.
+ */
+static void s_e32_heap_count( size_t * counter, size_t value )
+{
+    __atomic_store_n( counter, *counter + value, __ATOMIC_RELAXED );
+}
+
+void * e32_heap_malloc( size_t size )
+{
+    struct s_e32_thread_cache * cache = s_e32_heap_thread_cache();
+
+    if ( !cache )
+    {
+        return NULL;
+    }
+
+    if ( size == 0 )
+    {
+        size = 1;
+    }
+
+    void * ans;
+    size_t allocated;
+
+    if ( size > S_E32_HEAP_MAX_SMALL )
+    {
+        ans = s_e32_heap_malloc_large( size );
+        allocated = ans ? s_e32_heap_span( ans )->size : 0;
+    }
+    else
+    {
+        const unsigned c = s_e32_heap_size_class( size );
+
+        if ( !cache->head[c] )
+        {
+            s_e32_heap_refill( cache, c );
+        }
+
+        struct s_e32_block * b = cache->head[c];
+
+        if ( b )
+        {
+            cache->head[c] = b->next;
+            --cache->count[c];
+        }
+
+        ans = b;
+        allocated = e32_heap_class_size[c];
+    }
+
+    if ( ans )
+    {
+        s_e32_heap_count( &cache->mallocs, 1 );
+        s_e32_heap_count( &cache->allocated, allocated );
+    }
+
+    return ans;
+}
+
+void e32_heap_free( void * ptr )
+{
+    if ( !ptr )
+    {
+        return;
+    }
+
+    struct s_e32_thread_cache * cache = s_e32_heap_thread_cache();
+    struct s_e32_span * span = s_e32_heap_span( ptr );
+
+    if ( span->size_class == S_E32_HEAP_LARGE )
+    {
+        const size_t mapped = span->size;
+
+        munmap( span, mapped );
+
+        pthread_mutex_lock( &e32_heap_lock );
+        --e32_heap_totals.large_spans;
+        e32_heap_totals.mapped -= mapped;
+        pthread_mutex_unlock( &e32_heap_lock );
+
+        if ( cache )
+        {
+            s_e32_heap_count( &cache->frees, 1 );
+            s_e32_heap_count( &cache->released, mapped );
+        }
+        else
+        {
+            pthread_mutex_lock( &e32_heap_lock );
+            ++e32_heap_totals.frees;
+            e32_heap_totals.in_use -= mapped;
+            pthread_mutex_unlock( &e32_heap_lock );
+        }
+        return;
+    }
+
+    const unsigned c = span->size_class;
+    struct s_e32_block * b = ptr;
+
+    if ( !cache )
+    {
+        // No cache for this thread, give the block back directly
+        pthread_mutex_lock( &e32_heap_lock );
+        b->next = e32_heap_free_list[c];
+        e32_heap_free_list[c] = b;
+        ++e32_heap_totals.frees;
+        e32_heap_totals.in_use -= e32_heap_class_size[c];
+        pthread_mutex_unlock( &e32_heap_lock );
+        return;
+    }
+
+    b->next = cache->head[c];
+    cache->head[c] = b;
+
+    if ( ++cache->count[c] > 2 * S_E32_HEAP_BATCH )
+    {
+        s_e32_heap_flush( cache, c, S_E32_HEAP_BATCH );
+    }
+
+    s_e32_heap_count( &cache->frees, 1 );
+    s_e32_heap_count( &cache->released, e32_heap_class_size[c] );
+}
+
+void * e32_heap_calloc( size_t nmemb, size_t size )
+{
+    if ( size != 0 && nmemb > SIZE_MAX / size )
+    {
+        return NULL;
+    }
+
+    void * ans = e32_heap_malloc( nmemb * size );
+
+    if ( ans )
+    {
+        memset( ans, 0, nmemb * size );
+    }
+
+    return ans;
+}
+
+size_t e32_heap_usable_size( void * ptr )
+{
+    if ( !ptr )
+    {
+        return 0;
+    }
+
+    const struct s_e32_span * span = s_e32_heap_span( ptr );
+
+    return span->size_class == S_E32_HEAP_LARGE ?
+        span->size - S_E32_HEAP_HEADER_SIZE :
+        e32_heap_class_size[ span->size_class ];
+}
+
+void * e32_heap_realloc( void * ptr, size_t size )
+{
+    if ( !ptr )
+    {
+        return e32_heap_malloc( size );
+    }
+
+    const size_t usable = e32_heap_usable_size( ptr );
+
+    if ( size <= usable && size > usable / 2 )
+    {
+        return ptr;
+    }
+
+    void * ans = e32_heap_malloc( size );
+
+    if ( ans )
+    {
+        memcpy( ans, ptr, size < usable ? size : usable );
+        e32_heap_free( ptr );
+    }
+
+    return ans;
+}
+
+void e32_heap_stats( struct e32_heap_stats * stats )
+{
+    pthread_mutex_lock( &e32_heap_lock );
+
+    *stats = e32_heap_totals;
+
+    for ( const struct s_e32_thread_cache * cache = e32_heap_caches; cache; cache = cache->next )
+    {
+        const size_t allocated = __atomic_load_n( &cache->allocated, __ATOMIC_RELAXED );
+        const size_t released = __atomic_load_n( &cache->released, __ATOMIC_RELAXED );
+
+        stats->mallocs += __atomic_load_n( &cache->mallocs, __ATOMIC_RELAXED );
+        stats->frees += __atomic_load_n( &cache->frees, __ATOMIC_RELAXED );
+        stats->in_use += allocated - released;
+    }
+
+    pthread_mutex_unlock( &e32_heap_lock );
+}
@@ -1,24 +1,22 @@
 
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include "e32_libc.h"
-
-// Entry points
-e32_function_ptr e32_abort;
-e32_function_ptr e32_abs;
-e32_function_ptr e32_atoi;
-
-// Base address of the library
-static void * e32_libc_text_base;
+#include "e32_probe.h"
+#include "e32_thunk_arena.h"
 
 #define S_E32_LIBC_FUNC_ALIGN   0x20
-#define S_E32_LIBC_SECTION_SIZE 8096
 
 /**
  * @brief Pad addr with nops, until the next S_E32_LIBC_FUNC_ALIGN bytes boundary.
@@ -43,59 +41,179 @@ size_t s_e32_align_size( size_t value )
 }
 
 /**
- * @brief Generates a wrapper for a libc call
- * @param addr Destination for the bytecode
- * @param size Size of the buffer at \ref addr.
+ * @brief Name of a wrapper in the perf map and in the probes
+ * @param name Name of the exported function, NULL for wrappers of user functions.
+ */
+static void s_e32_wrapper_name( char * dest, size_t size, const char * name, void * target )
+{
+    Dl_info info;
+    
+    if ( name )
+    {
+        snprintf( dest, size, "e32_libc::%s", name );
+    }
+    else if ( dladdr( target, &info ) && info.dli_sname )
+    {
+        snprintf( dest, size, "e32_wrapper::%s", info.dli_sname );
+    }
+    else
+    {
+        snprintf( dest, size, "e32_wrapper::%p", target );
+    }
+}
+
+/**
+ * @brief Generates a self-contained wrapper for a libc call
+ * 
+ * If the probes are enabled, the wrapper also samples rdtsc before the
+ * prologue and hands it to e32_probe_record after the host call, with the
+ * return registers saved on the stack.
+ * @param name Name of the exported function, NULL for wrappers of user functions
  * @param target Target function
  * @param prologue 64-bit call prologue bytecode
  * @param prologue_size Size of prologue
  * @param epilogue 64-bit call epilogue bytecode
  * @param epilogue_size Size of epilogue
- * @return Next available address after \ref addr, or NULL on failure.
+ * @param callee_pop Bytes of arguments popped by the wrapper on return (fastcall)
+ * @param register_args Non-zero if the prologue reads EAX, EDX or ECX
+ * @return Address of the wrapper, or 0 on failure.
  */
-static e32_function_ptr s_e32_make_libc_wrapper( e32_function_ptr addr,
-                                                 size_t size,
+static e32_function_ptr s_e32_make_full_wrapper( const char * name,
                                                  void * target,
                                                  const void * prologue, size_t prologue_size,
-                                                 const void * epilogue, size_t epilogue_size )
+                                                 const void * epilogue, size_t epilogue_size,
+                                                 uint16_t callee_pop, int register_args )
 {
     static const char enter_64[] =
     {
         0x9a, 0x0, 0x0, 0x0, 0x0, 0x33, 0x0, // lcall $0x33,$trampoline
-        0xc3 // ret
+        0xc3, 0x90, 0x90, // ret, padded to the size of ret $imm16
+        0x55, // push %rbp
+        0x48, 0x89, 0xe5, // mov %rsp, %rbp
+        0x56, // push %rsi
+        0x57, // push %rdi
+        0x48, 0x83, 0xe4, 0xf0, // and $-16, %rsp
+    };
+    
+    static const char probe_enter[] =
+    {
+        0x48, 0x83, 0xec, 0x20, // sub $0x20, %rsp
+        0x0f, 0x31, // rdtsc
+        0x48, 0xc1, 0xe2, 0x20, // shl $32, %rdx
+        0x48, 0x09, 0xd0, // or %rdx, %rax
+        0x48, 0x89, 0x04, 0x24, // mov %rax, (%rsp)
+    };
+    
+    // rdtsc clobbers the register arguments
+    static const char probe_save_regs[] =
+    {
+        0x41, 0x89, 0xc2, // mov %eax, %r10d
+        0x41, 0x89, 0xd3, // mov %edx, %r11d
+    };
+    
+    static const char probe_restore_regs[] =
+    {
+        0x44, 0x89, 0xd0, // mov %r10d, %eax
+        0x44, 0x89, 0xda, // mov %r11d, %edx
     };
     
     static const char call_target[] = 
     {
-        0xe8, 0x0, 0x0, 0x0, 0x0, // callq 0x0
+        0x48, 0xb8, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, // movabs $0x0, %rax
+        0xff, 0xd0, // callq *%rax
+    };
+    
+    static const char probe_exit[] =
+    {
+        0x48, 0x89, 0x44, 0x24, 0x08, // mov %rax, 8(%rsp)
+        0xf2, 0x0f, 0x11, 0x44, 0x24, 0x10, // movsd %xmm0, 16(%rsp)
+        0xbf, 0x0, 0x0, 0x0, 0x0, // mov $id, %edi
+        0x48, 0x8b, 0x34, 0x24, // mov (%rsp), %rsi
+        0x48, 0xb8, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, // movabs $e32_probe_record, %rax
+        0xff, 0xd0, // callq *%rax
+        0x48, 0x8b, 0x44, 0x24, 0x08, // mov 8(%rsp), %rax
+        0xf2, 0x0f, 0x10, 0x44, 0x24, 0x10, // movsd 16(%rsp), %xmm0
     };
     
     static const char exit_64[] =
     {   
+        0x48, 0x8d, 0x65, 0xf0, // lea -16(%rbp), %rsp
+        0x5f, // pop %rdi
+        0x5e, // pop %rsi
+        0x5d, // pop %rbp
         0xcb, // long ret
     };
     
-    const size_t total_size = sizeof(enter_64) + prologue_size + sizeof(call_target) + epilogue_size + sizeof(exit_64);
+    const int probe = e32_probe_enabled();
     
-    if ( size < s_e32_align_size(total_size) )
+    const size_t total_size = sizeof(enter_64) + prologue_size + sizeof(call_target) + epilogue_size + sizeof(exit_64) +
+                              ( probe ? sizeof(probe_enter) + sizeof(probe_exit) : 0 ) +
+                              ( probe && register_args ? sizeof(probe_save_regs) + sizeof(probe_restore_regs) : 0 );
+    
+    void * dest;
+    const e32_function_ptr addr = e32_thunk_arena_alloc( s_e32_align_size(total_size), &dest );
+    
+    if ( !addr )
     {
         return (e32_function_ptr)0;
     }
     
-    char * ptr = (char*)(uint64_t)addr;
+    char symbol[256] = "";
+    
+    if ( probe || e32_perf_map_enabled() )
+    {
+        s_e32_wrapper_name( symbol, sizeof(symbol), name, target );
+    }
+    
+    const uint32_t probe_id = probe ? e32_probe_register( symbol, addr ) : E32_PROBE_NONE;
+    
+    char * ptr = dest;
 
     memcpy( ptr, enter_64, sizeof(enter_64) );
     ptr += sizeof(enter_64);
     
+    if ( probe_id != E32_PROBE_NONE && register_args )
+    {
+        memcpy( ptr, probe_save_regs, sizeof(probe_save_regs) );
+        ptr += sizeof(probe_save_regs);
+    }
+    
+    if ( probe_id != E32_PROBE_NONE )
+    {
+        memcpy( ptr, probe_enter, sizeof(probe_enter) );
+        ptr += sizeof(probe_enter);
+    }
+    
+    if ( probe_id != E32_PROBE_NONE && register_args )
+    {
+        memcpy( ptr, probe_restore_regs, sizeof(probe_restore_regs) );
+        ptr += sizeof(probe_restore_regs);
+    }
+    
     if ( prologue_size > 0 )
     {
         memcpy( ptr, prologue, prologue_size );   
         ptr += prologue_size;
     }
     
+    // Relocate (movabs target)
+    const uint64_t target_addr = (uint64_t)(target);
+    
     memcpy( ptr, call_target, sizeof(call_target) );
+    memcpy( ptr + 2, &target_addr, sizeof(target_addr) );
     ptr += sizeof(call_target);
     
+    if ( probe_id != E32_PROBE_NONE )
+    {
+        // Relocate (probe id and movabs e32_probe_record)
+        const uint64_t record_addr = (uint64_t)(&e32_probe_record);
+        
+        memcpy( ptr, probe_exit, sizeof(probe_exit) );
+        memcpy( ptr + 12, &probe_id, sizeof(probe_id) );
+        memcpy( ptr + 22, &record_addr, sizeof(record_addr) );
+        ptr += sizeof(probe_exit);
+    }
+    
     if ( epilogue_size > 0 )
     {
         memcpy( ptr, epilogue, epilogue_size );   
@@ -105,107 +223,571 @@ static e32_function_ptr s_e32_make_libc_wrapper( e32_function_ptr addr,
     memcpy( ptr, exit_64, sizeof(exit_64) );
     ptr += sizeof(exit_64);
     
-    // Relocation base address
-    const uint32_t base_addr_i = (uint32_t)(uint64_t)(addr);
+    s_e32_nop_pad(ptr);
     
     // Relocate (lcall trampoline)
-    const uint32_t trampoline_addr = base_addr_i + 8;
-    memcpy( (char*)(uint64_t)addr + 1,
+    const uint32_t trampoline_addr = addr + 10;
+    memcpy( (char*)dest + 1,
             &trampoline_addr,
             sizeof(trampoline_addr) );
     
-    const uint32_t call_target_offset = sizeof(enter_64) + prologue_size;
+    if ( callee_pop > 0 )
+    {
+        // ret $callee_pop
+        ((char*)dest)[7] = 0xc2;
+        memcpy( (char*)dest + 8, &callee_pop, sizeof(callee_pop) );
+    }
+    
+    e32_thunk_arena_commit( addr );
     
-    // Relocate (callq target)
-    const uint32_t target_rel_offset = 
-        (uint32_t)(uint64_t)(target) - 
-        (base_addr_i + call_target_offset + sizeof(call_target) );
-
-    memcpy( (char*)(uint64_t)addr + call_target_offset + 1,
-            &target_rel_offset,
-            sizeof(target_rel_offset) );
+    if ( e32_perf_map_enabled() )
+    {
+        e32_perf_map_add( addr, total_size, symbol );
+    }
     
-    return (uint64_t)s_e32_nop_pad(ptr);
+    return addr;
 }
 
+/*
+ * Wrappers without probes are split in two: a 16-byte stub per function,
+ *
+ *     lcall $0x33, $adapter
+ *     ret                      (or ret $callee_pop)
+ *     .long index
+ *
+ * and a 64-bit adapter shared by every function with the same prologue and
+ * epilogue, which finds the index through the far return address and calls
+ * e32_adapter_targets[index]. The stubs of the hot functions pack four to a
+ * cache line instead of one wrapper per line.
+ */
+#define S_E32_STUB_SIZE         16
+#define S_E32_MAX_STUBS         (1024 * 1024)
+#define S_E32_MAX_ADAPTERS      64
+#define S_E32_ADAPTER_MAX_CODE  64
+
 /**
- * @brief Copy opcodes for the abort() wrapper
+ * @brief A shared adapter, identified by its prologue and epilogue.
  */
-static e32_function_ptr s_e32_abort( e32_function_ptr addr, size_t size )
+struct s_e32_adapter
 {
-    return s_e32_make_libc_wrapper( addr, size,
-                                    &abort, 
-                                    NULL, 0, 
-                                    NULL, 0 );
-}
+    size_t prologue_size;
+    size_t epilogue_size;
+    char code[S_E32_ADAPTER_MAX_CODE];
+    e32_function_ptr addr;
+};
+
+static struct s_e32_adapter e32_adapters[S_E32_MAX_ADAPTERS];
+static size_t e32_nadapters;
+
+// Reserved once, so that its address can be baked in the adapters
+static uint64_t * e32_adapter_targets;
+static size_t e32_adapter_ntargets;
+
+static pthread_mutex_t e32_adapter_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
- * @brief Copy opcodes for the abs() wrapper
+ * @brief Find or generate the adapter for a prologue and an epilogue, called with e32_adapter_lock held.
+ * @return Address of the adapter, or 0 on failure.
  */
-static e32_function_ptr s_e32_abs( e32_function_ptr addr, size_t size )
+static e32_function_ptr s_e32_adapter( const void * prologue, size_t prologue_size,
+                                       const void * epilogue, size_t epilogue_size )
 {
-    static const char prologue[] =
+    static const char enter_64[] =
     {
-        0x8b, 0x7c, 0x24, 0x0C, // mov 12(%esp), %edi
+        0x55, // push %rbp
+        0x48, 0x89, 0xe5, // mov %rsp, %rbp
+        0x56, // push %rsi
+        0x57, // push %rdi
+        0x48, 0x83, 0xe4, 0xf0, // and $-16, %rsp
+        0x44, 0x8b, 0x5d, 0x08, // mov 8(%rbp), %r11d (far return address, the end of the lcall)
+        0x45, 0x8b, 0x5b, 0x03, // mov 3(%r11), %r11d (index, after the ret)
+        0x49, 0xba, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, // movabs $e32_adapter_targets, %r10
+        0x4f, 0x8b, 0x14, 0xda, // mov (%r10,%r11,8), %r10
     };
     
-    return s_e32_make_libc_wrapper( addr, size,
-                                    &abs, 
-                                    prologue, sizeof(prologue),
-                                    NULL, 0 );
+    static const char call_target[] =
+    {
+        0x41, 0xff, 0xd2, // callq *%r10
+    };
+    
+    static const char exit_64[] =
+    {
+        0x48, 0x8d, 0x65, 0xf0, // lea -16(%rbp), %rsp
+        0x5f, // pop %rdi
+        0x5e, // pop %rsi
+        0x5d, // pop %rbp
+        0xcb, // long ret
+    };
+    
+    if ( prologue_size + epilogue_size > S_E32_ADAPTER_MAX_CODE )
+    {
+        return (e32_function_ptr)0;
+    }
+    
+    if ( !e32_adapter_targets )
+    {
+        void * targets = mmap( NULL, S_E32_MAX_STUBS * sizeof(uint64_t),
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                               -1, 0 );
+        
+        if ( targets == MAP_FAILED )
+        {
+            return (e32_function_ptr)0;
+        }
+        
+        e32_adapter_targets = targets;
+    }
+    
+    for ( size_t i = 0; i < e32_nadapters; ++i )
+    {
+        const struct s_e32_adapter * a = &e32_adapters[i];
+        
+        if ( a->prologue_size == prologue_size &&
+             a->epilogue_size == epilogue_size &&
+             memcmp( a->code, prologue, prologue_size ) == 0 &&
+             memcmp( a->code + prologue_size, epilogue, epilogue_size ) == 0 )
+        {
+            return a->addr;
+        }
+    }
+    
+    if ( e32_nadapters == S_E32_MAX_ADAPTERS )
+    {
+        return (e32_function_ptr)0;
+    }
+    
+    const size_t total_size = sizeof(enter_64) + prologue_size + sizeof(call_target) + epilogue_size + sizeof(exit_64);
+    
+    void * dest;
+    const e32_function_ptr addr = e32_thunk_arena_alloc( s_e32_align_size(total_size), &dest );
+    
+    if ( !addr )
+    {
+        return (e32_function_ptr)0;
+    }
+    
+    char * ptr = dest;
+    
+    // Relocate (movabs e32_adapter_targets)
+    const uint64_t targets_addr = (uint64_t)e32_adapter_targets;
+    
+    memcpy( ptr, enter_64, sizeof(enter_64) );
+    memcpy( ptr + 20, &targets_addr, sizeof(targets_addr) );
+    ptr += sizeof(enter_64);
+    
+    memcpy( ptr, prologue, prologue_size );
+    ptr += prologue_size;
+    
+    memcpy( ptr, call_target, sizeof(call_target) );
+    ptr += sizeof(call_target);
+    
+    memcpy( ptr, epilogue, epilogue_size );
+    ptr += epilogue_size;
+    
+    memcpy( ptr, exit_64, sizeof(exit_64) );
+    ptr += sizeof(exit_64);
+    
+    s_e32_nop_pad(ptr);
+    e32_thunk_arena_commit( addr );
+    
+    struct s_e32_adapter * a = &e32_adapters[e32_nadapters++];
+    a->prologue_size = prologue_size;
+    a->epilogue_size = epilogue_size;
+    memcpy( a->code, prologue, prologue_size );
+    memcpy( a->code + prologue_size, epilogue, epilogue_size );
+    a->addr = addr;
+    
+    if ( e32_perf_map_enabled() )
+    {
+        char symbol[64];
+        snprintf( symbol, sizeof(symbol), "e32_adapter::%zu", e32_nadapters - 1 );
+        e32_perf_map_add( addr, total_size, symbol );
+    }
+    
+    return addr;
 }
+
 /**
- * @brief Copy opcodes for the atoi() wrapper
+ * @brief Generates the stub of a libc call, and its adapter if needed
+ * @return Address of the stub, or 0 on failure.
  */
-static e32_function_ptr s_e32_atoi( e32_function_ptr addr, size_t size )
+static e32_function_ptr s_e32_make_stub( const char * name,
+                                         void * target,
+                                         const void * prologue, size_t prologue_size,
+                                         const void * epilogue, size_t epilogue_size,
+                                         uint16_t callee_pop )
 {
-    static const char prologue[] =
+    pthread_mutex_lock( &e32_adapter_lock );
+    
+    const e32_function_ptr adapter = e32_adapter_ntargets < S_E32_MAX_STUBS ?
+                                     s_e32_adapter( prologue, prologue_size, epilogue, epilogue_size ) :
+                                     (e32_function_ptr)0;
+    
+    void * dest;
+    const e32_function_ptr addr = adapter ? e32_thunk_arena_alloc( S_E32_STUB_SIZE, &dest ) : (e32_function_ptr)0;
+    
+    if ( !addr )
+    {
+        pthread_mutex_unlock( &e32_adapter_lock );
+        return (e32_function_ptr)0;
+    }
+    
+    const uint32_t index = e32_adapter_ntargets++;
+    e32_adapter_targets[index] = (uint64_t)target;
+    
+    pthread_mutex_unlock( &e32_adapter_lock );
+    
+    char stub[S_E32_STUB_SIZE] =
     {
-        0x8b, 0x7c, 0x24, 0x0C, // mov 12(%esp), %edi
+        0x9a, 0x0, 0x0, 0x0, 0x0, 0x33, 0x0, // lcall $0x33,$adapter
+        0xc3, 0x90, 0x90, // ret, padded to the size of ret $imm16
+        0x0, 0x0, 0x0, 0x0, // index
+        0xcc, 0xcc,
     };
     
-    return s_e32_make_libc_wrapper( addr, size,
-                                    &atoi, 
-                                    prologue, sizeof(prologue),
-                                    NULL, 0 );
+    memcpy( stub + 1, &adapter, sizeof(adapter) );
+    
+    if ( callee_pop > 0 )
+    {
+        // ret $callee_pop
+        stub[7] = 0xc2;
+        memcpy( stub + 8, &callee_pop, sizeof(callee_pop) );
+    }
+    
+    memcpy( stub + 10, &index, sizeof(index) );
+    memcpy( dest, stub, sizeof(stub) );
+    e32_thunk_arena_commit( addr );
+    
+    if ( e32_perf_map_enabled() )
+    {
+        char symbol[256];
+        s_e32_wrapper_name( symbol, sizeof(symbol), name, target );
+        e32_perf_map_add( addr, S_E32_STUB_SIZE, symbol );
+    }
+    
+    return addr;
 }
 
 /**
- * @brief Initialize all the entry points
+ * @brief Generates a wrapper for a libc call
+ * 
+ * A stub on a shared adapter, unless the probes are enabled: instrumented
+ * wrappers need a site of their own.
+ * @see s_e32_make_full_wrapper for the parameters
  */
-__attribute__((constructor)) static void e32_libc_init() 
+static e32_function_ptr s_e32_make_libc_wrapper( const char * name,
+                                                 void * target,
+                                                 const void * prologue, size_t prologue_size,
+                                                 const void * epilogue, size_t epilogue_size,
+                                                 uint16_t callee_pop, int register_args )
 {
-    e32_libc_text_base = mmap( NULL, S_E32_LIBC_SECTION_SIZE ,
-                               PROT_EXEC | PROT_READ | PROT_WRITE,
-                               MAP_PRIVATE | MAP_32BIT | MAP_ANONYMOUS,
-                               -1, 0 );
-    
-    if ( ! e32_libc_text_base || (uint64_t)(e32_libc_text_base) % S_E32_LIBC_FUNC_ALIGN != 0) 
+    if ( e32_probe_enabled() )
     {
-        return;
+        return s_e32_make_full_wrapper( name, target,
+                                        prologue, prologue_size,
+                                        epilogue, epilogue_size,
+                                        callee_pop, register_args );
     }
     
-    if ( (uint64_t)e32_libc_text_base + S_E32_LIBC_SECTION_SIZE > 0xFFFFFFFF )
+    return s_e32_make_stub( name, target,
+                            prologue, prologue_size,
+                            epilogue, epilogue_size,
+                            callee_pop );
+}
+
+/**
+ * @brief Write the prologue that moves \ref argc 32-bit arguments into the 64-bit argument registers.
+ * 
+ * Register arguments of \ref callconv are moved from EAX, EDX and ECX, the
+ * others start at 20(%rbp), above the saved %rbp, the far return address and
+ * the near return address of the guest.
+ * @param dest Destination for the bytecode
+ * @param first Index of the first argument register to fill
+ * @param argc Number of arguments, at most 6 - \ref first.
+ * @param callconv One of e32_callconv
+ * @return Size of the prologue, at most 24 bytes.
+ */
+static size_t s_e32_int_prologue( char * dest, unsigned first, unsigned argc, int callconv )
+{
+    // %rdi, %rsi, %rdx, %rcx, %r8, %r9
+    static const unsigned char arg_regs[] = { 7, 6, 2, 1, 8, 9 };
+    
+    // %eax, %edx, %ecx
+    static const unsigned char regparm_regs[] = { 0, 2, 1 };
+    // %ecx, %edx
+    static const unsigned char fastcall_regs[] = { 1, 2 };
+    
+    const unsigned char * src_regs = callconv == E32_CC_FASTCALL ? fastcall_regs : regparm_regs;
+    const unsigned nregs = callconv == E32_CC_FASTCALL ? 2 : (unsigned)callconv;
+
+    // In argument order, so that a source register is read before it is overwritten
+    char * ptr = dest;
+    for ( unsigned i = 0; i < argc; ++i )
     {
-        munmap( e32_libc_text_base, S_E32_LIBC_SECTION_SIZE  );
-        e32_libc_text_base = NULL;
-        return;
+        const unsigned char reg = arg_regs[first + i];
+
+        if ( i < nregs )
+        {
+            if ( reg & 8 )
+            {
+                *ptr++ = 0x41; // REX.B
+            }
+            
+            *ptr++ = 0x89; // mov src, reg
+            *ptr++ = 0xc0 | ( src_regs[i] << 3 ) | ( reg & 7 );
+            continue;
+        }
+
+        if ( reg & 8 )
+        {
+            *ptr++ = 0x44; // REX.R
+        }
+
+        *ptr++ = 0x8b; // mov disp8(%rbp), reg
+        *ptr++ = 0x45 | ( (reg & 7) << 3 );
+        *ptr++ = 20 + 4 * ( i - nregs );
     }
+
+    return ptr - dest;
+}
+
+/**
+ * @brief Code of a function taking \ref argc integer or pointer arguments
+ * @return Size of the prologue
+ */
+static size_t s_e32_int_code( unsigned argc, char * prologue, const char ** epilogue, size_t * epilogue_size )
+{
+    *epilogue = NULL;
+    *epilogue_size = 0;
     
-    e32_function_ptr ptr = (e32_function_ptr)(uint64_t)e32_libc_text_base;
-    const e32_function_ptr end = ptr + S_E32_LIBC_SECTION_SIZE ;
+    return s_e32_int_prologue( prologue, 0, argc, E32_CC_CDECL );
+}
+
+/**
+ * @brief Write the prologue that moves \ref argc double arguments into %xmm0, %xmm1...
+ * @param dest Destination for the bytecode
+ * @param argc Number of arguments, at most 8.
+ * @return Size of the prologue, at most 40 bytes.
+ */
+static size_t s_e32_double_prologue( char * dest, unsigned argc )
+{
+    char * ptr = dest;
+    for ( unsigned i = 0; i < argc; ++i )
+    {
+        *ptr++ = 0xf2; // movsd disp8(%rbp), %xmmi
+        *ptr++ = 0x0f;
+        *ptr++ = 0x10;
+        *ptr++ = 0x45 | ( i << 3 );
+        *ptr++ = 20 + 8 * i;
+    }
+
+    return ptr - dest;
+}
 
-    ptr = s_e32_abort( e32_abort = ptr, end - ptr );
-    ptr = s_e32_abs( e32_abs = ptr, end - ptr );
-    ptr = s_e32_atoi( e32_atoi = ptr, end - ptr );
+/**
+ * @brief Code of a function taking \ref argc doubles and returning a double
+ * 
+ * The 64-bit result comes back in %xmm0, the i386 caller expects it in %st(0).
+ * @return Size of the prologue
+ */
+static size_t s_e32_double_code( unsigned argc, char * prologue, const char ** epilogue, size_t * epilogue_size )
+{
+    static const char double_epilogue[] =
+    {
+        0xf2, 0x0f, 0x11, 0x44, 0x24, 0xf8, // movsd %xmm0, -8(%rsp)
+        0xdd, 0x44, 0x24, 0xf8, // fldl -8(%rsp)
+    };
+    
+    *epilogue = double_epilogue;
+    *epilogue_size = sizeof(double_epilogue);
     
-    // Revoke PROT_WRITE
-    mprotect(e32_libc_text_base, S_E32_LIBC_SECTION_SIZE, PROT_EXEC | PROT_READ );
+    return s_e32_double_prologue( prologue, argc );
 }
 
 /**
- * @brief Release allocated memory
+ * @brief How to generate the wrapper of an e32libc function
  */
-__attribute__((destructor)) static void e32_libc_deinit()
+struct s_e32_libc_function
+{
+    const char * name; ///< Name imported by guest code
+    size_t (*code)( unsigned argc, char * prologue, const char ** epilogue, size_t * epilogue_size );
+    void * target;
+    unsigned argc;
+};
+
+static const struct s_e32_libc_function e32_libc_functions[E32_LIBC_COUNT] =
 {
-    munmap( e32_libc_text_base, S_E32_LIBC_SECTION_SIZE  );
+    [E32_LIBC_ABORT]    = { "abort", &s_e32_int_code, &abort, 0 },
+    [E32_LIBC_ABS]      = { "abs", &s_e32_int_code, &abs, 1 },
+    [E32_LIBC_ATOI]     = { "atoi", &s_e32_int_code, &atoi, 1 },
+    
+    [E32_LIBC_MALLOC]   = { "malloc", &s_e32_int_code, &e32_heap_malloc, 1 },
+    [E32_LIBC_FREE]     = { "free", &s_e32_int_code, &e32_heap_free, 1 },
+    [E32_LIBC_CALLOC]   = { "calloc", &s_e32_int_code, &e32_heap_calloc, 2 },
+    [E32_LIBC_REALLOC]  = { "realloc", &s_e32_int_code, &e32_heap_realloc, 2 },
+    
+    // The host versions are dispatched at load time to the best SIMD variant of the CPU
+    [E32_LIBC_MEMCPY]   = { "memcpy", &s_e32_int_code, &memcpy, 3 },
+    [E32_LIBC_MEMMOVE]  = { "memmove", &s_e32_int_code, &memmove, 3 },
+    [E32_LIBC_MEMSET]   = { "memset", &s_e32_int_code, &memset, 3 },
+    [E32_LIBC_MEMCMP]   = { "memcmp", &s_e32_int_code, &memcmp, 3 },
+    [E32_LIBC_STRLEN]   = { "strlen", &s_e32_int_code, &strlen, 1 },
+    
+    [E32_LIBC_EXP]      = { "exp", &s_e32_double_code, &exp, 1 },
+    [E32_LIBC_LOG]      = { "log", &s_e32_double_code, &log, 1 },
+    [E32_LIBC_SIN]      = { "sin", &s_e32_double_code, &sin, 1 },
+    [E32_LIBC_COS]      = { "cos", &s_e32_double_code, &cos, 1 },
+    [E32_LIBC_POW]      = { "pow", &s_e32_double_code, &pow, 2 },
+    [E32_LIBC_SQRT]     = { "sqrt", &s_e32_double_code, &sqrt, 1 },
+    
+    [E32_LIBC_VEXP]     = { "e32_vexp", &s_e32_int_code, &e32_math_vexp, 3 },
+    [E32_LIBC_VLOG]     = { "e32_vlog", &s_e32_int_code, &e32_math_vlog, 3 },
+    [E32_LIBC_VSIN]     = { "e32_vsin", &s_e32_int_code, &e32_math_vsin, 3 },
+    [E32_LIBC_VCOS]     = { "e32_vcos", &s_e32_int_code, &e32_math_vcos, 3 },
+    [E32_LIBC_VSQRT]    = { "e32_vsqrt", &s_e32_int_code, &e32_math_vsqrt, 3 },
+    [E32_LIBC_VPOW]     = { "e32_vpow", &s_e32_int_code, &e32_math_vpow, 4 },
+};
+
+// Generated entry points, 0 until first use
+static e32_function_ptr e32_libc_entries[E32_LIBC_COUNT];
+
+static pthread_mutex_t e32_libc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+e32_function_ptr e32_libc_entry( int function )
+{
+    if ( function < 0 || function >= E32_LIBC_COUNT )
+    {
+        return (e32_function_ptr)0;
+    }
+    
+    // Pairs with the release store below: the thunk is complete once its address is visible
+    e32_function_ptr ans = __atomic_load_n( &e32_libc_entries[function], __ATOMIC_ACQUIRE );
+    
+    if ( ans )
+    {
+        return ans;
+    }
+    
+    pthread_mutex_lock( &e32_libc_lock );
+    
+    ans = e32_libc_entries[function];
+    
+    if ( !ans )
+    {
+        const struct s_e32_libc_function * f = &e32_libc_functions[function];
+        
+        char prologue[40];
+        const char * epilogue;
+        size_t epilogue_size;
+        const size_t prologue_size = f->code( f->argc, prologue, &epilogue, &epilogue_size );
+        
+        ans = s_e32_make_libc_wrapper( f->name, f->target,
+                                       prologue, prologue_size,
+                                       epilogue, epilogue_size,
+                                       0, 0 );
+        __atomic_store_n( &e32_libc_entries[function], ans, __ATOMIC_RELEASE );
+    }
+    
+    pthread_mutex_unlock( &e32_libc_lock );
+    
+    return ans;
+}
+
+int e32_libc_preload( const int * functions, size_t count )
+{
+    // The adapters first, so that nothing gets between the stubs
+    for ( size_t i = 0; i < count && !e32_probe_enabled(); ++i )
+    {
+        if ( functions[i] < 0 || functions[i] >= E32_LIBC_COUNT )
+        {
+            return -1;
+        }
+        
+        const struct s_e32_libc_function * f = &e32_libc_functions[functions[i]];
+        
+        char prologue[40];
+        const char * epilogue;
+        size_t epilogue_size;
+        const size_t prologue_size = f->code( f->argc, prologue, &epilogue, &epilogue_size );
+        
+        pthread_mutex_lock( &e32_adapter_lock );
+        const e32_function_ptr adapter = s_e32_adapter( prologue, prologue_size, epilogue, epilogue_size );
+        pthread_mutex_unlock( &e32_adapter_lock );
+        
+        if ( !adapter )
+        {
+            return -1;
+        }
+    }
+    
+    for ( size_t i = 0; i < count; ++i )
+    {
+        if ( !e32_libc_entry( functions[i] ) )
+        {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+e32_function_ptr e32_libc_resolve( const char * name )
+{
+    for ( int i = 0; i < E32_LIBC_COUNT; ++i )
+    {
+        if ( strcmp( e32_libc_functions[i].name, name ) == 0 )
+        {
+            return e32_libc_entry( i );
+        }
+    }
+    
+    return (e32_function_ptr)0;
+}
+
+e32_function_ptr e32_make_wrapper( void * target, unsigned argc )
+{
+    return e32_make_wrapper_cc( target, argc, E32_CC_CDECL );
+}
+
+e32_function_ptr e32_make_wrapper_cc( void * target, unsigned argc, int callconv )
+{
+    char prologue[32];
+
+    if ( argc > 6 || callconv < E32_CC_CDECL || callconv > E32_CC_FASTCALL )
+    {
+        return (e32_function_ptr)0;
+    }
+
+    // fastcall callees pop their stack arguments
+    const uint16_t callee_pop = callconv == E32_CC_FASTCALL && argc > 2 ? 4 * ( argc - 2 ) : 0;
+
+    return s_e32_make_libc_wrapper( NULL, target,
+                                    prologue, s_e32_int_prologue( prologue, 0, argc, callconv ),
+                                    NULL, 0,
+                                    callee_pop, callconv != E32_CC_CDECL );
+}
+
+e32_function_ptr e32_make_callback( void * target, void * context, unsigned argc )
+{
+    char prologue[40];
+
+    if ( argc > 5 )
+    {
+        return (e32_function_ptr)0;
+    }
+
+    size_t size = s_e32_int_prologue( prologue, 1, argc, E32_CC_CDECL );
+
+    // movabs $context, %rdi
+    prologue[size++] = 0x48;
+    prologue[size++] = 0xbf;
+    memcpy( prologue + size, &context, sizeof(context) );
+    size += sizeof(context);
+
+    // The context makes every prologue unique, nothing to share
+    return s_e32_make_full_wrapper( NULL, target,
+                                    prologue, size,
+                                    NULL, 0,
+                                    0, 0 );
 }
@@ -1,6 +1,11 @@
 
+#ifndef E32LIBC_E32_LIBC_H
+#define E32LIBC_E32_LIBC_H
+
+#include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -8,6 +13,11 @@ extern "C" {
 
 typedef uint32_t e32_function_ptr;
 
+/**
+ * @brief Size of the guest stack reserved for each thread by \ref e32_thread_stack_jump.
+ */
+#define E32_THREAD_STACK_SIZE (1024 * 1024)
+
 /**
  * @brief Jump on a stack that lives on a 32-bit segment.
  * @param stack_size Size of the new stack
@@ -17,12 +27,669 @@ typedef uint32_t e32_function_ptr;
  */
 int e32_stack_jump( size_t stack_size, void (*f)(void*), void * param );
 
+/**
+ * @brief Jump on the calling thread's guest stack.
+ * 
+ * The stack is allocated on first use and released when the thread exits, so
+ * repeated calls from the same thread do not pay for the mapping. Nested calls
+ * run \ref f on the stack that is already active.
+ * @param f Function that will be called with the new stack
+ * @param param Argument for \ref f.
+ * @return Zero on success, negative value on failure.
+ */
+int e32_thread_stack_jump( void (*f)(void*), void * param );
+
+/**
+ * @brief Pool of the guest stacks
+ *
+ * The stacks of \ref e32_stack_jump, \ref e32_thread_stack_jump and the
+ * fibers are reserved with MAP_NORESERVE above a PROT_NONE guard page, so
+ * that an overflow faults instead of corrupting the memory below, and their
+ * pages are only committed when touched. Released stacks go back to a free
+ * list per size. Up to the high-water mark they keep their pages for the
+ * next user, past it their pages are given back with MADV_FREE.
+ */
+struct e32_stack_pool_stats
+{
+    size_t reserved; ///< Stacks mapped, in use or free
+    size_t free; ///< Stacks in the free lists
+    size_t dirty; ///< Free stacks that may still hold resident pages
+};
+
+void e32_stack_pool_stats( struct e32_stack_pool_stats * stats );
+
+/**
+ * @brief Fill the free list of \ref stack_size up to \ref count stacks, without committing them.
+ * @return Zero on success, negative value on failure.
+ */
+int e32_stack_pool_reserve( size_t stack_size, size_t count );
+
+/**
+ * @brief Number of free stacks that keep their pages, 16 by default.
+ * 
+ * Past it, the stacks released the longest time ago are cleaned first.
+ */
+void e32_stack_pool_set_high_water( size_t stacks );
+
+/**
+ * @brief Unmap the free stacks.
+ */
+void e32_stack_pool_trim();
+
+/**
+ * @brief Call a 32-bit function with a single argument.
+ * 
+ * Must be called from a stack that lives in the low 4GB (see \ref e32_stack_jump).
+ * Any number of threads can enter 32-bit code at the same time.
+ * Once a guest module uses TLS, a thread whose guest TLS can not be set up
+ * does not enter 32-bit code: the call returns -1 with errno set.
+ */
 int e32_enter32_i( e32_function_ptr method, int arg0);
 
-extern e32_function_ptr e32_abort;
-extern e32_function_ptr e32_abs;
-extern e32_function_ptr e32_atoi;
+/**
+ * @brief Call a 32-bit function with \ref argc arguments.
+ * 
+ * Same requirements as \ref e32_enter32_i. The arguments are copied on the
+ * guest stack, so \ref args can live anywhere.
+ */
+int e32_enter32_iv( e32_function_ptr method, const int * args, unsigned argc );
+
+/**
+ * @brief i386 calling conventions of guest functions and wrappers.
+ * 
+ * regparm(n) passes the first n arguments in EAX, EDX and ECX (gcc
+ * -mregparm=n); fastcall passes the first two in ECX and EDX, and the callee
+ * pops the rest. The remaining arguments are on the stack as in cdecl.
+ */
+enum e32_callconv
+{
+    E32_CC_CDECL = 0,
+    E32_CC_REGPARM1 = 1,
+    E32_CC_REGPARM2 = 2,
+    E32_CC_REGPARM3 = 3,
+    E32_CC_FASTCALL = 4
+};
+
+/**
+ * @brief Call a 32-bit function with \ref argc arguments, using \ref callconv.
+ * 
+ * Same requirements as \ref e32_enter32_i. Register arguments are loaded
+ * before the mode switch and are not copied on the guest stack.
+ * @return The result of the call, or -1 if \ref callconv is not valid.
+ */
+int e32_enter32_cc( e32_function_ptr method, int callconv, const int * args, unsigned argc );
+
+/**
+ * @brief Guest executors
+ * 
+ * Long-lived threads that run guest calls submitted by other threads. They
+ * stay on their guest stacks and drain the submission queue without leaving
+ * 32-bit-ready state in between, so host threads never switch mode or touch
+ * guest memory themselves. The queue is a bounded lock-free ring shared by
+ * the executor threads, idle executors and waiting submitters sleep on
+ * futexes.
+ */
+struct e32_executor;
+
+#define E32_CALL_MAX_ARGS 8
+
+/**
+ * @brief A guest call submitted to an executor, and its future result.
+ * 
+ * Owned by the submitter, and must not be moved or reused until the call
+ * is done.
+ */
+struct e32_call
+{
+    e32_function_ptr method;
+    int callconv; ///< One of e32_callconv
+    unsigned argc;
+    int args[E32_CALL_MAX_ARGS];
+    int result; ///< Valid once \ref e32_call_done
+    uint32_t state; ///< Set by e32_executor_submit
+};
+
+/**
+ * @brief Start \ref threads executors.
+ * @param capacity Size of the submission queue, a power of two.
+ * @param cpus If not NULL, executor i is pinned to cpus[i].
+ * @return The executor, or NULL on failure.
+ */
+struct e32_executor * e32_executor_create( unsigned threads, size_t capacity, const int * cpus );
+
+/**
+ * @brief Queue \ref call, without blocking.
+ * @return Zero on success, negative value if the queue is full.
+ */
+int e32_executor_submit( struct e32_executor * executor, struct e32_call * call );
+
+int e32_call_done( const struct e32_call * call );
+
+/**
+ * @brief Wait for \ref call to complete, spinning briefly before sleeping.
+ * @return The result of the call.
+ */
+int e32_call_wait( struct e32_call * call );
+
+/**
+ * @brief Run the calls already submitted, then stop and release the executors.
+ */
+void e32_executor_destroy( struct e32_executor * executor );
+
+/**
+ * @brief Instruction sequences that switch between 64-bit and 32-bit mode.
+ * 
+ * Used by e32_enter32_i, e32_enter32_iv and e32_enter32_batch. Which one is
+ * fastest depends on the CPU, far transfers through a memory operand are
+ * microcoded on several generations. Guest calls use lcall unless
+ * E32_SWITCH names another mechanism, or is set to auto to pick the
+ * fastest like \ref e32_switch_autoselect.
+ */
+enum e32_switch_mechanism
+{
+    E32_SWITCH_LCALL, ///< lcall through memory, lret back
+    E32_SWITCH_LJMP, ///< ljmp through memory, direct ljmp back
+    E32_SWITCH_LRETQ, ///< lretq, lret back
+    E32_SWITCH_IRETQ, ///< iretq, lret back
+    E32_SWITCH_COUNT
+};
+
+/**
+ * @return The name of \ref mechanism, as accepted by E32_SWITCH, or NULL.
+ */
+const char * e32_switch_name( int mechanism );
+
+/**
+ * @brief Check that \ref mechanism enters and leaves 32-bit code correctly.
+ * 
+ * The checks run in the calling thread with fault handlers installed, so a
+ * mechanism that faults on this machine is reported instead of crashing the
+ * caller. Faults of other threads meanwhile go to the previous handlers.
+ * @return Zero if the mechanism works, negative value otherwise.
+ */
+int e32_switch_validate( int mechanism );
+
+/**
+ * @return Median cycles of a call to an empty 32-bit function through
+ *         \ref mechanism, negative on failure. Does not validate it.
+ */
+double e32_switch_benchmark( int mechanism );
+
+/**
+ * @brief Validate \ref mechanism and use it for the following guest calls.
+ * @return Zero on success, negative value if it is not valid.
+ */
+int e32_switch_select( int mechanism );
+
+/**
+ * @brief Validate and benchmark every mechanism, and select the fastest.
+ * @return The selected mechanism.
+ */
+int e32_switch_autoselect();
+
+/**
+ * @return The mechanism used by guest calls.
+ */
+int e32_switch_current();
+
+/**
+ * @brief Cooperative fibers on low-memory stacks
+ * 
+ * A fiber runs f(param) on its own stack in the low 4GB, so it can enter
+ * 32-bit code directly. e32_fiber_yield suspends the running fiber and
+ * returns to the code that resumed it; it can be called from a host
+ * function reached through a wrapper, in which case the suspended guest
+ * frames stay on the fiber stack until the next e32_fiber_resume. A
+ * suspended fiber can be resumed by any thread, so host code must not keep
+ * thread-local state across a yield.
+ */
+struct e32_fiber;
+
+/**
+ * @return The new fiber, or NULL on failure.
+ */
+struct e32_fiber * e32_fiber_create( void (*f)(void*), void * param, size_t stack_size );
+
+/**
+ * @brief Run \ref fiber until it yields or finishes.
+ * @return 1 if the fiber yielded, 0 if it finished, -1 if it can not be resumed.
+ */
+int e32_fiber_resume( struct e32_fiber * fiber );
+
+/**
+ * @brief Suspend the running fiber.
+ * @return Zero once resumed, -1 if no fiber is running on this thread.
+ */
+int e32_fiber_yield();
+
+/**
+ * @return The fiber running on this thread, or NULL.
+ */
+struct e32_fiber * e32_fiber_current();
+
+int e32_fiber_done( const struct e32_fiber * fiber );
+
+/**
+ * @brief Release a fiber that is finished, or suspended and never to be resumed.
+ */
+void e32_fiber_destroy( struct e32_fiber * fiber );
+
+/**
+ * @brief Maximum number of arguments of \ref e32_enter32_batch.
+ */
+#define E32_BATCH_MAX_ARGS 16
+
+/**
+ * @brief Call a 32-bit function once per row of arguments, with a single mode switch.
+ * 
+ * results[i] = method( args[i * argc], ..., args[i * argc + argc - 1] ) for i < count.
+ * The loop runs in 32-bit mode. Arrays in the low 4GB are accessed in place,
+ * others are staged through the guest stack in chunks.
+ * Same requirements as \ref e32_enter32_i.
+ * @param argc Number of arguments per call, at most E32_BATCH_MAX_ARGS.
+ * @return Zero on success, negative value on failure.
+ */
+int e32_enter32_batch( e32_function_ptr method, const int * args, unsigned argc, int * results, size_t count );
+
+/**
+ * @brief Generates a 32-bit entry point for a 64-bit function.
+ * 
+ * The wrapper forwards \ref argc 32-bit integer arguments to \ref target and
+ * returns its 32-bit result. Safe to call concurrently with other
+ * registrations and with code running in existing wrappers.
+ * @param target Target function
+ * @param argc Number of arguments, at most 6.
+ * @return The entry point, or 0 on failure.
+ */
+e32_function_ptr e32_make_wrapper( void * target, unsigned argc );
+
+/**
+ * @brief Same as \ref e32_make_wrapper, for guest callers using \ref callconv.
+ * 
+ * Register arguments go straight from EAX, EDX and ECX to the 64-bit
+ * argument registers, without touching the stack.
+ * @return The entry point, or 0 on failure.
+ */
+e32_function_ptr e32_make_wrapper_cc( void * target, unsigned argc, int callconv );
+
+/**
+ * @brief Generates a 32-bit entry point for a 64-bit function bound to a context.
+ * 
+ * The context pointer is embedded in the generated code and passed as the
+ * first argument of \ref target, followed by the \ref argc 32-bit integer
+ * arguments of the guest, i.e. target has the signature
+ * <tt>int (void * context, int, ...)</tt>.
+ * @param target Target function
+ * @param context Passed unchanged to \ref target, can live anywhere.
+ * @param argc Number of guest arguments, at most 5.
+ * @return The entry point, or 0 on failure.
+ */
+e32_function_ptr e32_make_callback( void * target, void * context, unsigned argc );
+
+/**
+ * @brief Fill level of the executable memory that holds the wrappers.
+ * 
+ * Wrappers live in page-sized chunks in the low 4GB. The chunks are never
+ * writable and executable at the same time, they are filled through a
+ * separate writable mapping.
+ */
+struct e32_thunk_arena_stats
+{
+    size_t chunks; ///< Number of pages
+    size_t capacity; ///< Size of the pages, in bytes
+    size_t used; ///< Bytes used by wrappers
+    size_t thunks; ///< Number of wrappers
+};
+
+void e32_thunk_arena_stats( struct e32_thunk_arena_stats * stats );
+
+/**
+ * @brief Symbols for Linux perf
+ * 
+ * When enabled, every wrapper and every function of a module loaded by
+ * elf::loader is described in a perf map file, one "start size name" line
+ * per symbol, so that perf report can symbolize guest code and thunks.
+ * Setting E32_PERF_MAP=1 in the environment enables the default
+ * /tmp/perf-<pid>.map from the start, any other value is used as the path.
+ * Entries are only written while enabled. The file is append-only, as
+ * perf reads it after the run: unloading a module leaves its entries in
+ * place, and a module loaded at a reused address appends its own.
+ * @param path Path of the map file, NULL for /tmp/perf-<pid>.map.
+ * @return Zero on success, negative value on failure.
+ */
+int e32_perf_map_enable( const char * path );
+void e32_perf_map_disable();
+int e32_perf_map_enabled();
+
+/**
+ * @brief Call counters and latency histograms of the wrappers
+ * 
+ * While enabled, the wrappers generated from then on are instrumented: they
+ * count their calls and sample rdtsc around the host function, in
+ * per-thread counters updated without locking. Wrappers generated while
+ * disabled carry no overhead. Setting E32_PROBE=1 in the environment
+ * instruments the e32libc exports as well.
+ */
+#define E32_PROBE_BUCKETS 32
+
+struct e32_probe_stats
+{
+    char name[64]; ///< Exported function, or host target of the wrapper
+    e32_function_ptr thunk; ///< Address of the wrapper
+    uint64_t calls; ///< Calls from guest code
+    uint64_t cycles; ///< Total cycles in the host function
+    uint64_t histogram[E32_PROBE_BUCKETS]; ///< Calls taking [2^i, 2^(i+1)) cycles, the last bucket takes the rest
+};
+
+void e32_probe_enable();
+void e32_probe_disable();
+int e32_probe_enabled();
+
+/**
+ * @brief Sum the counters of all the threads.
+ * @param stats Receives the counters of the first \ref max instrumented wrappers
+ * @param max Size of \ref stats
+ * @return Number of instrumented wrappers, can be larger than \ref max.
+ */
+size_t e32_probe_snapshot( struct e32_probe_stats * stats, size_t max );
+
+/**
+ * @brief Hardware counters around guest calls
+ *
+ * While enabled, every e32_enter32_* call samples rdtsc and the hardware
+ * counters of the calling thread before and after the guest code runs, and
+ * adds the difference to the totals of the called function. The counters
+ * are opened with perf_event_open on the first measured call of each
+ * thread, user space only, so that they work unprivileged as long as
+ * perf_event_paranoid allows. A counter that can not be opened is left out:
+ * with none of them the calls are still timed with rdtsc. Setting
+ * E32_COUNTERS=1 in the environment enables the counters from the start.
+ */
+enum e32_counter
+{
+    E32_COUNTER_CYCLES,
+    E32_COUNTER_INSTRUCTIONS,
+    E32_COUNTER_LLC_MISSES,
+    E32_COUNTER_ITLB_MISSES,
+    E32_COUNTER_COUNT
+};
+
+struct e32_counters_stats
+{
+    e32_function_ptr method; ///< Guest function
+    uint64_t calls; ///< Calls from the host
+    uint64_t tsc; ///< Total rdtsc ticks in the guest function
+    uint64_t counters[E32_COUNTER_COUNT]; ///< Totals, indexed by enum e32_counter
+    unsigned available; ///< Bit (1 << counter) is set if every call was measured by that counter
+};
+
+void e32_counters_enable();
+void e32_counters_disable();
+int e32_counters_enabled();
+
+/**
+ * @return Bit (1 << counter) is set if the calling thread could open that counter, 0 if only rdtsc is available.
+ */
+unsigned e32_counters_available();
+
+/**
+ * @brief Sum the counters of all the threads.
+ * @param stats Receives the counters of the first \ref max guest functions called while enabled
+ * @param max Size of \ref stats
+ * @return Number of guest functions, can be larger than \ref max.
+ */
+size_t e32_counters_snapshot( struct e32_counters_stats * stats, size_t max );
+
+/**
+ * @brief Describe the code at [start, start + size) in the perf map.
+ */
+void e32_perf_map_add( uint32_t start, size_t size, const char * name );
+
+/**
+ * @brief Host functions exported to guest code by e32libc
+ */
+enum e32_libc_function
+{
+    E32_LIBC_ABORT,
+    E32_LIBC_ABS,
+    E32_LIBC_ATOI,
+    E32_LIBC_MALLOC,
+    E32_LIBC_FREE,
+    E32_LIBC_CALLOC,
+    E32_LIBC_REALLOC,
+    E32_LIBC_MEMCPY,
+    E32_LIBC_MEMMOVE,
+    E32_LIBC_MEMSET,
+    E32_LIBC_MEMCMP,
+    E32_LIBC_STRLEN,
+    E32_LIBC_EXP,
+    E32_LIBC_LOG,
+    E32_LIBC_SIN,
+    E32_LIBC_COS,
+    E32_LIBC_POW,
+    E32_LIBC_SQRT,
+    E32_LIBC_VEXP,
+    E32_LIBC_VLOG,
+    E32_LIBC_VSIN,
+    E32_LIBC_VCOS,
+    E32_LIBC_VSQRT,
+    E32_LIBC_VPOW,
+    E32_LIBC_COUNT
+};
+
+/**
+ * @brief Entry point of an e32libc function, one of e32_libc_function.
+ * 
+ * The wrapper is generated the first time it is asked for, so that the
+ * functions a guest never imports cost neither startup time nor thunk
+ * pages. Concurrent callers get the same address.
+ * @return The entry point, or 0 on failure.
+ */
+e32_function_ptr e32_libc_entry( int function );
+
+/**
+ * @brief Generate the entry points of \ref functions, in that order.
+ * 
+ * Entry points are small stubs on adapters shared by the functions with
+ * the same signature. Stubs are laid out in the order they are generated:
+ * listing the hottest functions first, e.g. after a run with the probes,
+ * packs them in the fewest cache lines.
+ * @return Zero on success, negative value on failure.
+ */
+int e32_libc_preload( const int * functions, size_t count );
+
+/**
+ * @brief Entry point of the e32libc function a guest imports as \ref name.
+ * 
+ * Suitable as the import resolver of a loader, e.g. as a fallback of the
+ * host's own symbols.
+ * @return The entry point, or 0 if e32libc does not export \ref name.
+ */
+e32_function_ptr e32_libc_resolve( const char * name );
+
+#define e32_abort    e32_libc_entry( E32_LIBC_ABORT )
+#define e32_abs      e32_libc_entry( E32_LIBC_ABS )
+#define e32_atoi     e32_libc_entry( E32_LIBC_ATOI )
+
+/**
+ * @brief Guest heap
+ * 
+ * malloc, free, calloc and realloc for guest code. Memory always comes from
+ * the low 4GB, so the returned pointers survive the trip through 32-bit
+ * code. Small sizes are served from per-thread caches of size-class slabs,
+ * larger ones get a mapping of their own. Host code can use the
+ * e32_heap_* functions directly, e.g. to hand buffers to guest code.
+ */
+#define e32_malloc   e32_libc_entry( E32_LIBC_MALLOC )
+#define e32_free     e32_libc_entry( E32_LIBC_FREE )
+#define e32_calloc   e32_libc_entry( E32_LIBC_CALLOC )
+#define e32_realloc  e32_libc_entry( E32_LIBC_REALLOC )
+
+void * e32_heap_malloc( size_t size );
+void e32_heap_free( void * ptr );
+void * e32_heap_calloc( size_t nmemb, size_t size );
+void * e32_heap_realloc( void * ptr, size_t size );
+size_t e32_heap_usable_size( void * ptr );
+
+/**
+ * @brief Statistics of the guest heap
+ */
+struct e32_heap_stats
+{
+    size_t in_use; ///< Bytes handed out and not yet freed, rounded to the size class or to pages
+    size_t mapped; ///< Bytes mapped by the heap
+    size_t spans; ///< Slabs for small allocations
+    size_t large_spans; ///< Mappings of large allocations
+    size_t mallocs; ///< Successful allocations
+    size_t frees; ///< Deallocations
+};
+
+void e32_heap_stats( struct e32_heap_stats * stats );
+
+/**
+ * @brief Bulk memory and string routines
+ * 
+ * Thunks onto the host implementations, which use the widest vector
+ * instructions of the CPU. The transition costs a few dozen cycles, so
+ * they pay off on large sizes; see bench/memory_bench.cpp for the
+ * crossover against guest code.
+ */
+#define e32_memcpy   e32_libc_entry( E32_LIBC_MEMCPY )
+#define e32_memmove  e32_libc_entry( E32_LIBC_MEMMOVE )
+#define e32_memset   e32_libc_entry( E32_LIBC_MEMSET )
+#define e32_memcmp   e32_libc_entry( E32_LIBC_MEMCMP )
+#define e32_strlen   e32_libc_entry( E32_LIBC_STRLEN )
+
+/**
+ * @brief libm for guest code
+ * 
+ * Same signatures as libm, with double arguments on the guest stack and the
+ * result returned in %st(0) as the i386 ABI requires.
+ */
+#define e32_exp      e32_libc_entry( E32_LIBC_EXP )
+#define e32_log      e32_libc_entry( E32_LIBC_LOG )
+#define e32_sin      e32_libc_entry( E32_LIBC_SIN )
+#define e32_cos      e32_libc_entry( E32_LIBC_COS )
+#define e32_pow      e32_libc_entry( E32_LIBC_POW )
+#define e32_sqrt     e32_libc_entry( E32_LIBC_SQRT )
+
+/**
+ * @brief Array variants of libm, out[i] = f(in[i]) for i < n
+ * 
+ * One transition for the whole array, computed with the host's vectorized
+ * libm. The guest signatures are
+ * <tt>void e32_vexp( const double * in, double * out, int n )</tt> and
+ * <tt>void e32_vpow( const double * x, const double * y, double * out, int n )</tt>.
+ * in and out may be the same array. The e32_math_* functions are the host side.
+ */
+#define e32_vexp     e32_libc_entry( E32_LIBC_VEXP )
+#define e32_vlog     e32_libc_entry( E32_LIBC_VLOG )
+#define e32_vsin     e32_libc_entry( E32_LIBC_VSIN )
+#define e32_vcos     e32_libc_entry( E32_LIBC_VCOS )
+#define e32_vsqrt    e32_libc_entry( E32_LIBC_VSQRT )
+#define e32_vpow     e32_libc_entry( E32_LIBC_VPOW )
+
+void e32_math_vexp( const double * in, double * out, size_t n );
+void e32_math_vlog( const double * in, double * out, size_t n );
+void e32_math_vsin( const double * in, double * out, size_t n );
+void e32_math_vcos( const double * in, double * out, size_t n );
+void e32_math_vsqrt( const double * in, double * out, size_t n );
+void e32_math_vpow( const double * x, const double * y, double * out, size_t n );
+
+/**
+ * @brief Convert a pointer to a 32-bit guest address.
+ * 
+ * Debug builds assert that \ref p lives in the low 4GB.
+ */
+static inline uint32_t e32_ptr( const void * p )
+{
+    assert( (uint64_t)p <= UINT32_MAX && "pointer not addressable by guest code" );
+    return (uint32_t)(uint64_t)p;
+}
+
+/**
+ * @brief Reference counted buffers in the low 4GB
+ * 
+ * Producers write request data straight into guest-addressable memory and
+ * pass e32_ptr(buffer) to guest code, no copy involved. A buffer is freed
+ * when its last reference is dropped.
+ */
+void * e32_buffer_alloc( size_t size );
+void * e32_buffer_ref( void * buffer );
+void e32_buffer_unref( void * buffer );
+size_t e32_buffer_size( const void * buffer );
+
+/**
+ * @brief Map the content of a file into a read-only buffer in the low 4GB.
+ * @param fd File descriptor, can be closed afterwards
+ * @param size Receives the size of the file
+ * @return The buffer, to be released with \ref e32_buffer_unref, or NULL on failure.
+ */
+void * e32_buffer_map( int fd, size_t * size );
+
+/**
+ * @brief Read up to \ref count bytes from \ref fd into \ref buffer at \ref offset.
+ * 
+ * Retries on short reads and EINTR until \ref count bytes are read or the end of file.
+ * Works on sockets and pipes.
+ * @return Number of bytes read, or -1 on failure.
+ */
+ssize_t e32_buffer_read( int fd, void * buffer, size_t offset, size_t count );
+
+/**
+ * @brief Bump allocator in the low 4GB, released all at once.
+ */
+struct e32_arena;
+
+struct e32_arena * e32_arena_create( size_t chunk_size );
+
+/**
+ * @return A distinct 16-byte aligned block, even for a zero \ref size, or NULL on failure.
+ */
+void * e32_arena_alloc( struct e32_arena * arena, size_t size );
+void e32_arena_reset( struct e32_arena * arena );
+void e32_arena_destroy( struct e32_arena * arena );
+
+/**
+ * @brief Per-thread scratch arena for the arguments of a single guest call.
+ * 
+ * Scratch memory is valid until the next e32_scratch_reset on the same
+ * thread, typically right after the guest call returns.
+ */
+void * e32_scratch_alloc( size_t size );
+void e32_scratch_reset();
+
+/**
+ * @brief Size of the static TLS area shared by all the guest modules, per thread.
+ */
+#define E32_TLS_STATIC_SIZE (64 * 1024)
+
+/**
+ * @brief Thread-local storage of the guest modules
+ * 
+ * Each thread that enters guest code gets a block in the low 4GB and an LDT
+ * descriptor in %gs, so 32-bit code finds its thread pointer at %gs:0 as on
+ * i386 Linux. A module's TLS block is at a fixed offset below the thread
+ * pointer in every thread. The loader reserves it with e32_tls_alloc, and
+ * publishes the initial image with e32_tls_init after relocation; threads
+ * that already exist get a copy right away, new ones on their first guest
+ * call. Fibers see the TLS of the thread that runs them. If the block or
+ * the descriptor of a thread can not be set up, its guest calls fail.
+ * @param[out] offset The block starts at the thread pointer - offset.
+ * @return Zero on success, negative value if the static area is full.
+ */
+int e32_tls_alloc( size_t size, size_t align, uint32_t * offset );
+void e32_tls_init( uint32_t offset, const void * image, size_t image_size );
+void e32_tls_free( uint32_t offset );
+
+/**
+ * @brief Guest implementations of ___tls_get_addr (tls_index in EAX) and __tls_get_addr.
+ */
+extern e32_function_ptr e32_tls_get_addr;
+extern e32_function_ptr e32_tls_get_addr_cdecl;
 
 #ifdef __cplusplus
 }
 #endif //__cplusplus
+
+#endif //E32LIBC_E32_LIBC_H
@@ -0,0 +1,149 @@
+
+#include <math.h>
+#include <stddef.h>
+
+#include <immintrin.h>
+
+#include "e32_libc.h"
+
+/*
+ * Vector variants of libm from glibc's libmvec, see the x86_64 vector
+ * function ABI. The "b" variants take xmm registers and are dispatched by
+ * glibc to the best SSE implementation, the "d" variants need AVX2.
+ */
+__m128d _ZGVbN2v_exp( __m128d x );
+__m128d _ZGVbN2v_log( __m128d x );
+__m128d _ZGVbN2v_sin( __m128d x );
+__m128d _ZGVbN2v_cos( __m128d x );
+__m128d _ZGVbN2vv_pow( __m128d x, __m128d y );
+
+/**
+ * @brief Non-zero if the AVX2 variants can be used.
+ */
+static int s_e32_math_avx2()
+{
+    static int avx2 = -1;
+
+    int ans = __atomic_load_n( &avx2, __ATOMIC_RELAXED );
+
+    if ( ans < 0 )
+    {
+        __builtin_cpu_init();
+        ans = __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" );
+        __atomic_store_n( &avx2, ans, __ATOMIC_RELAXED );
+    }
+
+    return ans;
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+
+__m256d _ZGVdN4v_exp( __m256d x );
+__m256d _ZGVdN4v_log( __m256d x );
+__m256d _ZGVdN4v_sin( __m256d x );
+__m256d _ZGVdN4v_cos( __m256d x );
+__m256d _ZGVdN4vv_pow( __m256d x, __m256d y );
+
+#define S_E32_VMATH_AVX2( name ) \
+static size_t s_e32_v##name##_avx2( const double * in, double * out, size_t n ) \
+{ \
+    size_t i = 0; \
+    for ( ; i + 4 <= n; i += 4 ) \
+    { \
+        _mm256_storeu_pd( out + i, _ZGVdN4v_##name( _mm256_loadu_pd( in + i ) ) ); \
+    } \
+    return i; \
+}
+
+S_E32_VMATH_AVX2( exp )
+S_E32_VMATH_AVX2( log )
+S_E32_VMATH_AVX2( sin )
+S_E32_VMATH_AVX2( cos )
+
+static size_t s_e32_vsqrt_avx2( const double * in, double * out, size_t n )
+{
+    size_t i = 0;
+    for ( ; i + 4 <= n; i += 4 )
+    {
+        _mm256_storeu_pd( out + i, _mm256_sqrt_pd( _mm256_loadu_pd( in + i ) ) );
+    }
+    return i;
+}
+
+static size_t s_e32_vpow_avx2( const double * x, const double * y, double * out, size_t n )
+{
+    size_t i = 0;
+    for ( ; i + 4 <= n; i += 4 )
+    {
+        _mm256_storeu_pd( out + i, _ZGVdN4vv_pow( _mm256_loadu_pd( x + i ), _mm256_loadu_pd( y + i ) ) );
+    }
+    return i;
+}
+
+#pragma GCC pop_options
+
+#define S_E32_VMATH_SSE( name ) \
+static size_t s_e32_v##name##_sse( const double * in, double * out, size_t n ) \
+{ \
+    size_t i = 0; \
+    for ( ; i + 2 <= n; i += 2 ) \
+    { \
+        _mm_storeu_pd( out + i, _ZGVbN2v_##name( _mm_loadu_pd( in + i ) ) ); \
+    } \
+    return i; \
+}
+
+S_E32_VMATH_SSE( exp )
+S_E32_VMATH_SSE( log )
+S_E32_VMATH_SSE( sin )
+S_E32_VMATH_SSE( cos )
+
+static size_t s_e32_vsqrt_sse( const double * in, double * out, size_t n )
+{
+    size_t i = 0;
+    for ( ; i + 2 <= n; i += 2 )
+    {
+        _mm_storeu_pd( out + i, _mm_sqrt_pd( _mm_loadu_pd( in + i ) ) );
+    }
+    return i;
+}
+
+static size_t s_e32_vpow_sse( const double * x, const double * y, double * out, size_t n )
+{
+    size_t i = 0;
+    for ( ; i + 2 <= n; i += 2 )
+    {
+        _mm_storeu_pd( out + i, _ZGVbN2vv_pow( _mm_loadu_pd( x + i ), _mm_loadu_pd( y + i ) ) );
+    }
+    return i;
+}
+
+/*
+ * The public entry points run the widest vector loop available, and
+ * finish the tail with the scalar function.
+ */
+#define S_E32_VMATH( name ) \
+void e32_math_v##name( const double * in, double * out, size_t n ) \
+{ \
+    size_t i = s_e32_math_avx2() ? s_e32_v##name##_avx2( in, out, n ) : s_e32_v##name##_sse( in, out, n ); \
+    for ( ; i < n; ++i ) \
+    { \
+        out[i] = name( in[i] ); \
+    } \
+}
+
+S_E32_VMATH( exp )
+S_E32_VMATH( log )
+S_E32_VMATH( sin )
+S_E32_VMATH( cos )
+S_E32_VMATH( sqrt )
+
+void e32_math_vpow( const double * x, const double * y, double * out, size_t n )
+{
+    size_t i = s_e32_math_avx2() ? s_e32_vpow_avx2( x, y, out, n ) : s_e32_vpow_sse( x, y, out, n );
+    for ( ; i < n; ++i )
+    {
+        out[i] = pow( x[i], y[i] );
+    }
+}
@@ -0,0 +1,125 @@
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "e32_libc.h"
+
+// Written with e32_perf_map_lock held, read without it to check if the map is enabled
+static int e32_perf_map_fd = -1;
+
+static pthread_mutex_t e32_perf_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t e32_perf_map_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Open the map file, called with e32_perf_map_lock held.
+ */
+static int s_e32_perf_map_open( const char * path )
+{
+    char default_path[PATH_MAX];
+
+    if ( !path )
+    {
+        snprintf( default_path, sizeof(default_path), "/tmp/perf-%d.map", (int)getpid() );
+        path = default_path;
+    }
+
+    const int fd = open( path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+
+    if ( fd < 0 )
+    {
+        return -1;
+    }
+
+    if ( e32_perf_map_fd >= 0 )
+    {
+        close( e32_perf_map_fd );
+    }
+
+    __atomic_store_n( &e32_perf_map_fd, fd, __ATOMIC_RELAXED );
+
+    return 0;
+}
+
+/**
+ * @brief E32_PERF_MAP=1 writes the default file, any other non-empty value is the path.
+ */
+static void s_e32_perf_map_env_init()
+{
+    const char * env = getenv( "E32_PERF_MAP" );
+
+    if ( !env || !*env || strcmp( env, "0" ) == 0 )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &e32_perf_map_lock );
+    s_e32_perf_map_open( strcmp( env, "1" ) == 0 ? NULL : env );
+    pthread_mutex_unlock( &e32_perf_map_lock );
+}
+
+int e32_perf_map_enable( const char * path )
+{
+    pthread_once( &e32_perf_map_once, &s_e32_perf_map_env_init );
+
+    pthread_mutex_lock( &e32_perf_map_lock );
+    const int ans = s_e32_perf_map_open( path );
+    pthread_mutex_unlock( &e32_perf_map_lock );
+
+    return ans;
+}
+
+void e32_perf_map_disable()
+{
+    pthread_once( &e32_perf_map_once, &s_e32_perf_map_env_init );
+
+    pthread_mutex_lock( &e32_perf_map_lock );
+
+    if ( e32_perf_map_fd >= 0 )
+    {
+        close( e32_perf_map_fd );
+        __atomic_store_n( &e32_perf_map_fd, -1, __ATOMIC_RELAXED );
+    }
+
+    pthread_mutex_unlock( &e32_perf_map_lock );
+}
+
+int e32_perf_map_enabled()
+{
+    pthread_once( &e32_perf_map_once, &s_e32_perf_map_env_init );
+
+    return __atomic_load_n( &e32_perf_map_fd, __ATOMIC_RELAXED ) >= 0;
+}
+
+void e32_perf_map_add( uint32_t start, size_t size, const char * name )
+{
+    if ( !e32_perf_map_enabled() )
+    {
+        return;
+    }
+
+    char line[512];
+    const int length = snprintf( line, sizeof(line), "%x %zx %s\n", start, size, name );
+
+    if ( length < 0 || (size_t)length >= sizeof(line) )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &e32_perf_map_lock );
+
+    // O_APPEND, a single write per entry
+    if ( e32_perf_map_fd >= 0 && write( e32_perf_map_fd, line, length ) != length )
+    {
+        close( e32_perf_map_fd );
+        __atomic_store_n( &e32_perf_map_fd, -1, __ATOMIC_RELAXED );
+    }
+
+    pthread_mutex_unlock( &e32_perf_map_lock );
+}
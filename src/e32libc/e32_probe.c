@@ -0,0 +1,304 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <x86intrin.h>
+
+#include "e32_libc.h"
+#include "e32_probe.h"
+
+// Counters and sites are allocated in blocks, so that they never move
+#define S_E32_PROBE_BLOCK_SIZE  64
+#define S_E32_PROBE_MAX_BLOCKS  1024
+
+struct s_e32_probe_counters
+{
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t histogram[E32_PROBE_BUCKETS];
+};
+
+struct s_e32_probe_site
+{
+    char name[64];
+    e32_function_ptr thunk;
+};
+
+/**
+ * @brief Counters of one thread, only written by that thread
+ */
+struct s_e32_probe_thread
+{
+    struct s_e32_probe_counters * blocks[S_E32_PROBE_MAX_BLOCKS];
+
+    struct s_e32_probe_thread * prev;
+    struct s_e32_probe_thread * next;
+};
+
+static int e32_probe_on;
+
+static struct s_e32_probe_site * e32_probe_sites[S_E32_PROBE_MAX_BLOCKS];
+static uint32_t e32_probe_nsites;
+
+// Live threads, and counters of the exited ones
+static struct s_e32_probe_thread * e32_probe_threads;
+static struct s_e32_probe_thread e32_probe_totals;
+
+static pthread_mutex_t e32_probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t e32_probe_once = PTHREAD_ONCE_INIT;
+
+static __thread struct s_e32_probe_thread * e32_probe_thread;
+static pthread_key_t e32_probe_thread_key;
+
+/**
+ * @brief Release the counters of an exiting thread, after adding them to the totals.
+ */
+static void s_e32_probe_thread_release( void * data )
+{
+    struct s_e32_probe_thread * thread = data;
+
+    pthread_mutex_lock( &e32_probe_lock );
+
+    for ( unsigned b = 0; b < S_E32_PROBE_MAX_BLOCKS; ++b )
+    {
+        if ( !thread->blocks[b] )
+        {
+            continue;
+        }
+
+        if ( !e32_probe_totals.blocks[b] )
+        {
+            e32_probe_totals.blocks[b] = calloc( S_E32_PROBE_BLOCK_SIZE, sizeof(struct s_e32_probe_counters) );
+        }
+
+        for ( unsigned i = 0; i < S_E32_PROBE_BLOCK_SIZE && e32_probe_totals.blocks[b]; ++i )
+        {
+            struct s_e32_probe_counters * dest = &e32_probe_totals.blocks[b][i];
+            const struct s_e32_probe_counters * src = &thread->blocks[b][i];
+
+            dest->calls += src->calls;
+            dest->cycles += src->cycles;
+            for ( unsigned k = 0; k < E32_PROBE_BUCKETS; ++k )
+            {
+                dest->histogram[k] += src->histogram[k];
+            }
+        }
+    }
+
+    if ( thread->prev )
+    {
+        thread->prev->next = thread->next;
+    }
+    else
+    {
+        e32_probe_threads = thread->next;
+    }
+
+    if ( thread->next )
+    {
+        thread->next->prev = thread->prev;
+    }
+
+    pthread_mutex_unlock( &e32_probe_lock );
+
+    for ( unsigned b = 0; b < S_E32_PROBE_MAX_BLOCKS; ++b )
+    {
+        free( thread->blocks[b] );
+    }
+
+    free( thread );
+    e32_probe_thread = NULL;
+}
+
+/**
+ * @brief E32_PROBE=1 in the environment instruments every wrapper from the start.
+ */
+static void s_e32_probe_init()
+{
+    pthread_key_create( &e32_probe_thread_key, &s_e32_probe_thread_release );
+
+    const char * env = getenv( "E32_PROBE" );
+
+    if ( env && strcmp( env, "1" ) == 0 )
+    {
+        __atomic_store_n( &e32_probe_on, 1, __ATOMIC_RELAXED );
+    }
+}
+
+void e32_probe_enable()
+{
+    pthread_once( &e32_probe_once, &s_e32_probe_init );
+    __atomic_store_n( &e32_probe_on, 1, __ATOMIC_RELAXED );
+}
+
+void e32_probe_disable()
+{
+    pthread_once( &e32_probe_once, &s_e32_probe_init );
+    __atomic_store_n( &e32_probe_on, 0, __ATOMIC_RELAXED );
+}
+
+int e32_probe_enabled()
+{
+    pthread_once( &e32_probe_once, &s_e32_probe_init );
+    return __atomic_load_n( &e32_probe_on, __ATOMIC_RELAXED );
+}
+
+uint32_t e32_probe_register( const char * name, e32_function_ptr thunk )
+{
+    pthread_mutex_lock( &e32_probe_lock );
+
+    const uint32_t id = e32_probe_nsites;
+    const uint32_t b = id / S_E32_PROBE_BLOCK_SIZE;
+
+    if ( b >= S_E32_PROBE_MAX_BLOCKS )
+    {
+        pthread_mutex_unlock( &e32_probe_lock );
+        return E32_PROBE_NONE;
+    }
+
+    if ( !e32_probe_sites[b] )
+    {
+        e32_probe_sites[b] = calloc( S_E32_PROBE_BLOCK_SIZE, sizeof(struct s_e32_probe_site) );
+
+        if ( !e32_probe_sites[b] )
+        {
+            pthread_mutex_unlock( &e32_probe_lock );
+            return E32_PROBE_NONE;
+        }
+    }
+
+    struct s_e32_probe_site * site = &e32_probe_sites[b][id % S_E32_PROBE_BLOCK_SIZE];
+    strncpy( site->name, name, sizeof(site->name) - 1 );
+    site->thunk = thunk;
+
+    e32_probe_nsites = id + 1;
+
+    pthread_mutex_unlock( &e32_probe_lock );
+
+    return id;
+}
+
+static struct s_e32_probe_thread * s_e32_probe_thread()
+{
+    if ( e32_probe_thread )
+    {
+        return e32_probe_thread;
+    }
+
+    struct s_e32_probe_thread * thread = calloc( 1, sizeof(*thread) );
+
+    if ( !thread )
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock( &e32_probe_lock );
+
+    thread->next = e32_probe_threads;
+    if ( e32_probe_threads )
+    {
+        e32_probe_threads->prev = thread;
+    }
+    e32_probe_threads = thread;
+
+    pthread_mutex_unlock( &e32_probe_lock );
+
+    pthread_setspecific( e32_probe_thread_key, thread );
+
+    return e32_probe_thread = thread;
+}
+
+/**
+ * @brief Add to a counter of the current thread, read concurrently by e32_probe_snapshot.
+ */
+static void s_e32_probe_count( uint64_t * counter, uint64_t value )
+{
+    __atomic_store_n( counter, *counter + value, __ATOMIC_RELAXED );
+}
+
+void e32_probe_record( uint32_t id, uint64_t start )
+{
+    const uint64_t cycles = __rdtsc() - start;
+
+    struct s_e32_probe_thread * thread = s_e32_probe_thread();
+
+    if ( !thread )
+    {
+        return;
+    }
+
+    const uint32_t b = id / S_E32_PROBE_BLOCK_SIZE;
+
+    if ( !thread->blocks[b] )
+    {
+        struct s_e32_probe_counters * block = calloc( S_E32_PROBE_BLOCK_SIZE, sizeof(struct s_e32_probe_counters) );
+
+        if ( !block )
+        {
+            return;
+        }
+
+        __atomic_store_n( &thread->blocks[b], block, __ATOMIC_RELEASE );
+    }
+
+    struct s_e32_probe_counters * counters = &thread->blocks[b][id % S_E32_PROBE_BLOCK_SIZE];
+
+    const unsigned bucket = 63 - __builtin_clzll( cycles | 1 );
+
+    s_e32_probe_count( &counters->calls, 1 );
+    s_e32_probe_count( &counters->cycles, cycles );
+    s_e32_probe_count( &counters->histogram[ bucket < E32_PROBE_BUCKETS ? bucket : E32_PROBE_BUCKETS - 1 ], 1 );
+}
+
+/**
+ * @brief Add the counters of a thread for site \ref id to \ref stats.
+ */
+static void s_e32_probe_sum( struct e32_probe_stats * stats, const struct s_e32_probe_thread * thread, uint32_t id )
+{
+    const struct s_e32_probe_counters * block =
+        __atomic_load_n( &thread->blocks[id / S_E32_PROBE_BLOCK_SIZE], __ATOMIC_ACQUIRE );
+
+    if ( !block )
+    {
+        return;
+    }
+
+    const struct s_e32_probe_counters * counters = &block[id % S_E32_PROBE_BLOCK_SIZE];
+
+    stats->calls += __atomic_load_n( &counters->calls, __ATOMIC_RELAXED );
+    stats->cycles += __atomic_load_n( &counters->cycles, __ATOMIC_RELAXED );
+
+    for ( unsigned k = 0; k < E32_PROBE_BUCKETS; ++k )
+    {
+        stats->histogram[k] += __atomic_load_n( &counters->histogram[k], __ATOMIC_RELAXED );
+    }
+}
+
+size_t e32_probe_snapshot( struct e32_probe_stats * stats, size_t max )
+{
+    pthread_mutex_lock( &e32_probe_lock );
+
+    const size_t n = e32_probe_nsites;
+
+    for ( size_t id = 0; id < n && id < max; ++id )
+    {
+        const struct s_e32_probe_site * site = &e32_probe_sites[id / S_E32_PROBE_BLOCK_SIZE][id % S_E32_PROBE_BLOCK_SIZE];
+
+        memset( &stats[id], 0, sizeof(stats[id]) );
+        memcpy( stats[id].name, site->name, sizeof(stats[id].name) );
+        stats[id].thunk = site->thunk;
+
+        s_e32_probe_sum( &stats[id], &e32_probe_totals, id );
+
+        for ( const struct s_e32_probe_thread * thread = e32_probe_threads; thread; thread = thread->next )
+        {
+            s_e32_probe_sum( &stats[id], thread, id );
+        }
+    }
+
+    pthread_mutex_unlock( &e32_probe_lock );
+
+    return n;
+}
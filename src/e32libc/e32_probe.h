@@ -0,0 +1,32 @@
+
+#ifndef E32LIBC_E32_PROBE_H
+#define E32LIBC_E32_PROBE_H
+
+#include <stdint.h>
+
+#include "e32_libc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+#define E32_PROBE_NONE ((uint32_t)-1)
+
+/**
+ * @brief Allocate the counters of a new instrumented thunk.
+ * @return Identifier of the site, or E32_PROBE_NONE if there is no room left.
+ */
+uint32_t e32_probe_register( const char * name, e32_function_ptr thunk );
+
+/**
+ * @brief Called by instrumented thunks after the host function returns.
+ * @param id Identifier of the site
+ * @param start rdtsc before the host call
+ */
+void e32_probe_record( uint32_t id, uint64_t start );
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif //E32LIBC_E32_PROBE_H
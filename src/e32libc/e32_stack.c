@@ -0,0 +1,383 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "e32_libc.h"
+#include "e32_stack.h"
+
+// Free stacks kept per size, the others are unmapped
+#define S_E32_STACK_POOL_MAX 4096
+
+// Free stacks that keep their pages by default
+#define S_E32_STACK_HIGH_WATER 16
+
+/**
+ * @brief A reserved stack, the descriptor lives outside of guest reach.
+ */
+struct s_e32_stack
+{
+    void * base; ///< Lowest usable address, the guard page is right below
+    size_t size;
+    int dirty; ///< Pages may still be resident
+    struct s_e32_stack * next;
+    struct s_e32_stack * newer; ///< Dirty free stacks, in release order
+    struct s_e32_stack * older;
+};
+
+/**
+ * @brief Free stacks of one size, most recently released first.
+ */
+struct s_e32_stack_class
+{
+    size_t size;
+    struct s_e32_stack * free;
+    size_t nfree;
+    struct s_e32_stack_class * next;
+};
+
+static struct s_e32_stack_class * e32_stack_classes;
+
+// Descriptors of the stacks handed out, reused on release
+static struct s_e32_stack * e32_stack_spare;
+
+// Dirty free stacks of all sizes, the oldest are cleaned first
+static struct s_e32_stack * e32_stack_newest;
+static struct s_e32_stack * e32_stack_oldest;
+
+static struct e32_stack_pool_stats e32_stack_stats;
+static size_t e32_stack_high_water = S_E32_STACK_HIGH_WATER;
+
+static pthread_mutex_t e32_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t s_e32_stack_round( size_t stack_size )
+{
+    const size_t pagesize = getpagesize();
+    return ( stack_size + pagesize - 1 ) & ~( pagesize - 1 );
+}
+
+static struct s_e32_stack_class * s_e32_stack_class( size_t size )
+{
+    for ( struct s_e32_stack_class * c = e32_stack_classes; c; c = c->next )
+    {
+        if ( c->size == size )
+        {
+            return c;
+        }
+    }
+
+    struct s_e32_stack_class * c = calloc( 1, sizeof(*c) );
+
+    if ( c )
+    {
+        c->size = size;
+        c->next = e32_stack_classes;
+        e32_stack_classes = c;
+    }
+
+    return c;
+}
+
+/**
+ * @brief Reserve a new stack and its guard page, nothing is committed until touched.
+ */
+static struct s_e32_stack * s_e32_stack_map( size_t size )
+{
+    const size_t pagesize = getpagesize();
+
+    struct s_e32_stack * stack = calloc( 1, sizeof(*stack) );
+
+    if ( !stack )
+    {
+        return NULL;
+    }
+
+    char * p = mmap( NULL,
+                     pagesize + size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_32BIT | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1, 0 );
+
+    if ( p == MAP_FAILED )
+    {
+        free( stack );
+        return NULL;
+    }
+
+    // An overflow faults instead of running into the mapping below
+    if ( mprotect( p, pagesize, PROT_NONE ) != 0 )
+    {
+        munmap( p, pagesize + size );
+        free( stack );
+        return NULL;
+    }
+
+    stack->base = p + pagesize;
+    stack->size = size;
+    ++e32_stack_stats.reserved;
+
+    return stack;
+}
+
+static void s_e32_stack_unmap( struct s_e32_stack * stack, size_t size )
+{
+    const size_t pagesize = getpagesize();
+
+    munmap( (char*)stack->base - pagesize, pagesize + size );
+    free( stack );
+
+    --e32_stack_stats.reserved;
+}
+
+static void s_e32_stack_dirty_push( struct s_e32_stack * stack )
+{
+    stack->newer = NULL;
+    stack->older = e32_stack_newest;
+
+    if ( e32_stack_newest )
+    {
+        e32_stack_newest->newer = stack;
+    }
+    else
+    {
+        e32_stack_oldest = stack;
+    }
+
+    e32_stack_newest = stack;
+    ++e32_stack_stats.dirty;
+}
+
+static void s_e32_stack_dirty_remove( struct s_e32_stack * stack )
+{
+    if ( stack->newer )
+    {
+        stack->newer->older = stack->older;
+    }
+    else
+    {
+        e32_stack_newest = stack->older;
+    }
+
+    if ( stack->older )
+    {
+        stack->older->newer = stack->newer;
+    }
+    else
+    {
+        e32_stack_oldest = stack->newer;
+    }
+
+    stack->newer = stack->older = NULL;
+    --e32_stack_stats.dirty;
+}
+
+/**
+ * @brief Give the pages of an unused stack back to the kernel, keeping the reservation.
+ *
+ * MADV_FREE only drops them under memory pressure, and a reuse before that
+ * does not fault at all.
+ */
+static void s_e32_stack_clean( struct s_e32_stack * stack )
+{
+#ifdef MADV_FREE
+    if ( madvise( stack->base, stack->size, MADV_FREE ) != 0 )
+#endif
+    {
+        madvise( stack->base, stack->size, MADV_DONTNEED );
+    }
+
+    stack->dirty = 0;
+}
+
+/**
+ * @brief Clean the least recently released stacks until the high-water mark is met.
+ *
+ * The most recent ones are the next to be reused, and the likeliest to
+ * still be in the cache.
+ */
+static void s_e32_stack_clean_oldest()
+{
+    while ( e32_stack_oldest && e32_stack_stats.dirty > e32_stack_high_water )
+    {
+        struct s_e32_stack * stack = e32_stack_oldest;
+
+        s_e32_stack_dirty_remove( stack );
+        s_e32_stack_clean( stack );
+    }
+}
+
+/**
+ * @brief Put a stack on the free list of its size, or unmap it if the list is full.
+ */
+static void s_e32_stack_release( struct s_e32_stack_class * c, struct s_e32_stack * stack, size_t size )
+{
+    if ( !c || c->nfree >= S_E32_STACK_POOL_MAX )
+    {
+        s_e32_stack_unmap( stack, size );
+        return;
+    }
+
+    ++e32_stack_stats.free;
+
+    stack->next = c->free;
+    c->free = stack;
+    ++c->nfree;
+
+    if ( stack->dirty )
+    {
+        s_e32_stack_dirty_push( stack );
+        s_e32_stack_clean_oldest();
+    }
+}
+
+void * e32_stack_alloc( size_t stack_size )
+{
+    const size_t size = s_e32_stack_round( stack_size );
+
+    pthread_mutex_lock( &e32_stack_lock );
+
+    struct s_e32_stack_class * c = s_e32_stack_class( size );
+    struct s_e32_stack * stack = c ? c->free : NULL;
+
+    if ( stack )
+    {
+        c->free = stack->next;
+        --c->nfree;
+        --e32_stack_stats.free;
+
+        if ( stack->dirty )
+        {
+            s_e32_stack_dirty_remove( stack );
+        }
+    }
+    else
+    {
+        stack = s_e32_stack_map( size );
+    }
+
+    void * base = NULL;
+
+    if ( stack )
+    {
+        // The descriptor waits for the next release
+        base = stack->base;
+        stack->next = e32_stack_spare;
+        e32_stack_spare = stack;
+    }
+
+    pthread_mutex_unlock( &e32_stack_lock );
+
+    return base;
+}
+
+void e32_stack_free( void * base, size_t stack_size )
+{
+    if ( !base )
+    {
+        return;
+    }
+
+    const size_t size = s_e32_stack_round( stack_size );
+
+    pthread_mutex_lock( &e32_stack_lock );
+
+    struct s_e32_stack * stack = e32_stack_spare;
+
+    if ( stack )
+    {
+        e32_stack_spare = stack->next;
+    }
+    else
+    {
+        stack = malloc( sizeof(*stack) );
+    }
+
+    if ( stack )
+    {
+        // Whether the guest touched it or not
+        stack->base = base;
+        stack->size = size;
+        stack->dirty = 1;
+        s_e32_stack_release( s_e32_stack_class( size ), stack, size );
+    }
+    else
+    {
+        munmap( (char*)base - getpagesize(), getpagesize() + size );
+        --e32_stack_stats.reserved;
+    }
+
+    pthread_mutex_unlock( &e32_stack_lock );
+}
+
+int e32_stack_pool_reserve( size_t stack_size, size_t count )
+{
+    const size_t size = s_e32_stack_round( stack_size );
+
+    pthread_mutex_lock( &e32_stack_lock );
+
+    struct s_e32_stack_class * c = s_e32_stack_class( size );
+    int ans = c ? 0 : -1;
+
+    while ( ans == 0 && c->nfree < count && c->nfree < S_E32_STACK_POOL_MAX )
+    {
+        struct s_e32_stack * stack = s_e32_stack_map( size );
+
+        if ( !stack )
+        {
+            ans = -1;
+            break;
+        }
+
+        s_e32_stack_release( c, stack, size );
+    }
+
+    pthread_mutex_unlock( &e32_stack_lock );
+
+    return ans;
+}
+
+void e32_stack_pool_set_high_water( size_t stacks )
+{
+    pthread_mutex_lock( &e32_stack_lock );
+
+    e32_stack_high_water = stacks;
+    s_e32_stack_clean_oldest();
+
+    pthread_mutex_unlock( &e32_stack_lock );
+}
+
+void e32_stack_pool_trim()
+{
+    pthread_mutex_lock( &e32_stack_lock );
+
+    for ( struct s_e32_stack_class * c = e32_stack_classes; c; c = c->next )
+    {
+        while ( c->free )
+        {
+            struct s_e32_stack * stack = c->free;
+            c->free = stack->next;
+
+            if ( stack->dirty )
+            {
+                s_e32_stack_dirty_remove( stack );
+            }
+
+            --e32_stack_stats.free;
+            s_e32_stack_unmap( stack, c->size );
+        }
+
+        c->nfree = 0;
+    }
+
+    pthread_mutex_unlock( &e32_stack_lock );
+}
+
+void e32_stack_pool_stats( struct e32_stack_pool_stats * stats )
+{
+    pthread_mutex_lock( &e32_stack_lock );
+    *stats = e32_stack_stats;
+    pthread_mutex_unlock( &e32_stack_lock );
+}
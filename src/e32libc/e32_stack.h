@@ -0,0 +1,30 @@
+
+#ifndef E32LIBC_E32_STACK_H
+#define E32LIBC_E32_STACK_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+/**
+ * @brief Take a stack in the low 4GB of the address space from the pool.
+ *
+ * The page below the stack is a guard page. The stack is rounded up to
+ * whole pages.
+ * @return The lowest address of the stack, to be released with \ref e32_stack_free, or NULL on failure.
+ */
+void * e32_stack_alloc( size_t stack_size );
+
+/**
+ * @brief Give a stack back to the pool.
+ * @param stack_size Size passed to \ref e32_stack_alloc
+ */
+void e32_stack_free( void * stack, size_t stack_size );
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif //E32LIBC_E32_STACK_H
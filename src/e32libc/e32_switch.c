@@ -0,0 +1,376 @@
+
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <x86intrin.h>
+
+#include "e32_libc.h"
+#include "e32_switch.h"
+#include "e32_thunk_arena.h"
+
+#define S_E32_SWITCH_ROUNDS 15
+#define S_E32_SWITCH_CALLS  256
+
+const struct e32_switch_ops * e32_switch_active;
+
+static pthread_once_t e32_switch_once = PTHREAD_ONCE_INIT;
+static pthread_once_t e32_switch_probe_once = PTHREAD_ONCE_INIT;
+
+// 32-bit functions returning a + 2 * b (+ c), used to check and time the mechanisms
+static e32_function_ptr e32_switch_probe;
+static e32_function_ptr e32_switch_probe_regparm;
+static e32_function_ptr e32_switch_probe_fastcall;
+
+static void s_e32_switch_probe_init()
+{
+    static const char code[] =
+    {
+        0x8b, 0x44, 0x24, 0x04, // mov 4(%esp), %eax
+        0x8b, 0x4c, 0x24, 0x08, // mov 8(%esp), %ecx
+        0x8d, 0x04, 0x48, // lea (%eax,%ecx,2), %eax
+        0xc3, // ret
+        0x90, 0x90, 0x90, 0x90,
+
+        // regparm(3)
+        0x8d, 0x04, 0x50, // lea (%eax,%edx,2), %eax
+        0x01, 0xc8, // add %ecx, %eax
+        0xc3, // ret
+        0x90, 0x90,
+
+        // fastcall, c on the stack
+        0x8d, 0x04, 0x51, // lea (%ecx,%edx,2), %eax
+        0x03, 0x44, 0x24, 0x04, // add 4(%esp), %eax
+        0xc2, 0x04, 0x00, // ret $4
+    };
+
+    void * dest;
+    const e32_function_ptr addr = e32_thunk_arena_alloc( 64, &dest );
+
+    if ( addr )
+    {
+        memcpy( dest, code, sizeof(code) );
+        e32_thunk_arena_commit( addr );
+        e32_switch_probe_regparm = addr + 16;
+        e32_switch_probe_fastcall = addr + 24;
+        e32_switch_probe = addr;
+    }
+}
+
+static const struct e32_switch_ops * s_e32_switch_get( int mechanism )
+{
+    if ( mechanism < 0 || mechanism >= E32_SWITCH_COUNT )
+    {
+        return NULL;
+    }
+
+    pthread_once( &e32_switch_probe_once, &s_e32_switch_probe_init );
+
+    return e32_switch_probe ? &e32_switch_table[mechanism] : NULL;
+}
+
+struct s_e32_switch_job
+{
+    const struct e32_switch_ops * ops;
+    double result;
+};
+
+/**
+ * @brief Exercise every entry point, on a guest stack.
+ * @return Zero if all the results are correct.
+ */
+static int s_e32_switch_check( const struct e32_switch_ops * ops )
+{
+    int args[2 * 8];
+    int results[8];
+
+    for ( int round = 0; round < 100; ++round )
+    {
+        if ( ops->enter32_i( e32_switch_probe, round ) != 3 * round )
+        {
+            return -1;
+        }
+
+        const int pair[2] = { round, -7 };
+
+        if ( ops->enter32_iv( e32_switch_probe, pair, 2 ) != round - 14 )
+        {
+            return -1;
+        }
+
+        const int regs[3] = { round, 5, 1 };
+        const int fastcall_regs[3] = { 0, 5, round };
+
+        if ( ops->enter32_cc( e32_switch_probe_regparm, regs, NULL, 0 ) != round + 11 ||
+             ops->enter32_cc( e32_switch_probe_fastcall, fastcall_regs, &regs[2], 1 ) != round + 11 )
+        {
+            return -1;
+        }
+
+        for ( int i = 0; i < 8; ++i )
+        {
+            args[2 * i] = i;
+            args[2 * i + 1] = round;
+            results[i] = -1;
+        }
+
+        ops->enter32_batch( e32_switch_probe, args, 2, results, 8 );
+
+        for ( int i = 0; i < 8; ++i )
+        {
+            if ( results[i] != i + 2 * round )
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Signals raised by a mechanism that does not work on this kernel or CPU
+static const int e32_switch_fault_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGTRAP };
+
+#define S_E32_SWITCH_FAULTS ( sizeof(e32_switch_fault_signals) / sizeof(e32_switch_fault_signals[0]) )
+
+// One validation at a time owns the fault handlers
+static pthread_mutex_t e32_switch_validate_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction e32_switch_previous[S_E32_SWITCH_FAULTS];
+
+// Set on the thread running s_e32_switch_check
+static __thread sigjmp_buf * e32_switch_fault_jump;
+
+/**
+ * @brief Abort the check that faulted, hand the faults of other threads to the previous handler.
+ */
+static void s_e32_switch_fault( int sig, siginfo_t * info, void * context )
+{
+    if ( e32_switch_fault_jump )
+    {
+        siglongjmp( *e32_switch_fault_jump, 1 );
+    }
+
+    for ( unsigned i = 0; i < S_E32_SWITCH_FAULTS; ++i )
+    {
+        const struct sigaction * previous = &e32_switch_previous[i];
+
+        if ( e32_switch_fault_signals[i] != sig )
+        {
+            continue;
+        }
+
+        if ( previous->sa_flags & SA_SIGINFO )
+        {
+            previous->sa_sigaction( sig, info, context );
+        }
+        else if ( previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN )
+        {
+            previous->sa_handler( sig );
+        }
+        else
+        {
+            // The faulting instruction runs again, and gets the default action
+            sigaction( sig, previous, NULL );
+        }
+    }
+}
+
+/**
+ * @brief Run the check in this process, a fault in 32-bit mode fails it.
+ */
+static void s_e32_switch_validate_job( void * data )
+{
+    struct s_e32_switch_job * job = data;
+
+    struct sigaction action;
+    memset( &action, 0, sizeof(action) );
+    action.sa_sigaction = &s_e32_switch_fault;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset( &action.sa_mask );
+
+    pthread_mutex_lock( &e32_switch_validate_lock );
+
+    for ( unsigned i = 0; i < S_E32_SWITCH_FAULTS; ++i )
+    {
+        sigaction( e32_switch_fault_signals[i], &action, &e32_switch_previous[i] );
+    }
+
+    sigjmp_buf env;
+    volatile int ans = -1;
+
+    if ( sigsetjmp( env, 1 ) == 0 )
+    {
+        e32_switch_fault_jump = &env;
+        ans = s_e32_switch_check( job->ops );
+    }
+
+    e32_switch_fault_jump = NULL;
+
+    for ( unsigned i = 0; i < S_E32_SWITCH_FAULTS; ++i )
+    {
+        sigaction( e32_switch_fault_signals[i], &e32_switch_previous[i], NULL );
+    }
+
+    pthread_mutex_unlock( &e32_switch_validate_lock );
+
+    job->result = ans;
+}
+
+int e32_switch_validate( int mechanism )
+{
+    struct s_e32_switch_job job = { s_e32_switch_get( mechanism ), -1 };
+
+    if ( !job.ops || e32_thread_stack_jump( &s_e32_switch_validate_job, &job ) != 0 )
+    {
+        return -1;
+    }
+
+    return (int)job.result;
+}
+
+static int s_e32_switch_compare( const void * a, const void * b )
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+
+    return ( x > y ) - ( x < y );
+}
+
+static void s_e32_switch_benchmark_job( void * data )
+{
+    struct s_e32_switch_job * job = data;
+    double samples[S_E32_SWITCH_ROUNDS];
+
+    // Warm up the caches and the branch predictors
+    for ( int i = 0; i < S_E32_SWITCH_CALLS; ++i )
+    {
+        job->ops->enter32_i( e32_switch_probe, i );
+    }
+
+    for ( int r = 0; r < S_E32_SWITCH_ROUNDS; ++r )
+    {
+        const uint64_t start = __rdtsc();
+
+        for ( int i = 0; i < S_E32_SWITCH_CALLS; ++i )
+        {
+            job->ops->enter32_i( e32_switch_probe, i );
+        }
+
+        samples[r] = (double)( __rdtsc() - start ) / S_E32_SWITCH_CALLS;
+    }
+
+    qsort( samples, S_E32_SWITCH_ROUNDS, sizeof(double), &s_e32_switch_compare );
+
+    job->result = samples[S_E32_SWITCH_ROUNDS / 2];
+}
+
+double e32_switch_benchmark( int mechanism )
+{
+    struct s_e32_switch_job job = { s_e32_switch_get( mechanism ), -1 };
+
+    if ( !job.ops || e32_thread_stack_jump( &s_e32_switch_benchmark_job, &job ) != 0 )
+    {
+        return -1;
+    }
+
+    return job.result;
+}
+
+const char * e32_switch_name( int mechanism )
+{
+    return mechanism >= 0 && mechanism < E32_SWITCH_COUNT ? e32_switch_table[mechanism].name : NULL;
+}
+
+int e32_switch_select( int mechanism )
+{
+    if ( e32_switch_validate( mechanism ) != 0 )
+    {
+        return -1;
+    }
+
+    __atomic_store_n( &e32_switch_active, &e32_switch_table[mechanism], __ATOMIC_RELEASE );
+
+    return 0;
+}
+
+/**
+ * @return The fastest valid mechanism, lcall if none of them can be checked.
+ */
+static int s_e32_switch_fastest()
+{
+    int best = E32_SWITCH_LCALL;
+    double best_cycles = -1;
+
+    for ( int m = 0; m < E32_SWITCH_COUNT; ++m )
+    {
+        if ( e32_switch_validate( m ) != 0 )
+        {
+            continue;
+        }
+
+        const double cycles = e32_switch_benchmark( m );
+
+        if ( cycles >= 0 && ( best_cycles < 0 || cycles < best_cycles ) )
+        {
+            best = m;
+            best_cycles = cycles;
+        }
+    }
+
+    return best;
+}
+
+int e32_switch_autoselect()
+{
+    const int best = s_e32_switch_fastest();
+
+    __atomic_store_n( &e32_switch_active, &e32_switch_table[best], __ATOMIC_RELEASE );
+
+    return best;
+}
+
+/**
+ * @brief E32_SWITCH=lcall|ljmp|lretq|iretq forces a mechanism, if it is valid, auto picks the fastest.
+ *
+ * Otherwise lcall is used as is: nothing is checked or timed behind the
+ * back of the first guest call.
+ */
+static void s_e32_switch_env_init()
+{
+    const char * env = getenv( "E32_SWITCH" );
+    int mechanism = E32_SWITCH_LCALL;
+
+    if ( env && strcmp( env, "auto" ) == 0 )
+    {
+        mechanism = s_e32_switch_fastest();
+    }
+
+    for ( int m = 0; env && m < E32_SWITCH_COUNT; ++m )
+    {
+        if ( strcmp( env, e32_switch_table[m].name ) == 0 && e32_switch_validate( m ) == 0 )
+        {
+            mechanism = m;
+        }
+    }
+
+    // Unless one was selected explicitly in the meantime
+    const struct e32_switch_ops * expected = NULL;
+    __atomic_compare_exchange_n( &e32_switch_active, &expected, &e32_switch_table[mechanism],
+                                 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED );
+}
+
+const struct e32_switch_ops * e32_switch_init()
+{
+    pthread_once( &e32_switch_once, &s_e32_switch_env_init );
+
+    return __atomic_load_n( &e32_switch_active, __ATOMIC_ACQUIRE );
+}
+
+int e32_switch_current()
+{
+    const struct e32_switch_ops * ops = __atomic_load_n( &e32_switch_active, __ATOMIC_ACQUIRE );
+
+    return (int)( ( ops ? ops : e32_switch_init() ) - e32_switch_table );
+}
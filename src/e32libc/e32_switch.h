@@ -0,0 +1,42 @@
+
+#ifndef E32LIBC_E32_SWITCH_H
+#define E32LIBC_E32_SWITCH_H
+
+#include <stdint.h>
+
+#include "e32_libc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+/**
+ * @brief Entry points of one mode-switch mechanism, see e32_enter.c.
+ */
+struct e32_switch_ops
+{
+    const char * name;
+    int (*enter32_i)( e32_function_ptr method, int arg0 );
+    int (*enter32_iv)( e32_function_ptr method, const int * args, unsigned argc );
+    int (*enter32_cc)( e32_function_ptr method, const int * regs, const int * args, unsigned nstack );
+    void (*enter32_batch)( e32_function_ptr method, const int * args, unsigned argc, int * results, uint32_t count );
+};
+
+extern const struct e32_switch_ops e32_switch_table[E32_SWITCH_COUNT];
+
+/**
+ * @brief Mechanism used by e32_enter32_*, NULL until the first call.
+ */
+extern const struct e32_switch_ops * e32_switch_active;
+
+/**
+ * @brief Choose the mechanism from E32_SWITCH, once.
+ * @return The active mechanism.
+ */
+const struct e32_switch_ops * e32_switch_init();
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif //E32LIBC_E32_SWITCH_H
@@ -0,0 +1,209 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "e32_thunk_arena.h"
+
+/**
+ * @brief A page of thunks.
+ */
+struct s_e32_thunk_chunk
+{
+    void * rx;
+    void * rw;
+    size_t writers; ///< Thunks allocated but not committed yet
+};
+
+// Backing file of the arena, every chunk is a page in it.
+static int e32_thunk_arena_fd = -1;
+
+static struct s_e32_thunk_chunk * e32_thunk_arena_chunks;
+static size_t e32_thunk_arena_nchunks;
+
+// First free byte in the last chunk
+static size_t e32_thunk_arena_offset;
+
+static size_t e32_thunk_arena_used;
+static size_t e32_thunk_arena_thunks;
+
+static pthread_mutex_t e32_thunk_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Map a new page in the arena.
+ * @return Zero on success, negative value on failure.
+ */
+static int s_e32_thunk_arena_grow()
+{
+    const size_t pagesize = getpagesize();
+    
+    if ( e32_thunk_arena_fd < 0 )
+    {
+        e32_thunk_arena_fd = memfd_create( "e32_thunks", MFD_CLOEXEC );
+        
+        if ( e32_thunk_arena_fd < 0 )
+        {
+            return -1;
+        }
+    }
+    
+    struct s_e32_thunk_chunk * chunks = realloc( e32_thunk_arena_chunks,
+                                                 (e32_thunk_arena_nchunks + 1) * sizeof(*chunks) );
+    if ( !chunks )
+    {
+        return -1;
+    }
+    
+    e32_thunk_arena_chunks = chunks;
+    
+    const off_t offset = (off_t)(e32_thunk_arena_nchunks * pagesize);
+    
+    if ( ftruncate( e32_thunk_arena_fd, offset + pagesize ) != 0 )
+    {
+        return -1;
+    }
+    
+    void * rx = mmap( NULL, pagesize,
+                      PROT_READ | PROT_EXEC,
+                      MAP_SHARED | MAP_32BIT,
+                      e32_thunk_arena_fd, offset );
+    
+    if ( rx == MAP_FAILED )
+    {
+        return -1;
+    }
+    
+    void * rw = mmap( NULL, pagesize,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED,
+                      e32_thunk_arena_fd, offset );
+    
+    if ( rw == MAP_FAILED )
+    {
+        munmap( rx, pagesize );
+        return -1;
+    }
+    
+    // The previous chunk is full, drop its writable alias once nobody writes through it.
+    if ( e32_thunk_arena_nchunks > 0 )
+    {
+        struct s_e32_thunk_chunk * last = &chunks[ e32_thunk_arena_nchunks - 1 ];
+        
+        if ( last->writers == 0 )
+        {
+            munmap( last->rw, pagesize );
+            last->rw = NULL;
+        }
+    }
+    
+    chunks[ e32_thunk_arena_nchunks ].rx = rx;
+    chunks[ e32_thunk_arena_nchunks ].rw = rw;
+    chunks[ e32_thunk_arena_nchunks ].writers = 0;
+    ++e32_thunk_arena_nchunks;
+    
+    e32_thunk_arena_offset = 0;
+    
+    return 0;
+}
+
+e32_function_ptr e32_thunk_arena_alloc( size_t size, void ** rw_addr )
+{
+    const size_t pagesize = getpagesize();
+    
+    if ( size > pagesize )
+    {
+        return (e32_function_ptr)0;
+    }
+    
+    pthread_mutex_lock( &e32_thunk_arena_lock );
+    
+    e32_function_ptr ans = (e32_function_ptr)0;
+    
+    if ( ( e32_thunk_arena_nchunks > 0 && e32_thunk_arena_offset + size <= pagesize ) ||
+         s_e32_thunk_arena_grow() == 0 )
+    {
+        struct s_e32_thunk_chunk * last = &e32_thunk_arena_chunks[ e32_thunk_arena_nchunks - 1 ];
+        
+        ans = (e32_function_ptr)(uint64_t)last->rx + e32_thunk_arena_offset;
+        *rw_addr = (char*)last->rw + e32_thunk_arena_offset;
+        ++last->writers;
+        
+        e32_thunk_arena_offset += size;
+        e32_thunk_arena_used += size;
+        ++e32_thunk_arena_thunks;
+    }
+    
+    pthread_mutex_unlock( &e32_thunk_arena_lock );
+    
+    return ans;
+}
+
+void e32_thunk_arena_commit( e32_function_ptr addr )
+{
+    const size_t pagesize = getpagesize();
+    
+    pthread_mutex_lock( &e32_thunk_arena_lock );
+    
+    // Most likely in one of the last chunks
+    for ( size_t i = e32_thunk_arena_nchunks; i > 0; --i )
+    {
+        struct s_e32_thunk_chunk * chunk = &e32_thunk_arena_chunks[ i - 1 ];
+        
+        if ( addr < (uint64_t)chunk->rx || addr - (uint64_t)chunk->rx >= pagesize )
+        {
+            continue;
+        }
+        
+        // Full chunks lose their writable alias with the last writer
+        if ( --chunk->writers == 0 && i < e32_thunk_arena_nchunks )
+        {
+            munmap( chunk->rw, pagesize );
+            chunk->rw = NULL;
+        }
+        
+        break;
+    }
+    
+    pthread_mutex_unlock( &e32_thunk_arena_lock );
+}
+
+void e32_thunk_arena_stats( struct e32_thunk_arena_stats * stats )
+{
+    pthread_mutex_lock( &e32_thunk_arena_lock );
+    
+    stats->chunks = e32_thunk_arena_nchunks;
+    stats->capacity = e32_thunk_arena_nchunks * getpagesize();
+    stats->used = e32_thunk_arena_used;
+    stats->thunks = e32_thunk_arena_thunks;
+    
+    pthread_mutex_unlock( &e32_thunk_arena_lock );
+}
+
+/**
+ * @brief Release allocated memory
+ */
+__attribute__((destructor)) static void e32_thunk_arena_deinit()
+{
+    const size_t pagesize = getpagesize();
+    
+    for ( size_t i = 0; i < e32_thunk_arena_nchunks; ++i )
+    {
+        munmap( e32_thunk_arena_chunks[i].rx, pagesize );
+        if ( e32_thunk_arena_chunks[i].rw )
+        {
+            munmap( e32_thunk_arena_chunks[i].rw, pagesize );
+        }
+    }
+    
+    free( e32_thunk_arena_chunks );
+    
+    if ( e32_thunk_arena_fd >= 0 )
+    {
+        close( e32_thunk_arena_fd );
+    }
+}
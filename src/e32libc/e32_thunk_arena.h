@@ -0,0 +1,38 @@
+
+#ifndef E32LIBC_E32_THUNK_ARENA_H
+#define E32LIBC_E32_THUNK_ARENA_H
+
+#include <stddef.h>
+
+#include "e32_libc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+/**
+ * @brief Reserve executable memory for a thunk.
+ * 
+ * The memory is mapped twice: read-execute in the low 4GB, and read-write
+ * somewhere else. The thunk must be written through \ref rw_addr, which
+ * stays valid until \ref e32_thunk_arena_commit, even if other threads
+ * allocate meanwhile.
+ * @param size Size of the thunk, at most one page.
+ * @param[out] rw_addr Writable alias of the returned address.
+ * @return The executable address, or 0 on failure.
+ */
+e32_function_ptr e32_thunk_arena_alloc( size_t size, void ** rw_addr );
+
+/**
+ * @brief End the write of the thunk at \ref addr.
+ * 
+ * The returned address can be handed out from then on, and its writable
+ * alias must not be used anymore.
+ */
+void e32_thunk_arena_commit( e32_function_ptr addr );
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif //E32LIBC_E32_THUNK_ARENA_H
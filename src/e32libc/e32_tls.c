@@ -0,0 +1,386 @@
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <asm/ldt.h>
+#include <pthread.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "e32_libc.h"
+#include "e32_thunk_arena.h"
+#include "e32_tls.h"
+
+#define S_E32_TLS_MAX_MODULES   64
+#define S_E32_TLS_LDT_ENTRIES   8192
+
+/*
+ * i386 TLS, variant II: %gs:0 holds the thread pointer, the block of each
+ * module sits at a fixed offset below it. The layout is shared by every
+ * thread, so the offsets can be resolved at load.
+ */
+
+/**
+ * @brief Start of the i386 glibc TCB, at the thread pointer
+ */
+struct s_e32_tls_tcb
+{
+    uint32_t tcb; ///< Thread pointer, %gs:0
+    uint32_t dtv;
+    uint32_t self;
+    uint32_t multiple_threads;
+    uint32_t sysinfo;
+    uint32_t stack_guard; ///< %gs:0x14, read by -fstack-protector
+    uint32_t pointer_guard;
+};
+
+struct s_e32_tls_module
+{
+    uint32_t offset; ///< The block starts at the thread pointer - offset
+    uint32_t size;
+    const void * image; ///< .tdata, NULL until e32_tls_init
+    size_t image_size;
+};
+
+/**
+ * @brief Static TLS area of one thread, followed by its TCB page
+ */
+struct s_e32_tls_thread
+{
+    char * block;
+    int ldt_entry;
+
+    struct s_e32_tls_thread * prev;
+    struct s_e32_tls_thread * next;
+};
+
+int e32_tls_active;
+__thread uint32_t e32_tls_thread_pointer;
+
+e32_function_ptr e32_tls_get_addr;
+e32_function_ptr e32_tls_get_addr_cdecl;
+
+static struct s_e32_tls_module e32_tls_modules[S_E32_TLS_MAX_MODULES];
+static unsigned e32_tls_nmodules;
+static uint32_t e32_tls_used;
+
+static struct s_e32_tls_thread * e32_tls_threads;
+static unsigned char e32_tls_ldt_used[S_E32_TLS_LDT_ENTRIES];
+
+static pthread_mutex_t e32_tls_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t e32_tls_once = PTHREAD_ONCE_INIT;
+static pthread_key_t e32_tls_thread_key;
+
+/**
+ * @brief Point LDT entry \ref entry to \ref base, or clear it if base is 0.
+ */
+static int s_e32_tls_set_ldt( int entry, uint32_t base )
+{
+    struct user_desc desc;
+    memset( &desc, 0, sizeof(desc) );
+
+    desc.entry_number = entry;
+
+    if ( base )
+    {
+        desc.base_addr = base;
+        desc.limit = 0xfffff;
+        desc.seg_32bit = 1;
+        desc.limit_in_pages = 1;
+        desc.useable = 1;
+    }
+    else
+    {
+        desc.read_exec_only = 1;
+        desc.seg_not_present = 1;
+    }
+
+    return syscall( SYS_modify_ldt, 0x11, &desc, sizeof(desc) ) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Copy the initial image of \ref module in the block of \ref thread.
+ */
+static void s_e32_tls_copy( const struct s_e32_tls_thread * thread, const struct s_e32_tls_module * module )
+{
+    char * dest = thread->block + E32_TLS_STATIC_SIZE - module->offset;
+
+    memcpy( dest, module->image, module->image_size );
+    memset( dest + module->image_size, 0, module->size - module->image_size );
+}
+
+/**
+ * @brief Release the block of an exiting thread
+ */
+static void s_e32_tls_thread_release( void * data )
+{
+    struct s_e32_tls_thread * thread = data;
+
+    asm volatile ( "mov %0, %%gs" : : "r"(0) );
+
+    pthread_mutex_lock( &e32_tls_lock );
+
+    if ( thread->prev )
+    {
+        thread->prev->next = thread->next;
+    }
+    else
+    {
+        e32_tls_threads = thread->next;
+    }
+
+    if ( thread->next )
+    {
+        thread->next->prev = thread->prev;
+    }
+
+    s_e32_tls_set_ldt( thread->ldt_entry, 0 );
+    e32_tls_ldt_used[thread->ldt_entry] = 0;
+
+    pthread_mutex_unlock( &e32_tls_lock );
+
+    munmap( thread->block, E32_TLS_STATIC_SIZE + getpagesize() );
+    free( thread );
+
+    e32_tls_thread_pointer = 0;
+}
+
+/**
+ * @brief Write __tls_get_addr for the general and local dynamic models.
+ * 
+ * The first word of tls_index is the offset of the module block below the
+ * thread pointer (see R_386_TLS_DTPMOD32), the second one the offset of the
+ * variable in the block.
+ */
+static void s_e32_tls_init()
+{
+    static const char code[] =
+    {
+        // ___tls_get_addr, tls_index in EAX
+        0x8b, 0x48, 0x04, // mov 4(%eax), %ecx
+        0x8b, 0x10, // mov (%eax), %edx
+        0x65, 0xa1, 0x00, 0x00, 0x00, 0x00, // mov %gs:0, %eax
+        0x29, 0xd0, // sub %edx, %eax
+        0x01, 0xc8, // add %ecx, %eax
+        0xc3, // ret
+
+        // __tls_get_addr, tls_index on the stack
+        0x8b, 0x44, 0x24, 0x04, // mov 4(%esp), %eax
+        0xeb, 0xea, // jmp ___tls_get_addr
+    };
+
+    pthread_key_create( &e32_tls_thread_key, &s_e32_tls_thread_release );
+
+    void * dest;
+    const e32_function_ptr addr = e32_thunk_arena_alloc( 32, &dest );
+
+    if ( addr )
+    {
+        memcpy( dest, code, sizeof(code) );
+        e32_thunk_arena_commit( addr );
+        e32_tls_get_addr = addr;
+        e32_tls_get_addr_cdecl = addr + 16;
+    }
+}
+
+__attribute__((constructor)) static void e32_tls_constructor()
+{
+    pthread_once( &e32_tls_once, &s_e32_tls_init );
+}
+
+int e32_tls_thread_init()
+{
+    if ( e32_tls_thread_pointer )
+    {
+        return 0;
+    }
+
+    const size_t pagesize = getpagesize();
+
+    struct s_e32_tls_thread * thread = calloc( 1, sizeof(*thread) );
+
+    if ( !thread )
+    {
+        return -1;
+    }
+
+    // The TCB page follows the static area, the thread pointer is page aligned
+    thread->block = mmap( NULL, E32_TLS_STATIC_SIZE + pagesize,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_32BIT | MAP_ANONYMOUS,
+                          -1, 0 );
+
+    if ( thread->block == MAP_FAILED )
+    {
+        free( thread );
+        return -1;
+    }
+
+    const uint32_t tp = e32_ptr( thread->block + E32_TLS_STATIC_SIZE );
+
+    struct s_e32_tls_tcb * tcb = (struct s_e32_tls_tcb *)( thread->block + E32_TLS_STATIC_SIZE );
+    tcb->tcb = tp;
+    tcb->self = tp;
+
+    const uint32_t * random = (const uint32_t *)getauxval( AT_RANDOM );
+    tcb->stack_guard = random ? random[0] & ~(uint32_t)0xff : 0;
+    tcb->pointer_guard = random ? random[1] : 0;
+
+    pthread_mutex_lock( &e32_tls_lock );
+
+    thread->ldt_entry = -1;
+    for ( int i = 0; i < S_E32_TLS_LDT_ENTRIES && thread->ldt_entry < 0; ++i )
+    {
+        if ( !e32_tls_ldt_used[i] )
+        {
+            thread->ldt_entry = i;
+        }
+    }
+
+    if ( thread->ldt_entry < 0 )
+    {
+        errno = ENOSPC;
+    }
+
+    if ( thread->ldt_entry < 0 || s_e32_tls_set_ldt( thread->ldt_entry, tp ) != 0 )
+    {
+        const int error = errno;
+
+        pthread_mutex_unlock( &e32_tls_lock );
+        munmap( thread->block, E32_TLS_STATIC_SIZE + pagesize );
+        free( thread );
+        errno = error;
+        return -1;
+    }
+
+    e32_tls_ldt_used[thread->ldt_entry] = 1;
+
+    for ( unsigned i = 0; i < e32_tls_nmodules; ++i )
+    {
+        if ( e32_tls_modules[i].image )
+        {
+            s_e32_tls_copy( thread, &e32_tls_modules[i] );
+        }
+    }
+
+    thread->next = e32_tls_threads;
+    if ( e32_tls_threads )
+    {
+        e32_tls_threads->prev = thread;
+    }
+    e32_tls_threads = thread;
+
+    pthread_mutex_unlock( &e32_tls_lock );
+
+    pthread_once( &e32_tls_once, &s_e32_tls_init );
+    pthread_setspecific( e32_tls_thread_key, thread );
+
+    // Unused by 64-bit code, and kept across the mode switches
+    const uint32_t selector = ( thread->ldt_entry << 3 ) | 7;
+    asm volatile ( "mov %0, %%gs" : : "r"(selector) );
+
+    e32_tls_thread_pointer = tp;
+
+    return 0;
+}
+
+int e32_tls_alloc( size_t size, size_t align, uint32_t * offset )
+{
+    if ( align == 0 )
+    {
+        align = 1;
+    }
+
+    if ( ( align & ( align - 1 ) ) != 0 || align > (size_t)getpagesize() || size > E32_TLS_STATIC_SIZE )
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock( &e32_tls_lock );
+
+    // Below the blocks of the previous modules, aligned since the thread pointer is page aligned
+    const size_t end = ( e32_tls_used + size + align - 1 ) & ~( align - 1 );
+
+    if ( end > E32_TLS_STATIC_SIZE || e32_tls_nmodules == S_E32_TLS_MAX_MODULES )
+    {
+        pthread_mutex_unlock( &e32_tls_lock );
+        return -1;
+    }
+
+    struct s_e32_tls_module * module = &e32_tls_modules[e32_tls_nmodules++];
+    module->offset = end;
+    module->size = size;
+    module->image = NULL;
+    module->image_size = 0;
+
+    e32_tls_used = end;
+    *offset = end;
+
+    pthread_mutex_unlock( &e32_tls_lock );
+
+    return 0;
+}
+
+static struct s_e32_tls_module * s_e32_tls_find( uint32_t offset )
+{
+    for ( unsigned i = 0; i < e32_tls_nmodules; ++i )
+    {
+        if ( e32_tls_modules[i].offset == offset )
+        {
+            return &e32_tls_modules[i];
+        }
+    }
+
+    return NULL;
+}
+
+void e32_tls_init( uint32_t offset, const void * image, size_t image_size )
+{
+    pthread_mutex_lock( &e32_tls_lock );
+
+    struct s_e32_tls_module * module = s_e32_tls_find( offset );
+
+    if ( module )
+    {
+        module->image = image;
+        module->image_size = image_size < module->size ? image_size : module->size;
+
+        // No guest code of the module ran yet, so its blocks are not in use
+        for ( const struct s_e32_tls_thread * thread = e32_tls_threads; thread; thread = thread->next )
+        {
+            s_e32_tls_copy( thread, module );
+        }
+
+        __atomic_store_n( &e32_tls_active, 1, __ATOMIC_RELAXED );
+    }
+
+    pthread_mutex_unlock( &e32_tls_lock );
+}
+
+void e32_tls_free( uint32_t offset )
+{
+    pthread_mutex_lock( &e32_tls_lock );
+
+    struct s_e32_tls_module * module = s_e32_tls_find( offset );
+
+    if ( module )
+    {
+        *module = e32_tls_modules[--e32_tls_nmodules];
+
+        // Only the space at the end of the area can be reused
+        e32_tls_used = 0;
+        for ( unsigned i = 0; i < e32_tls_nmodules; ++i )
+        {
+            if ( e32_tls_modules[i].offset > e32_tls_used )
+            {
+                e32_tls_used = e32_tls_modules[i].offset;
+            }
+        }
+    }
+
+    pthread_mutex_unlock( &e32_tls_lock );
+}
@@ -0,0 +1,43 @@
+
+#ifndef E32LIBC_E32_TLS_H
+#define E32LIBC_E32_TLS_H
+
+#include <stdint.h>
+
+#include "e32_libc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif //__cplusplus
+
+// Non-zero once a module with TLS is loaded
+extern int e32_tls_active;
+
+// Thread pointer of the calling thread, zero until its block is set up
+extern __thread uint32_t e32_tls_thread_pointer;
+
+/**
+ * @brief Allocate the TLS block of the calling thread, and point %gs to it.
+ * @return Zero on success, negative value with errno set on failure.
+ */
+int e32_tls_thread_init();
+
+/**
+ * @brief Make sure the calling thread can run guest code that uses TLS.
+ * @return Zero if it can, negative value with errno set if its %gs can not be set up.
+ */
+static inline int e32_tls_thread_check()
+{
+    if ( __builtin_expect( __atomic_load_n( &e32_tls_active, __ATOMIC_RELAXED ) && !e32_tls_thread_pointer, 0 ) )
+    {
+        return e32_tls_thread_init();
+    }
+
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif //E32LIBC_E32_TLS_H
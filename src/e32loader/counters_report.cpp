@@ -0,0 +1,93 @@
+
+#include "counters_report.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+namespace elf
+{
+
+std::vector< counters_row > counters_report( std::vector< loader const * > const & modules )
+{
+    std::vector< e32_counters_stats > stats( 64 );
+
+    // More functions may be called meanwhile
+    for ( size_t n; ( n = e32_counters_snapshot( stats.data(), stats.size() ) ) > stats.size(); )
+    {
+        stats.resize( n * 2 );
+    }
+
+    std::vector< counters_row > ans;
+
+    for ( auto const & s : stats )
+    {
+        if ( s.method == 0 || s.calls == 0 )
+        {
+            continue;
+        }
+
+        std::string symbol;
+
+        for ( loader const * module : modules )
+        {
+            if ( !( symbol = module->symbol_at( s.method ) ).empty() )
+            {
+                break;
+            }
+        }
+
+        if ( symbol.empty() )
+        {
+            std::ostringstream os;
+            os << "0x" << std::hex << s.method;
+            symbol = os.str();
+        }
+
+        ans.push_back( counters_row{ std::move(symbol), s } );
+    }
+
+    std::sort( ans.begin(), ans.end(),
+               []( counters_row const & a, counters_row const & b ) { return a.stats.tsc > b.stats.tsc; } );
+
+    return ans;
+}
+
+void print_counters_report( std::ostream & os, std::vector< counters_row > const & rows )
+{
+    static const char * const headers[] = { "calls", "tsc", "cycles", "instr", "llc miss", "itlb miss" };
+
+    os << std::left << std::setw(32) << "function" << std::right;
+    for ( const char * h : headers )
+    {
+        os << std::setw(12) << h;
+    }
+    os << '\n';
+
+    for ( auto const & row : rows )
+    {
+        auto const & s = row.stats;
+        const double calls = static_cast<double>( s.calls );
+
+        os << std::left << std::setw(32) << row.symbol << std::right
+           << std::setw(12) << s.calls
+           << std::setw(12) << std::fixed << std::setprecision(1) << s.tsc / calls;
+
+        for ( unsigned k = 0; k < E32_COUNTER_COUNT; ++k )
+        {
+            if ( s.available & ( 1u << k ) )
+            {
+                os << std::setw(12) << s.counters[k] / calls;
+            }
+            else
+            {
+                os << std::setw(12) << "-";
+            }
+        }
+
+        os << '\n';
+    }
+}
+
+} //namespace elf
@@ -0,0 +1,41 @@
+
+#ifndef E32LOADER_COUNTERS_REPORT_H
+#define E32LOADER_COUNTERS_REPORT_H
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "e32_libc.h"
+#include "loader.h"
+
+namespace elf
+{
+
+/**
+ * @brief Hardware counters of a guest function, see e32_counters_snapshot.
+ */
+struct counters_row
+{
+    std::string symbol; ///< Export of one of the modules, or the address in hex
+    e32_counters_stats stats;
+};
+
+/**
+ * @brief Counters of every guest function called so far, the most expensive first.
+ *
+ * Names are resolved through the exports of \ref modules, functions that
+ * none of them exports are named by their address.
+ */
+std::vector< counters_row > counters_report( std::vector< loader const * > const & modules );
+
+/**
+ * @brief One line per function: calls, then rdtsc ticks, cycles, instructions, LLC and iTLB misses per call.
+ *
+ * Counters that could not be measured on every call are printed as "-".
+ */
+void print_counters_report( std::ostream & os, std::vector< counters_row > const & rows );
+
+} //namespace elf
+
+#endif //E32LOADER_COUNTERS_REPORT_H
@@ -54,6 +54,7 @@ enum class pt : word_t
     note        = 0x4,
     shlib       = 0x5,
     phdr        = 0x6,
+    tls         = 0x7,
     loproc      = 0x70000000,
     hiproc      = 0x7fffffff
 };
@@ -96,6 +97,20 @@ enum class sht : word_t
     hiuser = 0xffffffff
 };
 
+/**
+ * @brief Elf symbol type, the low nibble of @c st_info
+ */
+enum class stt : unsigned char
+{
+    notype      = 0,
+    object      = 1,
+    func        = 2,
+    section     = 3,
+    file        = 4,
+    common      = 5,
+    tls         = 6
+};
+
 /**
  * @brief Elf relocation types
  */
@@ -111,7 +126,11 @@ enum class r_386
     jmp_slot    = 7, //!< S
     relative    = 8, //!< B + A
     gotoff      = 9, //!< S + A - GOT 
-    gotpc       = 10 //!< GOT + A - P
+    gotpc       = 10, //!< GOT + A - P
+    tls_tpoff   = 14, //!< Negative offset of the variable from the thread pointer
+    tls_dtpmod32 = 35, //!< Module of the variable, for __tls_get_addr
+    tls_dtpoff32 = 36, //!< Offset of the variable in the module block
+    tls_tpoff32 = 37 //!< Positive offset of the variable below the thread pointer
 };
 
 /**
@@ -180,6 +199,11 @@ struct symbol_table_entry
     unsigned char   st_info;
     unsigned char   st_other;
     half_t          st_shndx;
+    
+    stt type() const
+    {
+        return stt(st_info & 0xF);
+    }
 };
 
 /**
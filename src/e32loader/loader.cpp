@@ -1,8 +1,10 @@
 
 #include "loader.h"
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
+#include <unordered_set>
 #include <vector>
 
 #include <boost/range/adaptor/transformed.hpp>
@@ -12,6 +14,9 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+#include <e32_libc.h>
 
 #include "parser.h"
 
@@ -80,12 +85,57 @@ std::unordered_map< std::string, uint32_t > read_elf32_dynsym( const parser & p,
 
     for ( const symbol_table_entry & ste : p.symbols(*dynsym_section_hdr) )
     {
+        // Imports, and TLS variables that have no address of their own
+        if ( ste.st_shndx == 0 || ste.type() == stt::tls )
+        {
+            continue;
+        }
+        
         symbols.emplace( get_symbol_name(ste), reinterpret_cast<uint64_t>(vs.at(ste.st_value) ) );
     }
     
     return symbols;
 }
 
+/**
+ * @brief Describe the functions of the module in the perf map
+ * 
+ * Uses .symtab when the module is not stripped, the exported symbols otherwise.
+ */
+void write_elf32_perf_map( const parser & p, mmap_region const & vs, const char * filename )
+{
+    const char * basename = std::strrchr( filename, '/' );
+    basename = basename ? basename + 1 : filename;
+
+    std::unordered_set< uint32_t > written;
+
+    for ( const section_header & sec : p.section_headers() )
+    {
+        if ( sec.sh_type != sht::symtab && sec.sh_type != sht::dynsym )
+        {
+            continue;
+        }
+
+        const auto symbol_names = p.string_table( sec.sh_link );
+
+        for ( const symbol_table_entry & ste : p.symbols(sec) )
+        {
+            if ( ste.type() != stt::func || ste.st_shndx == 0 || ste.st_size == 0 || ste.st_name == 0 )
+            {
+                continue;
+            }
+
+            const uint32_t address = reinterpret_cast<uint64_t>( vs.at(ste.st_value) );
+
+            if ( written.insert( address ).second )
+            {
+                const std::string name = std::string(basename) + "::" + symbol_names.get_string( ste.st_name ).to_string();
+                e32_perf_map_add( address, ste.st_size, name.c_str() );
+            }
+        }
+    }
+}
+
 inline uint32_t read_uint32_t( char * base, uint32_t offset )
 {
     uint32_t ans;
@@ -104,7 +154,8 @@ inline void write_uint32_t( char * base, uint32_t offset, uint32_t value)
 void relocate_elf32( const parser & p, 
                      const section_header & reloc_sec,
                      mmap_region const & vs,
-                     std::function<uint32_t(std::experimental::string_view)> const & get_sym )
+                     std::function<uint32_t(std::experimental::string_view)> const & get_sym,
+                     unique_tls const & tls )
 {
     assert( reloc_sec.sh_type == sht::rel );
     
@@ -118,6 +169,25 @@ void relocate_elf32( const parser & p,
             return ste.st_name == 0 ? string_view() : symbol_names.get_string( ste.st_name );
         };
 
+    auto get_symbol_size = [ symbols = p.symbols(symtab) ] ( half_t sym ) { return symbols[sym].st_size; };
+    auto get_symbol_value = [ symbols = p.symbols(symtab) ] ( half_t sym ) { return symbols[sym].st_value; };
+
+    // Offset of a variable in the TLS block of the module, the null symbol stands for the module itself
+    auto get_tls_value = [ symbols = p.symbols(symtab), &tls ] ( half_t sym ) -> uint32_t
+    {
+        if ( !tls )
+        {
+            throw std::runtime_error("TLS relocation in a module without TLS");
+        }
+
+        if ( sym != 0 && symbols[sym].st_shndx == 0 )
+        {
+            throw std::runtime_error("TLS variables of other modules are not supported");
+        }
+
+        return sym != 0 ? symbols[sym].st_value : 0;
+    };
+
     for ( const relocation & r : p.relocations( reloc_sec ) )
     {
         const string_view symbol_name = get_symbol_name(r.sym());
@@ -140,9 +210,43 @@ void relocate_elf32( const parser & p,
         case r_386::relative:
             write_uint32_t( base, r.r_offset, A + B );
             break;
+        case r_386::_32:
+            write_uint32_t( base, r.r_offset, S + A );
+            break;
         case r_386::glob_dat:
-            // Not impl.
-            write_uint32_t( base, r.r_offset, get_sym( "abort") );
+            write_uint32_t( base, r.r_offset, S );
+            break;
+        case r_386::copy:
+        {
+            // Initial value of the module's own copy of a host object, S must come from the host
+            const uint32_t own = reinterpret_cast<uint64_t>( vs.at( get_symbol_value( r.sym() ) ) );
+
+            if ( S == 0 || S == own )
+            {
+                throw std::runtime_error("Unresolved copy relocation: " + symbol_name.to_string() );
+            }
+
+            std::memcpy( base + r.r_offset,
+                         reinterpret_cast<const void*>( uint64_t(S) ),
+                         get_symbol_size( r.sym() ) );
+            break;
+        }
+        case r_386::tls_tpoff:
+            write_uint32_t( base, r.r_offset, A + get_tls_value( r.sym() ) - tls.offset() );
+            break;
+        case r_386::tls_tpoff32:
+            write_uint32_t( base, r.r_offset, A + tls.offset() - get_tls_value( r.sym() ) );
+            break;
+        case r_386::tls_dtpmod32:
+            // Only read by e32_tls_get_addr
+            get_tls_value( r.sym() );
+            write_uint32_t( base, r.r_offset, tls.offset() );
+            break;
+        case r_386::tls_dtpoff32:
+            if ( r.sym() != 0 )
+            {
+                write_uint32_t( base, r.r_offset, get_tls_value( r.sym() ) );
+            }
             break;
         default:
             throw std::runtime_error("Unsupported relocation");
@@ -152,8 +256,9 @@ void relocate_elf32( const parser & p,
 
 /**
  * @brief Applies protection flags to all the loaded sections
+ * @return The protection of each page
  */
-void apply_prot_flags( const parser & p, const mmap_region & vs )
+std::vector< int > apply_prot_flags( const parser & p, const mmap_region & vs )
 {
     const std::size_t pagesize = getpagesize();
     assert( vs.size() % pagesize == 0 );
@@ -191,8 +296,75 @@ void apply_prot_flags( const parser & p, const mmap_region & vs )
             throw std::runtime_error("load_elf32::protect");
         }
     }
+    
+    return pageflags;
 }
 
+/**
+ * @brief Map the pages of the image that still hold the bytes of the file from the file itself.
+ * 
+ * Pages changed by the relocations stay anonymous. The others become clean
+ * page cache pages, shared with every other mapping of the file, that can
+ * be dropped and read back.
+ */
+void map_file_pages( const parser & p, const mmap_region & vs, int fd, const char * file, std::size_t filesize )
+{
+    const std::size_t pagesize = getpagesize();
+    
+    for ( const program_header & ph : p.program_headers() )
+    {
+        if ( ph.p_type != pt::load || ( ph.p_vaddr - ph.p_offset ) % pagesize != 0 )
+        {
+            continue;
+        }
+        
+        const std::size_t first = ph.p_vaddr - ph.p_vaddr % pagesize;
+        const std::size_t last = ph.p_vaddr + ph.p_filesz;
+        
+        // Runs of pages that match the file, mapped with one call
+        std::size_t run = first;
+        
+        for ( std::size_t page = first; ; page += pagesize )
+        {
+            bool same = page < last && page < vs.size();
+            
+            if ( same )
+            {
+                const std::size_t offset = page - ph.p_vaddr + ph.p_offset;
+                const std::size_t in_file = offset < filesize ? std::min( pagesize, filesize - offset ) : 0;
+                const char * image = reinterpret_cast< const char * >( vs.at( page ) );
+                
+                // Past the end of the file the mapping reads zeros
+                same = in_file > 0 &&
+                       std::memcmp( image, file + offset, in_file ) == 0 &&
+                       std::all_of( image + in_file, image + pagesize, []( char c ) { return c == 0; } );
+            }
+            
+            if ( !same )
+            {
+                if ( run < page )
+                {
+                    void * addr = vs.at( run );
+                    
+                    if ( mmap( addr, page - run, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                               fd, run - ph.p_vaddr + ph.p_offset ) != addr )
+                    {
+                        throw std::runtime_error("load_elf32::map_file_pages");
+                    }
+                }
+                
+                run = page + pagesize;
+            }
+            
+            if ( page >= last )
+            {
+                break;
+            }
+        }
+    }
+}
+
+
 struct smart_fd
 {
     smart_fd() : fd_(-1) {}
@@ -231,6 +403,30 @@ private:
     int fd_;
 };
 
+/**
+ * @brief Entries of /proc/self/pagemap for the pages at [addr, addr + pages * pagesize).
+ */
+std::vector< uint64_t > read_pagemap( const void * addr, std::size_t pages )
+{
+    smart_fd pagemap( "/proc/self/pagemap", O_RDONLY | O_CLOEXEC );
+    
+    std::vector< uint64_t > ans( pages );
+    const std::size_t bytes = pages * sizeof(uint64_t);
+    const off_t offset = reinterpret_cast< uint64_t >( addr ) / getpagesize() * sizeof(uint64_t);
+    
+    if ( pread( pagemap.get(), ans.data(), bytes, offset ) != ssize_t(bytes) )
+    {
+        throw std::runtime_error("cannot read /proc/self/pagemap");
+    }
+    
+    return ans;
+}
+
+// Bits of a pagemap entry, see Documentation/admin-guide/mm/pagemap.rst
+constexpr uint64_t pagemap_present = 1ull << 63;
+constexpr uint64_t pagemap_file = 1ull << 61; ///< Page cache or shared memory, not a private copy
+constexpr uint64_t pagemap_exclusive = 1ull << 56; ///< Mapped once in the whole system
+
 } //namespace
 
 void mmap_region::check_valid()
@@ -245,11 +441,33 @@ void mmap_region::deallocate()
 {
     munmap( addr_, size_ );
 }
+
+unique_fd::~unique_fd()
+{
+    if ( fd_ >= 0 )
+    {
+        close( fd_ );
+    }
+}
+
+unique_tls::~unique_tls()
+{
+    if ( offset_ != 0 )
+    {
+        e32_tls_free( offset_ );
+    }
+}
     
-loader::loader(const char *filename, get_symbol_t const & get_sym)
+loader::loader(const char *filename, get_symbol_t const & get_sym) :
+    loader( filename, get_sym, override_map_t() )
+{
+}
+
+loader::loader(const char *filename, get_symbol_t const & get_sym, override_map_t const & overrides)
 {
     smart_fd file(filename, O_RDONLY);
-    const std::size_t filesize = file.stat().st_size;
+    file_stat_ = file.stat();
+    const std::size_t filesize = file_stat_.st_size;
     
     mmap_region file_data( mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, file.get(), 0 ),
                            filesize );
@@ -262,15 +480,36 @@ loader::loader(const char *filename, get_symbol_t const & get_sym)
     // Read symbols
     symbols_ = read_elf32_dynsym( p, data_ );
 
+    for ( auto const & o : overrides )
+    {
+        symbols_[o.first] = o.second;
+    }
+
     // Relocate
-    auto get_symbols = [&get_sym, this]( std::experimental::string_view sym ) -> uint32_t
+    auto get_symbols = [&get_sym, &overrides, this]( std::experimental::string_view sym ) -> uint32_t
     {
+        auto over = overrides.find( sym.to_string() );
+        if ( over != overrides.end() )
+        {
+            return over->second;
+        }
+
         uint32_t sym_glob = get_sym(sym);
         if ( sym_glob != 0 )
         {
             return sym_glob;
         }
 
+        if ( sym == "___tls_get_addr" )
+        {
+            return e32_tls_get_addr;
+        }
+        
+        if ( sym == "__tls_get_addr" )
+        {
+            return e32_tls_get_addr_cdecl;
+        }
+        
         auto iter = symbols_.find( sym.to_string() );
         if ( iter != symbols_.end() )
         {
@@ -280,16 +519,231 @@ loader::loader(const char *filename, get_symbol_t const & get_sym)
         return 0;
     };
     
+    // Reserve the TLS block, its offset is needed by the relocations
+    for ( const program_header & ph : p.program_headers() )
+    {
+        if ( ph.p_type != pt::tls )
+        {
+            continue;
+        }
+        
+        uint32_t offset;
+        
+        if ( e32_tls_alloc( ph.p_memsz, ph.p_align, &offset ) != 0 )
+        {
+            throw std::runtime_error("Guest TLS area is full");
+        }
+        
+        tls_ = unique_tls( offset );
+    }
+    
     for ( const section_header & sec : p.section_headers() )
     {
         if ( sec.sh_type == sht::rel )
         {
-            relocate_elf32(p, sec, data_, std::ref(get_symbols) );
+            relocate_elf32(p, sec, data_, std::ref(get_symbols), tls_ );
+        }
+    }
+
+    // Publish the relocated .tdata, the template stays in the image
+    for ( const program_header & ph : p.program_headers() )
+    {
+        if ( ph.p_type == pt::tls && tls_ )
+        {
+            e32_tls_init( tls_.offset(), data_.at( ph.p_vaddr ), ph.p_filesz );
         }
     }
 
+    map_file_pages( p, data_, file.get(), reinterpret_cast< const char * >( file_data.data() ), filesize );
+    
+    // Kept to tell if the file changed under the mapping
+    file_ = unique_fd( fcntl( file.get(), F_DUPFD_CLOEXEC, 0 ) );
+    
+    if ( !file_ )
+    {
+        throw std::runtime_error("Can not keep: " + std::string(filename) );
+    }
+
     // Apply proper permissions
-    apply_prot_flags(p, data_);
+    const std::vector< int > pageflags = apply_prot_flags(p, data_);
+    const std::size_t pagesize = getpagesize();
+
+    for ( std::size_t i = 0; i < pageflags.size(); ++i )
+    {
+        if ( !segments_.empty() && segments_.back().prot == pageflags[i] )
+        {
+            segments_.back().size += pagesize;
+        }
+        else
+        {
+            segments_.push_back( page_range{ uint32_t(i * pagesize), uint32_t(pagesize), pageflags[i] } );
+        }
+    }
+
+    for ( const page_range & r : segments_ )
+    {
+        if ( r.prot & PROT_WRITE )
+        {
+            writable_.push_back( r );
+        }
+    }
+
+    if ( e32_perf_map_enabled() )
+    {
+        write_elf32_perf_map( p, data_, filename );
+    }
+}
+
+void loader::snapshot()
+{
+    unique_fd fd( memfd_create( "e32_snapshot", MFD_CLOEXEC ) );
+
+    if ( !fd || ftruncate( fd.get(), data_.size() ) != 0 )
+    {
+        throw std::runtime_error("loader::snapshot");
+    }
+
+    // The memfd mirrors the image, with holes in place of the read-only pages
+    for ( const page_range & r : writable_ )
+    {
+        const char * src = reinterpret_cast<const char*>( data_.at( r.offset ) );
+
+        for ( uint32_t done = 0; done < r.size; )
+        {
+            const ssize_t n = pwrite( fd.get(), src + done, r.size - done, r.offset + done );
+
+            if ( n <= 0 )
+            {
+                throw std::runtime_error("loader::snapshot");
+            }
+
+            done += n;
+        }
+    }
+
+    for ( const page_range & r : writable_ )
+    {
+        void * addr = data_.at( r.offset );
+
+        if ( mmap( addr, r.size, r.prot, MAP_PRIVATE | MAP_FIXED, fd.get(), r.offset ) != addr )
+        {
+            throw std::runtime_error("loader::snapshot");
+        }
+    }
+
+    snapshot_ = std::move(fd);
+}
+
+void loader::reset()
+{
+    if ( !snapshot_ )
+    {
+        throw std::logic_error("loader::reset without a snapshot");
+    }
+
+    // Private pages that were written are dropped, the others still map the memfd
+    for ( const page_range & r : writable_ )
+    {
+        if ( madvise( data_.at( r.offset ), r.size, MADV_DONTNEED ) != 0 )
+        {
+            throw std::runtime_error("loader::reset");
+        }
+    }
+}
+
+std::vector< loader::segment_usage > loader::memory_usage() const
+{
+    const std::size_t pagesize = getpagesize();
+    const std::vector< uint64_t > pagemap = read_pagemap( data_.data(), data_.size() / pagesize );
+    
+    std::vector< segment_usage > ans;
+    
+    for ( const page_range & r : segments_ )
+    {
+        segment_usage usage{ r.offset, r.size, r.prot, 0, 0, 0 };
+        
+        for ( uint32_t i = r.offset / pagesize; i < ( r.offset + r.size ) / pagesize; ++i )
+        {
+            const uint64_t e = pagemap[i];
+            
+            if ( !( e & pagemap_present ) )
+            {
+                continue;
+            }
+            
+            ++usage.resident;
+            
+            if ( !( e & pagemap_file ) )
+            {
+                ++usage.dirty;
+            }
+            else if ( !( e & pagemap_exclusive ) )
+            {
+                ++usage.shared;
+            }
+        }
+        
+        ans.push_back( usage );
+    }
+    
+    return ans;
+}
+
+std::size_t loader::trim()
+{
+    // A rename onto the path leaves this inode alone, a write in place shows in its size or mtime
+    struct stat sb;
+    
+    if ( fstat( file_.get(), &sb ) != 0 ||
+         sb.st_size != file_stat_.st_size ||
+         sb.st_mtim.tv_sec != file_stat_.st_mtim.tv_sec || sb.st_mtim.tv_nsec != file_stat_.st_mtim.tv_nsec )
+    {
+        throw std::runtime_error("loader::trim: the module file changed since load");
+    }
+    
+    const std::size_t pagesize = getpagesize();
+    const std::vector< uint64_t > pagemap = read_pagemap( data_.data(), data_.size() / pagesize );
+    
+    std::size_t ans = 0;
+    std::size_t run = 0;
+    
+    // Runs of resident clean pages, the private copies would be lost
+    for ( std::size_t i = 0; i <= pagemap.size(); ++i )
+    {
+        if ( i < pagemap.size() && ( pagemap[i] & pagemap_present ) && ( pagemap[i] & pagemap_file ) )
+        {
+            ++run;
+            continue;
+        }
+        
+        if ( run > 0 )
+        {
+            if ( madvise( data_.at( ( i - run ) * pagesize ), run * pagesize, MADV_DONTNEED ) != 0 )
+            {
+                throw std::runtime_error("loader::trim");
+            }
+            
+            ans += run;
+            run = 0;
+        }
+    }
+    
+    return ans;
+}
+
+std::string loader::symbol_at( uint32_t address ) const
+{
+    std::string ans;
+    
+    for ( auto const & s : symbols_ )
+    {
+        if ( s.second == address && ( ans.empty() || s.first < ans ) )
+        {
+            ans = s.first;
+        }
+    }
+    
+    return ans;
 }
 
 } //namespace elf
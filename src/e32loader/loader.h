@@ -3,10 +3,14 @@
 #define E32LOADER_LOADER_H
 
 #include <functional>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <experimental/string_view>
 
+#include <sys/stat.h>
+
 namespace elf
 {
 
@@ -71,18 +75,191 @@ private:
     uint32_t size_;
 };
     
+/**
+ * @brief Owns a file descriptor
+ */
+class unique_fd
+{
+public:
+    unique_fd() : fd_(-1) {}
+    
+    explicit unique_fd( int fd ) : fd_(fd) {}
+    
+    unique_fd( unique_fd && other ) noexcept :
+        fd_(other.fd_)
+    {
+        other.fd_ = -1;
+    }
+    
+    unique_fd& operator=( unique_fd && other ) noexcept
+    {
+        std::swap( fd_, other.fd_ );
+        return *this;
+    }
+    
+    ~unique_fd();
+    
+    int get() const { return fd_; }
+    explicit operator bool() const { return fd_ >= 0; }
+    
+private:
+    int fd_;
+};
+
+/**
+ * @brief Owns the block of a module in the guest static TLS area
+ */
+class unique_tls
+{
+public:
+    unique_tls() : offset_(0) {}
+    
+    explicit unique_tls( uint32_t offset ) : offset_(offset) {}
+    
+    unique_tls( unique_tls && other ) noexcept :
+        offset_(other.offset_)
+    {
+        other.offset_ = 0;
+    }
+    
+    unique_tls& operator=( unique_tls && other ) noexcept
+    {
+        std::swap( offset_, other.offset_ );
+        return *this;
+    }
+    
+    ~unique_tls();
+    
+    /**
+     * @brief The block starts at the thread pointer - offset.
+     */
+    uint32_t offset() const { return offset_; }
+    explicit operator bool() const { return offset_ != 0; }
+    
+private:
+    uint32_t offset_;
+};
+
 class loader
 {
 public:
     using get_symbol_t = std::function<uint32_t(std::experimental::string_view)>;
+    using override_map_t = std::unordered_map< std::string, uint32_t >;
     
-    explicit loader( const char * filename, get_symbol_t const & );
+    /**
+     * @brief Load a module, resolving its imports with \ref get_sym.
+     * 
+     * get_sym returns the 32-bit address of a host function (a wrapper) or
+     * of a host data object, or 0 if the host does not define the symbol.
+     * Data objects must live in the low 4GB (e32_heap_malloc, or a global of
+     * the -no-pie host): GLOB_DAT and R_386_32 relocations point the guest
+     * straight at them, R_386_COPY relocations copy their initial value into
+     * the module.
+     */
+    explicit loader( const char * filename, get_symbol_t const & get_sym );
+    
+    /**
+     * @brief Load a module, replacing some of its exports.
+     * 
+     * Every symbol in \ref overrides resolves to the given address instead of
+     * the guest definition: in get_sym, and in the relocations of the module
+     * itself, so that calls between guest functions through the PLT or the
+     * GOT reach the override too. Calls the guest linker bound directly
+     * (static functions, -Bsymbolic) are not affected.
+     */
+    loader( const char * filename, get_symbol_t const &, override_map_t const & overrides );
     
     uint32_t get_sym( const char * name ) const { return symbols_.at(name); }
     
+    /**
+     * @brief Every symbol defined by the module, with the overrides applied.
+     */
+    std::unordered_map< std::string, uint32_t > const & exports() const { return symbols_; }
+    
+    /**
+     * @brief Name of the export at \ref address, empty if there is none.
+     * 
+     * Of several names for the same address, the first in lexicographic
+     * order is returned.
+     */
+    std::string symbol_at( uint32_t address ) const;
+    
+    /**
+     * @brief Record the current content of the writable pages.
+     * 
+     * Typically called once after load, or after running the guest
+     * initialization. The pages are remapped as a private mapping of a
+     * memfd holding the snapshot, so that \ref reset only has to drop the
+     * pages dirtied since.
+     */
+    void snapshot();
+    
+    /**
+     * @brief Restore the writable pages to the last \ref snapshot.
+     * 
+     * Costs in proportion to the pages written since the snapshot, not to
+     * the size of the image. No guest code of this module may run meanwhile.
+     */
+    void reset();
+    
+    /**
+     * @brief Memory used by a run of pages with the same protection.
+     */
+    struct segment_usage
+    {
+        uint32_t offset; ///< From the start of the image
+        uint32_t size;
+        int prot;
+        std::size_t resident; ///< Pages mapped in this process
+        std::size_t dirty; ///< Resident pages private to this process, that only swap can reclaim
+        std::size_t shared; ///< Resident pages of the file or snapshot that other mappings use as well
+    };
+    
+    /**
+     * @brief Resident, dirty and shared pages of each segment, read from /proc/self/pagemap.
+     * 
+     * The pages that still hold the bytes of the file map the file itself,
+     * they are only dirty once the guest writes to them.
+     */
+    std::vector< segment_usage > memory_usage() const;
+    
+    /**
+     * @brief Unmap the resident pages that are not dirty.
+     * 
+     * They are read back from the page cache, or from the snapshot, the
+     * next time the guest touches them. Dirty pages are left alone. No
+     * guest code of this module may run meanwhile.
+     * 
+     * Meant for modules that have gone idle: recently used code is dropped
+     * as well, and the next calls fault it back in page by page.
+     * 
+     * The module file must not be written in place while it is loaded, a
+     * new version has to replace it by rename. Since dropped pages would be
+     * read back from the changed file, trim throws if the size or the
+     * modification time of the file differ from the ones at load.
+     * @return Number of pages dropped.
+     */
+    std::size_t trim();
+    
 private:
+    /**
+     * @brief Pages with the same protection
+     */
+    struct page_range
+    {
+        uint32_t offset;
+        uint32_t size;
+        int prot;
+    };
+    
     mmap_region data_;
     std::unordered_map< std::string, uint32_t > symbols_;
+    std::vector< page_range > segments_;
+    std::vector< page_range > writable_;
+    unique_fd snapshot_;
+    unique_fd file_; ///< The clean pages map it
+    struct stat file_stat_; ///< At load
+    unique_tls tls_;
 };
 
 } //namespace elf
@@ -0,0 +1,309 @@
+
+#include "symbol_namespace.h"
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace elf
+{
+
+namespace
+{
+
+/**
+ * @brief Announces the epoch of the lookup running on a thread, 0 if none.
+ */
+struct alignas(64) reader_record
+{
+    std::atomic< uint64_t > epoch{ 0 };
+    std::atomic< bool > in_use{ true };
+    reader_record * next = nullptr;
+
+    // Only used by the owning thread
+    unsigned nesting = 0;
+};
+
+/**
+ * @brief Epoch based reclamation, shared by every namespace.
+ */
+class epoch_domain
+{
+public:
+    /**
+     * @brief Readers get away with a compiler barrier if the kernel can fence them on demand.
+     */
+    epoch_domain() :
+        asymmetric_( syscall( SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0 ) == 0 )
+    {
+    }
+
+    /**
+     * @brief A record for the calling thread, reusing the one of an exited thread if possible.
+     */
+    reader_record * acquire_record()
+    {
+        for ( reader_record * r = readers_.load( std::memory_order_acquire ); r; r = r->next )
+        {
+            bool expected = false;
+            if ( !r->in_use.load( std::memory_order_relaxed ) &&
+                 r->in_use.compare_exchange_strong( expected, true, std::memory_order_acquire ) )
+            {
+                return r;
+            }
+        }
+
+        reader_record * r = new reader_record;
+        r->next = readers_.load( std::memory_order_relaxed );
+
+        while ( !readers_.compare_exchange_weak( r->next, r, std::memory_order_release, std::memory_order_relaxed ) )
+        {
+        }
+
+        return r;
+    }
+
+    uint64_t current() const
+    {
+        return epoch_.load( std::memory_order_relaxed );
+    }
+
+    /**
+     * @brief Orders the epoch store of a reader before its read of the table.
+     */
+    void reader_fence() const
+    {
+        if ( asymmetric_ )
+        {
+            std::atomic_signal_fence( std::memory_order_seq_cst );
+        }
+        else
+        {
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+        }
+    }
+
+    /**
+     * @brief Wait until every lookup started before the call is over.
+     */
+    void synchronize()
+    {
+        // Pairs with reader_fence
+        if ( !asymmetric_ || syscall( SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0 ) != 0 )
+        {
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+        }
+
+        const uint64_t target = epoch_.fetch_add( 1, std::memory_order_seq_cst ) + 1;
+
+        for ( reader_record * r = readers_.load( std::memory_order_acquire ); r; r = r->next )
+        {
+            for ( ;; )
+            {
+                const uint64_t e = r->epoch.load( std::memory_order_acquire );
+
+                if ( e == 0 || e >= target )
+                {
+                    break;
+                }
+
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    const bool asymmetric_;
+    std::atomic< uint64_t > epoch_{ 1 };
+    std::atomic< reader_record * > readers_{ nullptr };
+};
+
+// Never destroyed, threads may still exit after the static destructors ran
+epoch_domain & domain()
+{
+    static epoch_domain * ans = new epoch_domain;
+    return *ans;
+}
+
+/**
+ * @brief Hands the record back when the thread exits.
+ */
+struct reader_slot
+{
+    reader_record * record = nullptr;
+
+    ~reader_slot()
+    {
+        if ( record )
+        {
+            record->in_use.store( false, std::memory_order_release );
+        }
+    }
+};
+
+// Trivial, so that reading it does not go through the initialization wrapper of this_reader_slot
+thread_local reader_record * this_reader;
+thread_local reader_slot this_reader_slot;
+
+/**
+ * @brief The table read in this scope is not freed before the end of the scope.
+ */
+class read_section
+{
+public:
+    read_section() :
+        record_( this_reader )
+    {
+        if ( !record_ )
+        {
+            record_ = this_reader = this_reader_slot.record = domain().acquire_record();
+        }
+
+        if ( record_->nesting++ == 0 )
+        {
+            // Either the writer sees this epoch, or this thread sees the new table
+            record_->epoch.store( domain().current(), std::memory_order_relaxed );
+            domain().reader_fence();
+        }
+    }
+
+    ~read_section()
+    {
+        if ( --record_->nesting == 0 )
+        {
+            record_->epoch.store( 0, std::memory_order_release );
+        }
+    }
+
+    read_section( read_section const & ) = delete;
+    read_section & operator=( read_section const & ) = delete;
+
+private:
+    reader_record * record_;
+};
+
+struct module_exports
+{
+    symbol_namespace::module_id id;
+    std::string name;
+    std::vector< std::pair< std::string, uint32_t > > symbols;
+};
+
+} //namespace
+
+struct symbol_namespace::table
+{
+    table() = default;
+
+    explicit table( std::vector< std::shared_ptr< module_exports const > > m ) :
+        modules( std::move(m) )
+    {
+        for ( auto const & module : modules )
+        {
+            for ( auto const & s : module->symbols )
+            {
+                // The first module keeps the name
+                index.emplace( std::experimental::string_view( s.first ), s.second );
+            }
+        }
+    }
+
+    std::vector< std::shared_ptr< module_exports const > > modules;
+
+    // Keys point into modules
+    std::unordered_map< std::experimental::string_view, uint32_t > index;
+};
+
+symbol_namespace::symbol_namespace() :
+    table_( new table ),
+    next_id_( 1 )
+{
+}
+
+symbol_namespace::~symbol_namespace()
+{
+    delete table_.load( std::memory_order_relaxed );
+}
+
+symbol_namespace & symbol_namespace::global()
+{
+    static symbol_namespace * ans = new symbol_namespace;
+    return *ans;
+}
+
+symbol_namespace::module_id symbol_namespace::add( std::string name, loader const & module )
+{
+    auto exports = std::make_shared< module_exports >();
+    exports->name = std::move(name);
+    exports->symbols.assign( module.exports().begin(), module.exports().end() );
+
+    std::lock_guard< std::mutex > lock( writer_lock_ );
+
+    exports->id = next_id_++;
+
+    table const * old = table_.load( std::memory_order_relaxed );
+
+    auto modules = old->modules;
+    modules.push_back( exports );
+
+    table_.store( new table( std::move(modules) ), std::memory_order_release );
+
+    domain().synchronize();
+    delete old;
+
+    return exports->id;
+}
+
+bool symbol_namespace::remove( module_id id )
+{
+    std::lock_guard< std::mutex > lock( writer_lock_ );
+
+    table const * old = table_.load( std::memory_order_relaxed );
+
+    auto modules = old->modules;
+
+    auto iter = std::find_if( modules.begin(), modules.end(),
+                              [id]( std::shared_ptr< module_exports const > const & m ) { return m->id == id; } );
+
+    if ( iter == modules.end() )
+    {
+        return false;
+    }
+
+    modules.erase( iter );
+
+    table_.store( new table( std::move(modules) ), std::memory_order_release );
+
+    domain().synchronize();
+    delete old;
+
+    return true;
+}
+
+uint32_t symbol_namespace::find( std::experimental::string_view name ) const
+{
+    read_section section;
+
+    table const * t = table_.load( std::memory_order_acquire );
+
+    auto iter = t->index.find( name );
+    return iter != t->index.end() ? iter->second : 0;
+}
+
+loader::get_symbol_t symbol_namespace::resolver( loader::get_symbol_t host ) const
+{
+    return [this, host]( std::experimental::string_view name ) -> uint32_t
+    {
+        const uint32_t ans = host ? host( name ) : 0;
+        return ans != 0 ? ans : find( name );
+    };
+}
+
+} //namespace elf
@@ -0,0 +1,80 @@
+
+#ifndef E32LOADER_SYMBOL_NAMESPACE_H
+#define E32LOADER_SYMBOL_NAMESPACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <experimental/string_view>
+
+#include "loader.h"
+
+namespace elf
+{
+
+/**
+ * @brief Exports of several guest modules, looked up without locks.
+ *
+ * The table is immutable once published: \ref add and \ref remove build a
+ * new one, swap it in and free the old one after every lookup that could
+ * still see it has finished. Lookups only announce the epoch they run in,
+ * in a cache line of their own thread, so they scale with the number of
+ * reader threads and never wait for a load or an unload.
+ *
+ * A name exported by several modules resolves to the module added first,
+ * like the global scope of the dynamic linker.
+ */
+class symbol_namespace
+{
+public:
+    using module_id = uint64_t;
+
+    symbol_namespace();
+    ~symbol_namespace();
+
+    symbol_namespace( symbol_namespace const & ) = delete;
+    symbol_namespace & operator=( symbol_namespace const & ) = delete;
+
+    /**
+     * @brief The namespace of the process.
+     */
+    static symbol_namespace & global();
+
+    /**
+     * @brief Publish the exports of \ref module.
+     *
+     * The addresses are copied, \ref module must stay loaded until it is
+     * removed from the namespace.
+     */
+    module_id add( std::string name, loader const & module );
+
+    /**
+     * @brief Withdraw the exports of a module.
+     *
+     * Returns once no lookup can find them anymore, the module can be
+     * unloaded afterwards. Returns false if \ref id is unknown.
+     */
+    bool remove( module_id id );
+
+    /**
+     * @brief Address of a guest export, 0 if no module defines it.
+     */
+    uint32_t find( std::experimental::string_view name ) const;
+
+    /**
+     * @brief Import resolver for the next module: host symbols first, then the namespace.
+     */
+    loader::get_symbol_t resolver( loader::get_symbol_t host ) const;
+
+private:
+    struct table;
+
+    std::atomic< table const * > table_;
+    std::mutex writer_lock_;
+    module_id next_id_;
+};
+
+} //namespace elf
+
+#endif //E32LOADER_SYMBOL_NAMESPACE_H
@@ -0,0 +1,30 @@
+
+// Host data objects, resolved by the loader
+extern const int host_table[16];
+extern int host_counter;
+
+// Exported, so PIC code reaches it through the GOT too
+int guest_counter = 5;
+
+int data_sum( int n )
+{
+    int sum = 0;
+    for ( int i = 0; i < n; ++i )
+    {
+        sum += host_table[i];
+    }
+    return sum;
+}
+
+int data_bump( int x )
+{
+    host_counter += x;
+    guest_counter += x;
+    return host_counter;
+}
+
+int data_guest_counter( int x )
+{
+    (void)x;
+    return guest_counter;
+}
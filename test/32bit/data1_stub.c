@@ -0,0 +1,4 @@
+
+// Link-time stand-ins for the host data of data1.c, they give the sizes of the copy relocations
+const int host_table[16];
+int host_counter;
@@ -0,0 +1,8 @@
+
+/* Defined by base1, resolved through a symbol namespace */
+int foo( int c );
+
+int link_foo( int c )
+{
+    return foo( c ) + 1;
+}
@@ -0,0 +1,49 @@
+
+#include <math.h>
+
+void e32_vexp( const double * in, double * out, int n );
+void e32_vpow( const double * x, const double * y, double * out, int n );
+
+int math_exp( int c )
+{
+    return (int)( exp( c / 10.0 ) * 1000 );
+}
+
+int math_pow( int c )
+{
+    return (int)( pow( c, 0.5 ) * 1000 + sqrt( c ) * 1000 );
+}
+
+int math_trig( int c )
+{
+    // Many results alive on the x87 stack at once
+    double ans = 0;
+    for ( int i = 0; i < c; ++i )
+    {
+        ans += sin( i ) * sin( i ) + cos( i ) * cos( i ) + log( exp( 1.0 ) ) - 1;
+    }
+    return (int)( ans + 0.5 );
+}
+
+int math_vexp( int c )
+{
+    double in[37];
+    double out[37];
+    double half[37];
+
+    for ( int i = 0; i < 37; ++i )
+    {
+        in[i] = c / 10.0;
+        half[i] = 0.5;
+    }
+
+    e32_vexp( in, out, 37 );
+    e32_vpow( out, half, out, 37 );
+
+    double ans = 0;
+    for ( int i = 0; i < 37; ++i )
+    {
+        ans += out[i];
+    }
+    return (int)( ans * 1000 );
+}
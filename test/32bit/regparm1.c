@@ -0,0 +1,25 @@
+
+// Built with -mregparm=3, the host wrappers are generated for the same conventions
+int host_mix3( int a, int b, int c );
+__attribute__((fastcall)) int host_fast4( int a, int b, int c, int d );
+
+int regparm_call( int a, int b, int c, int d )
+{
+    return host_mix3( a, b, c ) + host_fast4( d, c, b, a );
+}
+
+__attribute__((fastcall)) int fastcall_call( int a, int b, int c, int d )
+{
+    return host_fast4( a, b, c, d ) - d;
+}
+
+// Any stack imbalance across the calls accumulates
+int regparm_loop( int n )
+{
+    int sum = 0;
+    for ( int i = 0; i < n; ++i )
+    {
+        sum += host_fast4( i, 1, 2, 3 ) + host_mix3( 0, i, 0 );
+    }
+    return sum;
+}
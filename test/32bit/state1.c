@@ -0,0 +1,21 @@
+
+// Global state in .data and .bss, static to keep the accesses GOT-relative
+static int counter = 100;
+static int table[4096];
+
+int bump( int c )
+{
+    counter += c;
+    return counter;
+}
+
+int fill( int c )
+{
+    int ans = 0;
+    for ( int i = 0; i < 4096; ++i )
+    {
+        ans += table[i];
+        table[i] = c;
+    }
+    return ans;
+}
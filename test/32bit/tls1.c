@@ -0,0 +1,22 @@
+
+__thread int tls_counter = 5;
+static __thread int tls_local[4];
+
+int tls_bump( int x )
+{
+    tls_counter += x;
+    tls_local[1] += 2 * x;
+    return tls_counter;
+}
+
+int tls_local_value( int x )
+{
+    (void)x;
+    return tls_local[1];
+}
+
+int tls_address( int x )
+{
+    (void)x;
+    return (int)&tls_counter;
+}
@@ -2,6 +2,25 @@
 #define BOOST_TEST_MODULE libc_stdlib
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <e32_libc.h>
 
 int call( e32_function_ptr method, int arg )
@@ -25,6 +44,87 @@ int call( e32_function_ptr method, int arg )
     return result.res;
 }
 
+/**
+ * @brief Fill level of the thunk arena before the first test.
+ */
+struct startup_arena
+{
+    startup_arena()
+    {
+        e32_thunk_arena_stats( &stats );
+    }
+    
+    static struct e32_thunk_arena_stats stats;
+};
+
+struct e32_thunk_arena_stats startup_arena::stats;
+
+BOOST_GLOBAL_FIXTURE( startup_arena );
+
+BOOST_AUTO_TEST_CASE(test_lazy_libc)
+{
+    // Only the internal thunks exist before a libc function is asked for
+    BOOST_TEST_MESSAGE( "startup: " << startup_arena::stats.thunks << " thunks, "
+                        << startup_arena::stats.chunks << " pages" );
+    BOOST_TEST( startup_arena::stats.thunks < unsigned(E32_LIBC_COUNT) );
+    
+    struct e32_thunk_arena_stats before;
+    e32_thunk_arena_stats( &before );
+    
+    // Racing resolutions of every function publish a single wrapper each
+    std::vector< std::vector< e32_function_ptr > > entries( 4 );
+    std::vector< std::thread > threads;
+    
+    const auto start = std::chrono::steady_clock::now();
+    
+    for ( int t = 0; t < 4; ++t )
+    {
+        threads.emplace_back( [&entries, t]
+        {
+            for ( int i = 0; i < E32_LIBC_COUNT; ++i )
+            {
+                entries[t].push_back( e32_libc_entry( ( i + 7 * t ) % E32_LIBC_COUNT ) );
+            }
+            std::rotate( entries[t].begin(), entries[t].end() - ( 7 * t ) % E32_LIBC_COUNT, entries[t].end() );
+        } );
+    }
+    
+    for ( std::thread & t : threads )
+    {
+        t.join();
+    }
+    
+    const std::chrono::duration< double, std::micro > elapsed = std::chrono::steady_clock::now() - start;
+    
+    struct e32_thunk_arena_stats after;
+    e32_thunk_arena_stats( &after );
+    
+    BOOST_TEST_MESSAGE( "every libc function: " << elapsed.count() << " us, "
+                        << after.thunks - before.thunks << " thunks, "
+                        << after.chunks - before.chunks << " pages" );
+    
+    // A stub per function, and an adapter per signature: int with 0 to 4 arguments, double with 1 or 2
+    BOOST_TEST( after.thunks - before.thunks <= unsigned(E32_LIBC_COUNT) + 7 );
+    
+    for ( int t = 0; t < 4; ++t )
+    {
+        BOOST_TEST( std::count( entries[t].begin(), entries[t].end(), 0u ) == 0 );
+        BOOST_TEST( entries[t] == entries[0] );
+    }
+    
+    // Already generated
+    BOOST_TEST( e32_libc_resolve( "strlen" ) == entries[0][E32_LIBC_STRLEN] );
+    BOOST_TEST( e32_libc_resolve( "e32_vpow" ) == entries[0][E32_LIBC_VPOW] );
+    BOOST_TEST( e32_libc_resolve( "printf" ) == 0u );
+    BOOST_TEST( e32_libc_entry( E32_LIBC_COUNT ) == 0u );
+    
+    struct e32_thunk_arena_stats again;
+    e32_thunk_arena_stats( &again );
+    BOOST_TEST( again.thunks == after.thunks );
+    
+    BOOST_TEST( call( e32_libc_resolve( "abs" ), -3 ) == 3 );
+}
+
 BOOST_AUTO_TEST_CASE(test_abs)
 {
     BOOST_TEST( call( e32_abs, -20 ) == 20 );
@@ -55,3 +155,954 @@ BOOST_AUTO_TEST_CASE(test_atoi)
     BOOST_TEST( res == -5121 );
 
 }
+
+int sum3( int a, int b, int c )
+{
+    return a + b + c;
+}
+
+BOOST_AUTO_TEST_CASE(test_make_wrapper)
+{
+    // e32_enter32_i replicates its argument on the stack
+    const e32_function_ptr wrapper = e32_make_wrapper( reinterpret_cast<void*>(&sum3), 3 );
+    BOOST_TEST( wrapper != 0u );
+    BOOST_TEST( call( wrapper, 7 ) == 21 );
+    
+    BOOST_TEST( e32_make_wrapper( reinterpret_cast<void*>(&sum3), 7 ) == 0u );
+    
+    struct result_t
+    {
+        e32_function_ptr method;
+        int res;
+    } result = { wrapper, 0 };
+    
+    e32_thread_stack_jump( +[]( void * data )
+                           {
+                               result_t * ans = reinterpret_cast<result_t*>(data);
+                               const int args[] = { 1, 20, 300 };
+                               ans->res = e32_enter32_iv( ans->method, args, 3 );
+                           },
+                           &result );
+    BOOST_TEST( result.res == 321 );
+}
+
+BOOST_AUTO_TEST_CASE(test_concurrent_wrappers)
+{
+    std::vector< std::thread > threads;
+    std::atomic< int > failures(0);
+    
+    for ( int i = 0; i < 8; ++i )
+    {
+        threads.emplace_back( [&failures]
+        {
+            // Enough to fill several chunks of the thunk arena while the others write
+            for ( int j = 0; j < 256; ++j )
+            {
+                const e32_function_ptr wrapper = e32_make_wrapper( reinterpret_cast<void*>(&sum3), 3 );
+                
+                struct result_t
+                {
+                    e32_function_ptr method;
+                    int res;
+                } result = { wrapper, 0 };
+                
+                e32_thread_stack_jump( +[]( void * data )
+                                       {
+                                           result_t * ans = reinterpret_cast<result_t*>(data);
+                                           ans->res = e32_enter32_i( ans->method, -3 ) + e32_enter32_i( e32_abs, -3 );
+                                       },
+                                       &result );
+                
+                if ( wrapper == 0 || result.res != -6 )
+                {
+                    ++failures;
+                }
+            }
+        } );
+    }
+    
+    for ( std::thread & t : threads )
+    {
+        t.join();
+    }
+    
+    BOOST_TEST( failures == 0 );
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_stack)
+{
+    // Addresses are kept as numbers, the frames are gone once the jumps return
+    uint64_t stacks[2] = {};
+    
+    for ( uint64_t & stack : stacks )
+    {
+        e32_thread_stack_jump( +[]( void * data )
+                               {
+                                   volatile char c;
+                                   *reinterpret_cast<uint64_t*>(data) = reinterpret_cast<uint64_t>(&c);
+                               },
+                               &stack );
+    }
+    
+    // The same stack is reused, and it lives in the low 4GB.
+    BOOST_TEST( stacks[0] == stacks[1] );
+    BOOST_TEST( stacks[0] < 0xFFFFFFFFull );
+    
+    // Nested jumps stay on the current stack
+    std::pair< uint64_t, uint64_t > nested;
+    e32_thread_stack_jump( +[]( void * data )
+                           {
+                               auto * ans = reinterpret_cast< std::pair< uint64_t, uint64_t > * >(data);
+                               volatile char c;
+                               ans->first = reinterpret_cast<uint64_t>(&c);
+                               
+                               e32_thread_stack_jump( +[]( void * data )
+                                                      {
+                                                          volatile char c;
+                                                          *reinterpret_cast<uint64_t*>(data) = reinterpret_cast<uint64_t>(&c);
+                                                      },
+                                                      &ans->second );
+                           },
+                           &nested );
+    
+    const uint64_t outer = nested.first;
+    const uint64_t inner = nested.second;
+    BOOST_TEST( inner < outer );
+    BOOST_TEST( outer - inner < 4096u );
+}
+
+void stack_address( void * data )
+{
+    volatile char c = 0;
+    *reinterpret_cast<uint64_t*>(data) = reinterpret_cast<uint64_t>(&c);
+}
+
+void stack_recurse( void * data )
+{
+    volatile char frame[4096];
+    frame[0] = 1;
+    
+    if ( --*reinterpret_cast<int*>(data) > 0 )
+    {
+        stack_recurse( data );
+    }
+    
+    frame[1] = frame[0];
+}
+
+BOOST_AUTO_TEST_CASE(test_stack_pool)
+{
+    const size_t size = 72 * 1024;
+    
+    // A released stack is the next one handed out
+    uint64_t stacks[2] = {};
+    
+    for ( uint64_t & stack : stacks )
+    {
+        BOOST_TEST( e32_stack_jump( size, &stack_address, &stack ) == 0 );
+    }
+    
+    BOOST_TEST( stacks[0] == stacks[1] );
+    
+    BOOST_TEST( e32_stack_pool_reserve( size, 64 ) == 0 );
+    
+    struct e32_stack_pool_stats stats;
+    e32_stack_pool_stats( &stats );
+    BOOST_TEST( stats.free >= 64u );
+    BOOST_TEST( stats.reserved >= stats.free );
+    
+    // Past the high-water mark, released stacks lose their pages
+    e32_stack_pool_set_high_water( 0 );
+    e32_stack_pool_stats( &stats );
+    BOOST_TEST( stats.dirty == 0u );
+    
+    const size_t free_stacks = stats.free;
+    uint64_t stack;
+    e32_stack_jump( size, &stack_address, &stack );
+    
+    e32_stack_pool_stats( &stats );
+    BOOST_TEST( stats.dirty == 0u );
+    BOOST_TEST( stats.free == free_stacks );
+    
+    e32_stack_pool_set_high_water( 1000 );
+    e32_stack_jump( size, &stack_address, &stack );
+    
+    e32_stack_pool_stats( &stats );
+    BOOST_TEST( stats.dirty == 1u );
+    
+    // The least recently released stack is cleaned, the last one stays dirty
+    e32_stack_pool_set_high_water( 1 );
+    e32_stack_jump( size + 8192, &stack_address, &stack );
+    e32_stack_jump( size + 16384, &stack_address, &stack );
+    
+    e32_stack_pool_stats( &stats );
+    BOOST_TEST( stats.dirty == 1u );
+    
+    e32_stack_jump( size + 16384,
+                    +[]( void * data )
+                    {
+                        e32_stack_pool_stats( reinterpret_cast<struct e32_stack_pool_stats*>(data) );
+                    },
+                    &stats );
+    BOOST_TEST( stats.dirty == 0u );
+    
+    e32_stack_pool_set_high_water( 16 );
+    
+    // An overflow faults on the guard page
+    const pid_t pid = fork();
+    
+    if ( pid == 0 )
+    {
+        signal( SIGSEGV, SIG_DFL );
+        
+        int depth = 64;
+        e32_stack_jump( size, &stack_recurse, &depth );
+        _exit( 0 );
+    }
+    
+    int status = 0;
+    BOOST_REQUIRE( waitpid( pid, &status, 0 ) == pid );
+    BOOST_TEST( WIFSIGNALED( status ) );
+    BOOST_TEST( WTERMSIG( status ) == SIGSEGV );
+    
+    // A deep enough stack does not
+    int depth = 8;
+    BOOST_TEST( e32_stack_jump( size, &stack_recurse, &depth ) == 0 );
+    
+    e32_stack_pool_trim();
+    e32_stack_pool_stats( &stats );
+    BOOST_TEST( stats.free == 0u );
+    BOOST_TEST( stats.dirty == 0u );
+}
+
+BOOST_AUTO_TEST_CASE(test_thunk_arena)
+{
+    struct e32_thunk_arena_stats before;
+    e32_thunk_arena_stats( &before );
+    
+    std::vector< e32_function_ptr > wrappers;
+    for ( int i = 0; i < 5000; ++i )
+    {
+        wrappers.push_back( e32_make_wrapper( reinterpret_cast<void*>(&sum3), i % 4 ) );
+        BOOST_REQUIRE( wrappers.back() != 0u );
+    }
+    
+    struct e32_thunk_arena_stats after;
+    e32_thunk_arena_stats( &after );
+    
+    BOOST_TEST( after.thunks == before.thunks + 5000 );
+    BOOST_TEST( after.used > before.used );
+    BOOST_TEST( after.chunks > before.chunks );
+    BOOST_TEST( after.used <= after.capacity );
+    BOOST_TEST_MESSAGE( after.thunks << " thunks, " << after.used << "/" << after.capacity << " bytes" );
+    
+    BOOST_TEST( call( wrappers.back(), 5 ) == 15 );
+    BOOST_TEST( call( wrappers[3], -5 ) == -15 );
+    
+    // No mapping is both writable and executable, and only the last chunk is writable
+    std::ifstream maps( "/proc/self/maps" );
+    std::string line;
+    int writable_chunks = 0;
+    while ( std::getline( maps, line ) )
+    {
+        std::istringstream fields( line );
+        std::string range, perms;
+        fields >> range >> perms;
+        BOOST_TEST( !( perms[1] == 'w' && perms[2] == 'x' ), line );
+        
+        if ( perms[1] == 'w' && line.find( "e32_thunks" ) != std::string::npos )
+        {
+            ++writable_chunks;
+        }
+    }
+    BOOST_TEST( writable_chunks == 1 );
+}
+
+int times3( int a, int b, int c )
+{
+    return a * b * c;
+}
+
+/**
+ * @brief Target of the lcall of a stub.
+ */
+uint32_t stub_adapter( e32_function_ptr stub )
+{
+    const unsigned char * code = reinterpret_cast<const unsigned char*>( uintptr_t(stub) );
+    
+    uint32_t ans;
+    std::memcpy( &ans, code + 1, sizeof(ans) );
+    
+    return code[0] == 0x9a ? ans : 0;
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_adapters)
+{
+    struct e32_thunk_arena_stats before;
+    e32_thunk_arena_stats( &before );
+    
+    const e32_function_ptr sum = e32_make_wrapper( reinterpret_cast<void*>(&sum3), 3 );
+    const e32_function_ptr product = e32_make_wrapper( reinterpret_cast<void*>(&times3), 3 );
+    const e32_function_ptr fast = e32_make_wrapper_cc( reinterpret_cast<void*>(&times3), 3, E32_CC_FASTCALL );
+    
+    struct e32_thunk_arena_stats after;
+    e32_thunk_arena_stats( &after );
+    
+    BOOST_TEST( call( sum, 4 ) == 12 );
+    BOOST_TEST( call( product, 4 ) == 64 );
+    
+    // Same signature, same adapter, and the stubs are adjacent
+    BOOST_REQUIRE( stub_adapter( sum ) != 0u );
+    BOOST_TEST( stub_adapter( sum ) == stub_adapter( product ) );
+    BOOST_TEST( stub_adapter( fast ) != stub_adapter( sum ) );
+    BOOST_TEST( product == sum + 16 );
+    BOOST_TEST( stub_adapter( e32_abs ) == stub_adapter( e32_atoi ) );
+    
+    // A probed wrapper carries the whole sequence
+    e32_probe_enable();
+    const e32_function_ptr full = e32_make_wrapper( reinterpret_cast<void*>(&sum3), 3 );
+    e32_probe_disable();
+    
+    struct e32_thunk_arena_stats probed;
+    e32_thunk_arena_stats( &probed );
+    
+    BOOST_TEST( stub_adapter( full ) == full + 10 );
+    BOOST_TEST_MESSAGE( "stub: " << ( after.used - before.used ) / ( after.thunks - before.thunks )
+                        << " bytes on average with new adapters, full wrapper: " << probed.used - after.used << " bytes" );
+    
+    // Hottest first
+    const int hot[] = { E32_LIBC_MEMCPY, E32_LIBC_STRLEN, E32_LIBC_MALLOC, E32_LIBC_FREE };
+    BOOST_TEST( e32_libc_preload( hot, 4 ) == 0 );
+    
+    const int bad[] = { E32_LIBC_COUNT };
+    BOOST_TEST( e32_libc_preload( bad, 1 ) != 0 );
+}
+
+struct accumulator
+{
+    int total;
+    
+    int add( int a, int b )
+    {
+        total += a * b;
+        return total;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(test_make_callback)
+{
+    auto add = +[]( void * self, int a, int b ) { return static_cast<accumulator*>(self)->add( a, b ); };
+    
+    accumulator acc1 = { 0 };
+    accumulator acc2 = { 100 };
+    
+    const e32_function_ptr cb1 = e32_make_callback( reinterpret_cast<void*>(add), &acc1, 2 );
+    const e32_function_ptr cb2 = e32_make_callback( reinterpret_cast<void*>(add), &acc2, 2 );
+    BOOST_REQUIRE( cb1 != 0u );
+    BOOST_REQUIRE( cb2 != 0u );
+    
+    BOOST_TEST( call( cb1, 3 ) == 9 );
+    BOOST_TEST( call( cb1, 2 ) == 13 );
+    BOOST_TEST( call( cb2, 4 ) == 116 );
+    
+    BOOST_TEST( acc1.total == 13 );
+    BOOST_TEST( acc2.total == 116 );
+    
+    BOOST_TEST( e32_make_callback( reinterpret_cast<void*>(add), &acc1, 6 ) == 0u );
+}
+
+BOOST_AUTO_TEST_CASE(test_heap)
+{
+    struct e32_heap_stats before;
+    e32_heap_stats( &before );
+    
+    std::vector< void * > blocks;
+    for ( size_t size : { 1, 16, 17, 100, 1000, 4096, 8192, 8193, 100000, 3000000 } )
+    {
+        char * p = static_cast<char*>( e32_heap_malloc( size ) );
+        BOOST_REQUIRE( p != nullptr );
+        BOOST_TEST( reinterpret_cast<uint64_t>(p) + size <= 0x100000000ull );
+        BOOST_TEST( reinterpret_cast<uint64_t>(p) % 16 == 0u );
+        BOOST_TEST( e32_heap_usable_size( p ) >= size );
+        
+        std::fill( p, p + size, char(size) );
+        blocks.push_back( p );
+    }
+    
+    // Grow a block, the content is preserved
+    char * p = static_cast<char*>( e32_heap_realloc( blocks[3], 20000 ) );
+    BOOST_REQUIRE( p != nullptr );
+    BOOST_TEST( std::count( p, p + 100, char(100) ) == 100 );
+    blocks[3] = p;
+    
+    int * zeros = static_cast<int*>( e32_heap_calloc( 1000, sizeof(int) ) );
+    BOOST_TEST( std::count( zeros, zeros + 1000, 0 ) == 1000 );
+    blocks.push_back( zeros );
+    
+    struct e32_heap_stats during;
+    e32_heap_stats( &during );
+    BOOST_TEST( during.mallocs - before.mallocs == 12u );
+    BOOST_TEST( during.in_use > before.in_use );
+    BOOST_TEST( during.large_spans >= before.large_spans + 3 );
+    
+    for ( void * b : blocks )
+    {
+        e32_heap_free( b );
+    }
+    
+    struct e32_heap_stats after;
+    e32_heap_stats( &after );
+    BOOST_TEST( after.in_use == before.in_use );
+    BOOST_TEST( after.frees - before.frees == 12u );
+    BOOST_TEST( after.large_spans == before.large_spans );
+}
+
+BOOST_AUTO_TEST_CASE(test_heap_threads)
+{
+    struct e32_heap_stats before;
+    e32_heap_stats( &before );
+    
+    // Blocks allocated by a thread are freed by the next one
+    std::vector< std::vector< void * > > blocks( 9 );
+    
+    for ( int i = 0; i < 8; ++i )
+    {
+        std::thread( [&blocks, i]
+        {
+            for ( void * b : blocks[i] )
+            {
+                e32_heap_free( b );
+            }
+            
+            for ( int j = 0; j < 10000; ++j )
+            {
+                blocks[i + 1].push_back( e32_heap_malloc( 1 + ( j * 37 ) % 3000 ) );
+            }
+        } ).join();
+    }
+    
+    for ( void * b : blocks.back() )
+    {
+        e32_heap_free( b );
+    }
+    
+    struct e32_heap_stats after;
+    e32_heap_stats( &after );
+    BOOST_TEST( after.in_use == before.in_use );
+    BOOST_TEST( after.mallocs - before.mallocs == 80000u );
+    BOOST_TEST( after.frees - before.frees == 80000u );
+}
+
+BOOST_AUTO_TEST_CASE(test_guest_heap)
+{
+    const uint32_t p = call( e32_malloc, 64 );
+    BOOST_REQUIRE( p != 0u );
+    BOOST_TEST( e32_heap_usable_size( reinterpret_cast<void*>( uint64_t(p) ) ) >= 64u );
+    
+    std::fill_n( reinterpret_cast<char*>( uint64_t(p) ), 64, 'x' );
+    
+    struct result_t
+    {
+        uint32_t block;
+        uint32_t zeros;
+    } result = { p, 0 };
+    
+    e32_thread_stack_jump( +[]( void * data )
+                           {
+                               result_t & r = *reinterpret_cast<result_t*>(data);
+                               
+                               const int realloc_args[] = { int(r.block), 5000 };
+                               r.block = e32_enter32_iv( e32_realloc, realloc_args, 2 );
+                               
+                               const int calloc_args[] = { 10, 4 };
+                               r.zeros = e32_enter32_iv( e32_calloc, calloc_args, 2 );
+                           },
+                           &result );
+    
+    BOOST_REQUIRE( result.block != 0u );
+    BOOST_REQUIRE( result.zeros != 0u );
+    
+    const char * block = reinterpret_cast<const char*>( uint64_t(result.block) );
+    const int * zeros = reinterpret_cast<const int*>( uint64_t(result.zeros) );
+    BOOST_TEST( std::count( block, block + 64, 'x' ) == 64 );
+    BOOST_TEST( std::count( zeros, zeros + 10, 0 ) == 10 );
+    
+    call( e32_free, result.block );
+    call( e32_free, result.zeros );
+}
+
+BOOST_AUTO_TEST_CASE(test_buffer)
+{
+    char * buffer = static_cast<char*>( e32_buffer_alloc( 100 ) );
+    BOOST_REQUIRE( buffer != nullptr );
+    BOOST_TEST( e32_buffer_size( buffer ) == 100u );
+    
+    std::strcpy( buffer, "-7777" );
+    BOOST_TEST( call( e32_atoi, e32_ptr( buffer ) ) == -7777 );
+    
+    BOOST_TEST( e32_buffer_ref( buffer ) == buffer );
+    e32_buffer_unref( buffer );
+    BOOST_TEST( call( e32_atoi, e32_ptr( buffer ) ) == -7777 );
+    e32_buffer_unref( buffer );
+    
+    // Sockets and pipes
+    int fds[2];
+    BOOST_REQUIRE( pipe( fds ) == 0 );
+    
+    std::thread writer( [&fds]
+    {
+        for ( const char * chunk : { "12", "34", "56" } )
+        {
+            BOOST_TEST( write( fds[1], chunk, 2 ) == 2 );
+        }
+        close( fds[1] );
+    } );
+    
+    buffer = static_cast<char*>( e32_buffer_alloc( 16 ) );
+    BOOST_TEST( e32_buffer_read( fds[0], buffer, 0, 4 ) == 4 );
+    BOOST_TEST( e32_buffer_read( fds[0], buffer, 4, 11 ) == 2 );
+    buffer[6] = '\0';
+    BOOST_TEST( call( e32_atoi, e32_ptr( buffer ) ) == 123456 );
+    
+    writer.join();
+    close( fds[0] );
+    e32_buffer_unref( buffer );
+}
+
+BOOST_AUTO_TEST_CASE(test_buffer_map)
+{
+    char path[] = "/tmp/e32_buffer_XXXXXX";
+    const int fd = mkstemp( path );
+    BOOST_REQUIRE( fd >= 0 );
+    unlink( path );
+    
+    const std::string content = "31337" + std::string( 10000, ' ' );
+    BOOST_REQUIRE( write( fd, content.data(), content.size() ) == ssize_t( content.size() ) );
+    
+    size_t size = 0;
+    const char * buffer = static_cast<const char*>( e32_buffer_map( fd, &size ) );
+    close( fd );
+    
+    BOOST_REQUIRE( buffer != nullptr );
+    BOOST_TEST( size == content.size() );
+    BOOST_TEST( e32_buffer_size( buffer ) == content.size() );
+    BOOST_TEST( std::string( buffer, size ) == content );
+    BOOST_TEST( call( e32_atoi, e32_ptr( buffer ) ) == 31337 );
+    
+    e32_buffer_unref( const_cast<char*>( buffer ) );
+}
+
+BOOST_AUTO_TEST_CASE(test_ptr)
+{
+    int res;
+    e32_stack_jump( 1024 * 1024,
+                    +[]( void * data )
+                    {
+                        const volatile char q[] = "-5121";
+                        *reinterpret_cast<int*>(data) = 
+                            e32_enter32_i( e32_atoi, e32_ptr( const_cast<char*>(q) ) );
+                    },
+                    &res );
+    BOOST_TEST( res == -5121 );
+}
+
+BOOST_AUTO_TEST_CASE(test_arena)
+{
+    e32_arena * arena = e32_arena_create( 1024 );
+    BOOST_REQUIRE( arena != nullptr );
+    
+    // Empty and impossible requests
+    char * empty = static_cast<char*>( e32_arena_alloc( arena, 0 ) );
+    BOOST_REQUIRE( empty != nullptr );
+    BOOST_TEST( e32_arena_alloc( arena, 0 ) != empty );
+    BOOST_TEST( e32_arena_alloc( arena, SIZE_MAX ) == nullptr );
+    BOOST_TEST( e32_arena_alloc( arena, SIZE_MAX - 8 ) == nullptr );
+    e32_arena_reset( arena );
+    
+    char * first = static_cast<char*>( e32_arena_alloc( arena, 10 ) );
+    char * second = static_cast<char*>( e32_arena_alloc( arena, 10 ) );
+    BOOST_TEST( second - first == 16 );
+    
+    // Larger than a chunk
+    char * big = static_cast<char*>( e32_arena_alloc( arena, 100000 ) );
+    BOOST_REQUIRE( big != nullptr );
+    BOOST_TEST( reinterpret_cast<uint64_t>(big) + 100000 <= 0x100000000ull );
+    std::fill_n( big, 100000, 'a' );
+    
+    e32_arena_reset( arena );
+    BOOST_TEST( e32_arena_alloc( arena, 100000 ) == big );
+    
+    e32_arena_destroy( arena );
+    
+    std::strcpy( static_cast<char*>( e32_scratch_alloc( 8 ) ), "42" );
+    char * scratch = static_cast<char*>( e32_scratch_alloc( 8 ) );
+    std::strcpy( scratch, "-42" );
+    BOOST_TEST( call( e32_atoi, e32_ptr( scratch ) ) == -42 );
+    e32_scratch_reset();
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_routines)
+{
+    char * src = static_cast<char*>( e32_buffer_alloc( 100000 ) );
+    char * dest = static_cast<char*>( e32_buffer_alloc( 100000 ) );
+    
+    for ( int i = 0; i < 100000; ++i )
+    {
+        src[i] = 'a' + i % 26;
+    }
+    src[99999] = '\0';
+    
+    BOOST_TEST( call( e32_strlen, e32_ptr( src ) ) == 99999 );
+    
+    struct result_t
+    {
+        char * src;
+        char * dest;
+        uint32_t copy;
+        int cmp;
+    } result = { src, dest, 0, 0 };
+    
+    e32_thread_stack_jump( +[]( void * data )
+                           {
+                               result_t & r = *reinterpret_cast<result_t*>(data);
+                               
+                               const int memset_args[] = { int(e32_ptr( r.dest )), 'z', 100000 };
+                               e32_enter32_iv( e32_memset, memset_args, 3 );
+                               
+                               const int memcpy_args[] = { int(e32_ptr( r.dest )), int(e32_ptr( r.src )), 50000 };
+                               r.copy = e32_enter32_iv( e32_memcpy, memcpy_args, 3 );
+                               
+                               const int memcmp_args[] = { int(e32_ptr( r.dest )), int(e32_ptr( r.src )), 100000 };
+                               r.cmp = e32_enter32_iv( e32_memcmp, memcmp_args, 3 );
+                           },
+                           &result );
+    
+    BOOST_TEST( result.copy == e32_ptr( dest ) );
+    BOOST_TEST( std::memcmp( dest, src, 50000 ) == 0 );
+    BOOST_TEST( std::count( dest + 50000, dest + 100000, 'z' ) == 50000 );
+    BOOST_TEST( result.cmp > 0 );
+    
+    e32_buffer_unref( src );
+    e32_buffer_unref( dest );
+}
+
+BOOST_AUTO_TEST_CASE(test_vector_math)
+{
+    // Odd size to exercise the scalar tail
+    std::vector< double > in( 1001 );
+    std::vector< double > out( in.size() );
+    
+    for ( size_t i = 0; i < in.size(); ++i )
+    {
+        in[i] = 0.01 + i * 0.013;
+    }
+    
+    const std::pair< void(*)( const double *, double *, size_t ), double(*)( double ) > functions[] =
+    {
+        { &e32_math_vexp, &std::exp },
+        { &e32_math_vlog, &std::log },
+        { &e32_math_vsin, &std::sin },
+        { &e32_math_vcos, &std::cos },
+        { &e32_math_vsqrt, &std::sqrt },
+    };
+    
+    for ( const auto & f : functions )
+    {
+        f.first( in.data(), out.data(), in.size() );
+        
+        for ( size_t i = 0; i < in.size(); ++i )
+        {
+            BOOST_TEST( out[i] == f.second( in[i] ), boost::test_tools::tolerance( 1e-12 ) );
+        }
+    }
+    
+    e32_math_vpow( in.data(), in.data(), out.data(), in.size() );
+    
+    for ( size_t i = 0; i < in.size(); ++i )
+    {
+        BOOST_TEST( out[i] == std::pow( in[i], in[i] ), boost::test_tools::tolerance( 1e-12 ) );
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_probe)
+{
+    e32_probe_enable();
+    const e32_function_ptr probed = e32_make_wrapper( reinterpret_cast<void*>(&sum3), 3 );
+    e32_probe_disable();
+    
+    const e32_function_ptr plain = e32_make_wrapper( reinterpret_cast<void*>(&sum3), 3 );
+    
+    BOOST_REQUIRE( probed != 0u );
+    BOOST_TEST( call( probed, 7 ) == 21 );
+    BOOST_TEST( call( plain, 7 ) == 21 );
+    
+    std::vector< std::thread > threads;
+    for ( int t = 0; t < 4; ++t )
+    {
+        threads.emplace_back( [probed]
+        {
+            for ( int i = 0; i < 250; ++i )
+            {
+                call( probed, i );
+            }
+        } );
+    }
+    
+    for ( std::thread & t : threads )
+    {
+        t.join();
+    }
+    
+    const size_t n = e32_probe_snapshot( nullptr, 0 );
+    std::vector< e32_probe_stats > stats( n );
+    BOOST_REQUIRE( e32_probe_snapshot( stats.data(), stats.size() ) == n );
+    
+    BOOST_TEST( std::none_of( stats.begin(), stats.end(), [plain]( const e32_probe_stats & s ) { return s.thunk == plain; } ) );
+    
+    const auto it = std::find_if( stats.begin(), stats.end(), [probed]( const e32_probe_stats & s ) { return s.thunk == probed; } );
+    BOOST_REQUIRE( it != stats.end() );
+    
+    BOOST_TEST( std::string( it->name ).find( "e32_wrapper::" ) == 0u );
+    BOOST_TEST( it->calls == 1001u );
+    BOOST_TEST( it->cycles > 0u );
+    BOOST_TEST( std::accumulate( std::begin(it->histogram), std::end(it->histogram), uint64_t(0) ) == 1001u );
+}
+
+BOOST_AUTO_TEST_CASE(test_enter32_batch)
+{
+    const e32_function_ptr wrapper = e32_make_wrapper( reinterpret_cast<void*>(&sum3), 3 );
+    
+    const size_t count = 1000;
+    
+    // Arrays in the low 4GB are used in place, others are staged
+    int * low_args = static_cast<int*>( e32_heap_malloc( count * 3 * sizeof(int) ) );
+    int * low_results = static_cast<int*>( e32_heap_malloc( count * sizeof(int) ) );
+    
+    const size_t high_size = ( count * 4 * sizeof(int) + 4095 ) & ~size_t(4095);
+    void * high = mmap( reinterpret_cast<void*>( 0x500000000000ull ), high_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    BOOST_REQUIRE( high != MAP_FAILED );
+    BOOST_REQUIRE( reinterpret_cast<uint64_t>(high) > 0xFFFFFFFFull );
+    
+    int * high_args = static_cast<int*>( high );
+    int * high_results = high_args + count * 3;
+    
+    for ( size_t i = 0; i < count * 3; ++i )
+    {
+        low_args[i] = high_args[i] = int(i);
+    }
+    
+    struct batch_t
+    {
+        e32_function_ptr method;
+        const int * args;
+        int * results;
+        size_t count;
+        int ret;
+    };
+    
+    for ( batch_t batch : { batch_t{ wrapper, low_args, low_results, count, -1 },
+                            batch_t{ wrapper, high_args, high_results, count, -1 },
+                            batch_t{ wrapper, high_args, low_results, 3, -1 },
+                            batch_t{ wrapper, low_args, high_results, 0, -1 } } )
+    {
+        std::fill_n( batch.results, batch.count, -1 );
+        
+        e32_thread_stack_jump( +[]( void * data )
+                               {
+                                   batch_t & b = *reinterpret_cast<batch_t*>(data);
+                                   b.ret = e32_enter32_batch( b.method, b.args, 3, b.results, b.count );
+                               },
+                               &batch );
+        
+        BOOST_TEST( batch.ret == 0 );
+        
+        for ( size_t i = 0; i < batch.count; ++i )
+        {
+            BOOST_TEST( batch.results[i] == int( 9 * i + 3 ) );
+        }
+    }
+    
+    munmap( high, high_size );
+    e32_heap_free( low_args );
+    e32_heap_free( low_results );
+}
+
+BOOST_AUTO_TEST_CASE(test_fiber)
+{
+    struct state_t
+    {
+        std::vector< int > trace;
+        int id;
+    };
+    
+    auto body = +[]( void * data )
+    {
+        state_t & s = *reinterpret_cast<state_t*>(data);
+        for ( int i = 0; i < 3; ++i )
+        {
+            s.trace.push_back( s.id * 10 + i );
+            BOOST_TEST( e32_fiber_yield() == 0 );
+        }
+    };
+    
+    std::vector< int > trace;
+    state_t a{ {}, 1 };
+    state_t b{ {}, 2 };
+    
+    e32_fiber * fa = e32_fiber_create( body, &a, 64 * 1024 );
+    e32_fiber * fb = e32_fiber_create( body, &b, 64 * 1024 );
+    BOOST_REQUIRE( fa != nullptr );
+    BOOST_REQUIRE( fb != nullptr );
+    
+    BOOST_TEST( e32_fiber_current() == nullptr );
+    BOOST_TEST( e32_fiber_yield() == -1 );
+    
+    int resumed = 0;
+    while ( !e32_fiber_done( fa ) || !e32_fiber_done( fb ) )
+    {
+        for ( e32_fiber * f : { fa, fb } )
+        {
+            if ( !e32_fiber_done( f ) )
+            {
+                BOOST_TEST( e32_fiber_resume( f ) >= 0 );
+                ++resumed;
+            }
+        }
+    }
+    
+    BOOST_TEST( resumed == 8 );
+    BOOST_TEST( a.trace == std::vector< int >( { 10, 11, 12 } ) );
+    BOOST_TEST( b.trace == std::vector< int >( { 20, 21, 22 } ) );
+    BOOST_TEST( e32_fiber_resume( fa ) == -1 );
+    
+    e32_fiber_destroy( fa );
+    e32_fiber_destroy( fb );
+}
+
+int yielding_sum3( int a, int b, int c )
+{
+    e32_fiber_yield();
+    return a + b + c;
+}
+
+BOOST_AUTO_TEST_CASE(test_fiber_guest)
+{
+    // Suspend fibers from a host function called by 32-bit code
+    struct request_t
+    {
+        e32_function_ptr wrapper;
+        int arg;
+        int result;
+    };
+    
+    const e32_function_ptr wrapper = e32_make_wrapper( reinterpret_cast<void*>(&yielding_sum3), 3 );
+    
+    std::vector< request_t > requests;
+    for ( int i = 0; i < 100; ++i )
+    {
+        requests.push_back( request_t{ wrapper, i, 0 } );
+    }
+    
+    std::vector< e32_fiber * > fibers;
+    for ( request_t & r : requests )
+    {
+        fibers.push_back( e32_fiber_create( +[]( void * data )
+                                            {
+                                                request_t & r = *reinterpret_cast<request_t*>(data);
+                                                r.result = e32_enter32_i( r.wrapper, r.arg );
+                                            },
+                                            &r,
+                                            64 * 1024 ) );
+    }
+    
+    // Every fiber is suspended inside the guest call at the same time
+    for ( e32_fiber * f : fibers )
+    {
+        BOOST_TEST( e32_fiber_resume( f ) == 1 );
+    }
+    
+    // Finish them from another thread, in reverse order
+    std::thread( [&fibers]
+    {
+        for ( auto it = fibers.rbegin(); it != fibers.rend(); ++it )
+        {
+            BOOST_TEST( e32_fiber_resume( *it ) == 0 );
+            e32_fiber_destroy( *it );
+        }
+    } ).join();
+    
+    for ( int i = 0; i < 100; ++i )
+    {
+        BOOST_TEST( requests[i].result == 3 * i );
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_switch_mechanisms)
+{
+    // Nothing is validated or timed behind the first guest call
+    const int initial = e32_switch_current();
+    BOOST_TEST( e32_switch_name( initial ) != nullptr );
+    
+    if ( !std::getenv( "E32_SWITCH" ) )
+    {
+        BOOST_TEST( initial == E32_SWITCH_LCALL );
+    }
+    
+    // The checks run in process, and leave the fault handlers of the host alone
+    struct sigaction host_handler, original;
+    sigaction( SIGSEGV, nullptr, &original );
+    std::memset( &host_handler, 0, sizeof(host_handler) );
+    host_handler.sa_handler = +[]( int ) {};
+    sigaction( SIGSEGV, &host_handler, nullptr );
+    
+    BOOST_TEST( e32_switch_validate( E32_SWITCH_LCALL ) == 0 );
+    
+    struct sigaction after;
+    sigaction( SIGSEGV, nullptr, &after );
+    BOOST_TEST( ( after.sa_handler == host_handler.sa_handler ) );
+    
+    sigaction( SIGSEGV, &original, nullptr );
+    BOOST_TEST( e32_switch_name( E32_SWITCH_COUNT ) == nullptr );
+    BOOST_TEST( e32_switch_select( -1 ) == -1 );
+    
+    const e32_function_ptr sum3 = e32_make_wrapper( reinterpret_cast<void*>( +[]( int a, int b, int c ) { return a + b + c; } ), 3 );
+    
+    for ( int m = 0; m < E32_SWITCH_COUNT; ++m )
+    {
+        BOOST_TEST_CONTEXT( e32_switch_name( m ) )
+        {
+            BOOST_REQUIRE( e32_switch_validate( m ) == 0 );
+            BOOST_TEST( e32_switch_benchmark( m ) > 0 );
+            BOOST_REQUIRE( e32_switch_select( m ) == 0 );
+            BOOST_TEST( e32_switch_current() == m );
+            
+            // Guest to host and back, through every entry point
+            BOOST_TEST( call( e32_abs, -42 ) == 42 );
+            BOOST_TEST( call( sum3, 5 ) == 15 );
+            
+            struct batch_t
+            {
+                e32_function_ptr method;
+                int ret;
+                int results[4];
+            } b = { sum3, -1, {} };
+            
+            e32_thread_stack_jump( +[]( void * data )
+                                   {
+                                       batch_t & b = *reinterpret_cast<batch_t*>(data);
+                                       const int args[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+                                       b.ret = e32_enter32_batch( b.method, args, 3, b.results, 4 );
+                                   },
+                                   &b );
+            
+            BOOST_TEST( b.ret == 0 );
+            BOOST_TEST( std::vector< int >( b.results, b.results + 4 ) == std::vector< int >( { 6, 15, 24, 33 } ) );
+        }
+    }
+    
+    const int best = e32_switch_autoselect();
+    BOOST_TEST( e32_switch_current() == best );
+    BOOST_TEST( call( e32_abs, -1 ) == 1 );
+    
+    BOOST_TEST( e32_switch_select( initial ) == 0 );
+}
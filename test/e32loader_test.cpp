@@ -2,8 +2,35 @@
 #define BOOST_TEST_MODULE elf_loader
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <counters_report.h>
 #include <e32_libc.h>
 #include <loader.h>
+#include <symbol_namespace.h>
 
 int call( e32_function_ptr method, int arg )
 {
@@ -71,3 +98,951 @@ BOOST_AUTO_TEST_CASE(test_base1_pic)
     BOOST_TEST( call( loader.get_sym("foo_atoi"), 10 ) == 120 );
     BOOST_TEST( call( loader.get_sym("foo_atoi"), -10 ) == -120 );
 }
+
+BOOST_AUTO_TEST_CASE(test_concurrent_calls)
+{
+    elf::loader loader("32bit/libbase1_pic.so", get_symlibc);
+    
+    struct worker_t
+    {
+        e32_function_ptr foo;
+        e32_function_ptr foo_atoi;
+        int calls;
+        int failures;
+    };
+    
+    const unsigned max_threads = std::min( 64u, std::max( 4u, std::thread::hardware_concurrency() ) );
+    const int calls_per_thread = 20000;
+    
+    for ( unsigned nthreads = 1; nthreads <= max_threads; nthreads *= 2 )
+    {
+        std::vector< worker_t > workers( nthreads, worker_t{ loader.get_sym("foo"), loader.get_sym("foo_atoi"), calls_per_thread, 0 } );
+        std::vector< std::thread > threads;
+        
+        const auto start = std::chrono::steady_clock::now();
+        
+        for ( worker_t & w : workers )
+        {
+            threads.emplace_back( [&w]
+            {
+                e32_thread_stack_jump( +[]( void * data )
+                                       {
+                                           worker_t * w = reinterpret_cast<worker_t*>(data);
+                                           for ( int i = 0; i < w->calls; ++i )
+                                           {
+                                               const int c = i % 16;
+                                               if ( e32_enter32_i( w->foo, c ) != c * (c - 1) / 2 ||
+                                                    e32_enter32_i( w->foo_atoi, c ) != c * 12 )
+                                               {
+                                                   ++w->failures;
+                                               }
+                                           }
+                                       },
+                                       &w );
+            } );
+        }
+        
+        for ( std::thread & t : threads )
+        {
+            t.join();
+        }
+        
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        
+        int failures = 0;
+        for ( const worker_t & w : workers )
+        {
+            failures += w.failures;
+        }
+        
+        BOOST_TEST( failures == 0 );
+        BOOST_TEST_MESSAGE( nthreads << " threads: " 
+                            << 2.0 * calls_per_thread * nthreads / elapsed.count() << " calls/s" );
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_concurrent_load)
+{
+    std::vector< std::thread > threads;
+    std::atomic< int > failures(0);
+    
+    for ( int i = 0; i < 8; ++i )
+    {
+        threads.emplace_back( [&failures, i]
+        {
+            elf::loader loader( i % 2 ? "32bit/libbase1_pic.so" : "32bit/libbase1.so", get_symlibc);
+            
+            if ( call( loader.get_sym("foo_atoi"), i ) != 12 * i )
+            {
+                ++failures;
+            }
+        } );
+    }
+    
+    for ( std::thread & t : threads )
+    {
+        t.join();
+    }
+    
+    BOOST_TEST( failures == 0 );
+}
+
+BOOST_AUTO_TEST_CASE(test_callback_import)
+{
+    struct counted_atoi
+    {
+        int calls;
+        
+        static int invoke( void * self, const char * str )
+        {
+            ++static_cast<counted_atoi*>(self)->calls;
+            return std::atoi( str );
+        }
+    } counter = { 0 };
+    
+    const e32_function_ptr cb = e32_make_callback( reinterpret_cast<void*>(&counted_atoi::invoke), &counter, 1 );
+    
+    elf::loader loader("32bit/libbase1.so", [cb]( std::experimental::string_view name ) -> uint32_t
+    {
+        return name == "atoi" ? cb : get_symlibc( name );
+    } );
+    
+    BOOST_TEST( call( loader.get_sym("foo_atoi"), 3 ) == 36 );
+    BOOST_TEST( call( loader.get_sym("foo_atoi"), -1 ) == -12 );
+    BOOST_TEST( counter.calls == 2 );
+}
+
+BOOST_AUTO_TEST_CASE(test_math_import)
+{
+    const std::map< std::experimental::string_view, e32_function_ptr > math =
+    {
+        { "exp", e32_exp },
+        { "log", e32_log },
+        { "sin", e32_sin },
+        { "cos", e32_cos },
+        { "pow", e32_pow },
+        { "sqrt", e32_sqrt },
+        { "e32_vexp", e32_vexp },
+        { "e32_vpow", e32_vpow },
+    };
+    
+    elf::loader loader( "32bit/libmath1.so", [&math]( std::experimental::string_view name ) -> uint32_t
+    {
+        const auto it = math.find( name );
+        return it != math.end() ? it->second : get_symlibc( name );
+    } );
+    
+    BOOST_TEST( call( loader.get_sym("math_exp"), 10 ) == 2718 );
+    BOOST_TEST( call( loader.get_sym("math_exp"), -10 ) == 367 );
+    BOOST_TEST( call( loader.get_sym("math_pow"), 2 ) == 2828 );
+    BOOST_TEST( call( loader.get_sym("math_trig"), 100 ) == 100 );
+    BOOST_TEST( call( loader.get_sym("math_vexp"), 20 ) == 100576 );  // 37 * sqrt( exp( 2 ) )
+}
+
+BOOST_AUTO_TEST_CASE(test_perf_map)
+{
+    char path[] = "/tmp/e32_perf_map_XXXXXX";
+    const int fd = mkstemp( path );
+    BOOST_REQUIRE( fd >= 0 );
+    close( fd );
+    
+    BOOST_REQUIRE( e32_perf_map_enable( path ) == 0 );
+    
+    auto read_map = [&path]
+    {
+        std::ifstream file( path );
+        std::map< uint32_t, std::string > entries;
+        
+        std::string line;
+        while ( std::getline( file, line ) )
+        {
+            std::istringstream fields( line );
+            uint32_t address;
+            std::size_t size;
+            std::string name;
+            fields >> std::hex >> address >> size >> name;
+            
+            BOOST_TEST( size > 0u );
+            entries[address] = name;
+        }
+        
+        return entries;
+    };
+    
+    const e32_function_ptr wrapper = e32_make_wrapper( reinterpret_cast<void*>(&std::labs), 1 );
+    
+    {
+        elf::loader loader("32bit/libbase1.so", get_symlibc);
+        
+        const auto entries = read_map();
+        BOOST_TEST( entries.at( loader.get_sym("foo") ) == "libbase1.so::foo" );
+        BOOST_TEST( entries.at( loader.get_sym("foo_atoi") ) == "libbase1.so::foo_atoi" );
+        BOOST_TEST( entries.at( wrapper ).find( "e32_wrapper::" ) == 0u );
+    }
+    
+    // Append-only: a module loaded later adds its entries after the ones of the unloaded module
+    {
+        elf::loader loader("32bit/libbase1_pic.so", get_symlibc);
+        
+        const auto entries = read_map();
+        BOOST_TEST( entries.count( wrapper ) == 1u );
+        BOOST_TEST( entries.at( loader.get_sym("foo") ) == "libbase1_pic.so::foo" );
+    }
+    
+    std::ifstream file( path );
+    const std::string map( ( std::istreambuf_iterator< char >( file ) ), std::istreambuf_iterator< char >() );
+    BOOST_TEST( map.find( " libbase1.so::foo\n" ) != std::string::npos );
+    
+    e32_perf_map_disable();
+    unlink( path );
+}
+
+BOOST_AUTO_TEST_CASE(test_batch_calls)
+{
+    elf::loader loader("32bit/libbase1_pic.so", get_symlibc);
+    
+    struct batch_t
+    {
+        e32_function_ptr method;
+        std::vector< int > args;
+        std::vector< int > results;
+    } batch = { loader.get_sym("foo"), std::vector< int >( 10000 ), std::vector< int >( 10000 ) };
+    
+    std::iota( batch.args.begin(), batch.args.end(), -100 );
+    
+    e32_thread_stack_jump( +[]( void * data )
+                           {
+                               batch_t & b = *reinterpret_cast<batch_t*>(data);
+                               BOOST_TEST( e32_enter32_batch( b.method, b.args.data(), 1, b.results.data(), b.args.size() ) == 0 );
+                           },
+                           &batch );
+    
+    for ( size_t i = 0; i < batch.args.size(); ++i )
+    {
+        const int c = batch.args[i];
+        BOOST_TEST( batch.results[i] == ( c > 0 ? c * ( c - 1 ) / 2 : 0 ) );
+    }
+}
+
+int host_foo( int c )
+{
+    return 1000 + c;
+}
+
+BOOST_AUTO_TEST_CASE(test_override)
+{
+    const e32_function_ptr wrapper = e32_make_wrapper( reinterpret_cast<void*>(&host_foo), 1 );
+    
+    for ( const char * module : { "32bit/libbase1.so", "32bit/libbase1_pic.so" } )
+    {
+        elf::loader loader( module, get_symlibc, { { "foo", wrapper } } );
+        
+        // Exported symbol, and calls from other guest functions
+        BOOST_TEST( loader.get_sym("foo") == wrapper );
+        BOOST_TEST( call( loader.get_sym("foo"), 5 ) == 1005 );
+        BOOST_TEST( call( loader.get_sym("foo_abs"), -10 ) == 1010 );
+        
+        // Other symbols are unaffected
+        BOOST_TEST( call( loader.get_sym("foo_atoi"), 2 ) == 24 );
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_snapshot_reset)
+{
+    elf::loader loader("32bit/libstate1.so", get_symlibc);
+    
+    BOOST_CHECK_THROW( loader.reset(), std::logic_error );
+    
+    loader.snapshot();
+    
+    BOOST_TEST( call( loader.get_sym("bump"), 1 ) == 101 );
+    BOOST_TEST( call( loader.get_sym("fill"), 2 ) == 0 );
+    BOOST_TEST( call( loader.get_sym("fill"), 3 ) == 2 * 4096 );
+    
+    loader.reset();
+    
+    BOOST_TEST( call( loader.get_sym("bump"), 1 ) == 101 );
+    BOOST_TEST( call( loader.get_sym("fill"), 5 ) == 0 );
+    
+    // A later snapshot replaces the first one
+    loader.snapshot();
+    BOOST_TEST( call( loader.get_sym("bump"), 10 ) == 111 );
+    
+    for ( int i = 0; i < 3; ++i )
+    {
+        loader.reset();
+        BOOST_TEST( call( loader.get_sym("bump"), 0 ) == 101 );
+        BOOST_TEST( call( loader.get_sym("fill"), 7 ) == 5 * 4096 );
+    }
+}
+
+/**
+ * @brief Clean resident memory of the mappings of \ref file, in kB, from /proc/self/smaps.
+ * 
+ * Clean pages are page cache pages the kernel can reclaim, unlike private
+ * copies or shared memory.
+ */
+std::size_t clean_kb( const std::string & file )
+{
+    char * path = realpath( file.c_str(), nullptr );
+    BOOST_REQUIRE( path != nullptr );
+    const std::string name( path );
+    free( path );
+    
+    std::ifstream smaps( "/proc/self/smaps" );
+    std::string line;
+    bool mapping = false;
+    std::size_t ans = 0;
+    
+    while ( std::getline( smaps, line ) )
+    {
+        std::istringstream fields( line );
+        std::string key;
+        fields >> key;
+        
+        if ( key.find( '-' ) != std::string::npos )
+        {
+            mapping = line.size() >= name.size() && line.compare( line.size() - name.size(), name.size(), name ) == 0;
+        }
+        else if ( mapping && ( key == "Shared_Clean:" || key == "Private_Clean:" ) )
+        {
+            std::size_t kb = 0;
+            fields >> kb;
+            ans += kb;
+        }
+    }
+    
+    return ans;
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_usage)
+{
+    elf::loader loader("32bit/libstate1.so", get_symlibc);
+    
+    BOOST_TEST( call( loader.get_sym("bump"), 1 ) == 101 );
+    BOOST_TEST( call( loader.get_sym("fill"), 2 ) == 0 );
+    
+    auto usage = loader.memory_usage();
+    BOOST_REQUIRE( !usage.empty() );
+    
+    auto code = usage.end();
+    std::size_t dirty = 0;
+    
+    for ( auto i = usage.begin(); i != usage.end(); ++i )
+    {
+        BOOST_TEST( i->resident >= i->dirty + i->shared );
+        BOOST_TEST( i->resident * getpagesize() <= i->size );
+        
+        if ( i != usage.begin() )
+        {
+            BOOST_TEST( i->offset == std::prev(i)->offset + std::prev(i)->size );
+        }
+        
+        if ( i->prot & PROT_EXEC )
+        {
+            code = i;
+        }
+        
+        dirty += i->dirty;
+    }
+    
+    // The code maps the file, the table in .bss is private
+    BOOST_REQUIRE( ( code != usage.end() ) );
+    BOOST_TEST( code->resident > 0u );
+    BOOST_TEST( code->dirty == 0u );
+    BOOST_TEST( dirty >= 4096 * sizeof(int) / getpagesize() );
+    
+    // Only the clean pages go away, and the memory with them
+    const std::size_t clean = clean_kb( "32bit/libstate1.so" );
+    BOOST_TEST( clean > 0u );
+    BOOST_TEST( loader.trim() > 0u );
+    BOOST_TEST( clean_kb( "32bit/libstate1.so" ) == 0u );
+    
+    auto trimmed = loader.memory_usage();
+    std::size_t trimmed_dirty = 0;
+    
+    for ( auto const & u : trimmed )
+    {
+        BOOST_TEST( u.resident == u.dirty );
+        trimmed_dirty += u.dirty;
+    }
+    
+    BOOST_TEST( trimmed_dirty == dirty );
+    
+    // The state is kept, the code is read back
+    BOOST_TEST( call( loader.get_sym("bump"), 1 ) == 102 );
+    BOOST_TEST( call( loader.get_sym("fill"), 3 ) == 2 * 4096 );
+    
+    // Hot reload replaces the module file by rename, a write in place stops trim
+    {
+        std::ifstream module( "32bit/libstate1.so", std::ios::binary );
+        const std::string content( ( std::istreambuf_iterator< char >( module ) ), std::istreambuf_iterator< char >() );
+        
+        auto copy = [&content]( char * path )
+        {
+            const int fd = mkstemp( path );
+            BOOST_REQUIRE( fd >= 0 );
+            BOOST_REQUIRE( write( fd, content.data(), content.size() ) == ssize_t( content.size() ) );
+            
+            // Any later write moves the modification time
+            const struct timespec times[2] = { { 0, 0 }, { 0, 0 } };
+            BOOST_REQUIRE( futimens( fd, times ) == 0 );
+            
+            return fd;
+        };
+        
+        char path[] = "/tmp/e32_module_XXXXXX";
+        const int fd = copy( path );
+        elf::loader other( path, get_symlibc );
+        BOOST_TEST( call( other.get_sym("bump"), 1 ) == 101 );
+        
+        char next[] = "/tmp/e32_module_XXXXXX";
+        close( copy( next ) );
+        BOOST_REQUIRE( rename( next, path ) == 0 );
+        
+        BOOST_TEST( other.trim() > 0u );
+        BOOST_TEST( call( other.get_sym("bump"), 1 ) == 102 );
+        
+        // Same bytes, but trim can not know
+        BOOST_REQUIRE( pwrite( fd, content.data(), 4096, 0 ) == 4096 );
+        BOOST_CHECK_THROW( other.trim(), std::runtime_error );
+        BOOST_TEST( call( other.get_sym("bump"), 1 ) == 103 );
+        
+        close( fd );
+        unlink( path );
+    }
+    
+    // Trimming a snapshot only drops the pages that were not written since
+    loader.snapshot();
+    BOOST_TEST( call( loader.get_sym("bump"), 1 ) == 103 );
+    loader.trim();
+    BOOST_TEST( call( loader.get_sym("bump"), 0 ) == 103 );
+    loader.reset();
+    BOOST_TEST( call( loader.get_sym("bump"), 0 ) == 102 );
+}
+
+int host_mix3( int a, int b, int c )
+{
+    return a * 100 + b * 10 + c;
+}
+
+int host_fast4( int a, int b, int c, int d )
+{
+    return a * 1000 + b * 100 + c * 10 + d;
+}
+
+BOOST_AUTO_TEST_CASE(test_register_conventions)
+{
+    const e32_function_ptr mix3 = e32_make_wrapper_cc( reinterpret_cast<void*>( &host_mix3 ), 3, E32_CC_REGPARM3 );
+    const e32_function_ptr fast4 = e32_make_wrapper_cc( reinterpret_cast<void*>( &host_fast4 ), 4, E32_CC_FASTCALL );
+    BOOST_REQUIRE( mix3 != 0 );
+    BOOST_REQUIRE( fast4 != 0 );
+    BOOST_TEST( e32_make_wrapper_cc( reinterpret_cast<void*>( &host_mix3 ), 3, 5 ) == 0u );
+    
+    elf::loader loader( "32bit/libregparm1.so", [&]( std::experimental::string_view name ) -> uint32_t
+    {
+        if ( name == "host_mix3" )
+        {
+            return mix3;
+        }
+        
+        return name == "host_fast4" ? fast4 : get_symlibc( name );
+    } );
+    
+    struct call_t
+    {
+        e32_function_ptr method;
+        int callconv;
+        std::vector< int > args;
+        int res;
+    };
+    
+    auto call_cc = []( call_t c )
+    {
+        e32_thread_stack_jump( +[]( void * data )
+                               {
+                                   call_t & c = *reinterpret_cast<call_t*>(data);
+                                   c.res = e32_enter32_cc( c.method, c.callconv, c.args.data(), c.args.size() );
+                               },
+                               &c );
+        return c.res;
+    };
+    
+    BOOST_TEST( call_cc( { loader.get_sym( "regparm_call" ), E32_CC_REGPARM3, { 1, 2, 3, 4 }, 0 } ) == 123 + 4321 );
+    BOOST_TEST( call_cc( { loader.get_sym( "fastcall_call" ), E32_CC_FASTCALL, { 1, 2, 3, 4 }, 0 } ) == 1234 - 4 );
+    BOOST_TEST( call_cc( { loader.get_sym( "regparm_loop" ), E32_CC_REGPARM3, { 100 }, 0 } ) ==
+                100 * 123 + 1000 * 4950 + 10 * 4950 );
+    
+    // Host calls through the register conventions
+    BOOST_TEST( call_cc( { mix3, E32_CC_REGPARM3, { 4, 5, 6 }, 0 } ) == 456 );
+    BOOST_TEST( call_cc( { fast4, E32_CC_FASTCALL, { 4, 5, 6, 7 }, 0 } ) == 4567 );
+    BOOST_TEST( call_cc( { mix3, 7, { 4, 5, 6 }, 0 } ) == -1 );
+}
+
+BOOST_AUTO_TEST_CASE(test_data_exports)
+{
+    struct host_data_t
+    {
+        int table[16];
+        int counter;
+    };
+    
+    host_data_t * data = static_cast<host_data_t*>( e32_heap_malloc( sizeof(host_data_t) ) );
+    std::iota( data->table, data->table + 16, 1 );
+    
+    auto get_symdata = [data]( std::experimental::string_view name ) -> uint32_t
+    {
+        if ( name == "host_table" )
+        {
+            return e32_ptr( data->table );
+        }
+        
+        return name == "host_counter" ? e32_ptr( &data->counter ) : get_symlibc( name );
+    };
+    
+    for ( const char * module : { "32bit/libdata1_pic.so", "32bit/libdata1.so", "32bit/data1_pie" } )
+    {
+        BOOST_TEST_CONTEXT( module )
+        {
+            data->counter = 100;
+            
+            elf::loader loader( module, get_symdata );
+            
+            BOOST_TEST( call( loader.get_sym( "data_sum" ), 16 ) == 136 );
+            BOOST_TEST( call( loader.get_sym( "data_bump" ), 3 ) == 103 );
+            BOOST_TEST( call( loader.get_sym( "data_guest_counter" ), 0 ) == 8 );
+            
+            // Host writes are seen by the guest, and the other way around
+            data->table[0] = 1001;
+            BOOST_TEST( call( loader.get_sym( "data_sum" ), 1 ) == 1001 );
+            BOOST_TEST( data->counter == 103 );
+            data->table[0] = 1;
+        }
+    }
+    
+    // A copy relocation needs a host definition
+    BOOST_CHECK_THROW( elf::loader( "32bit/data1_pie", get_symlibc ), std::runtime_error );
+    
+    e32_heap_free( data );
+}
+
+BOOST_AUTO_TEST_CASE(test_guest_tls)
+{
+    std::vector< elf::loader > modules;
+    modules.emplace_back( "32bit/libtls1_pic.so", get_symlibc );
+    
+    // Started before the second module is loaded
+    std::atomic< int > ready( 0 );
+    std::atomic< bool > loaded( false );
+    std::vector< std::thread > threads;
+    std::vector< std::vector< int > > results( 4 );
+    
+    for ( int t = 0; t < 4; ++t )
+    {
+        threads.emplace_back( [&, t]
+        {
+            BOOST_REQUIRE( call( modules[0].get_sym( "tls_bump" ), 0 ) == 5 );
+            
+            ++ready;
+            while ( !loaded )
+            {
+                std::this_thread::yield();
+            }
+            
+            for ( const elf::loader & m : modules )
+            {
+                int value = 0;
+                for ( int i = 1; i <= 1000; ++i )
+                {
+                    value = call( m.get_sym( "tls_bump" ), t + 1 );
+                }
+                
+                results[t].push_back( value );
+                results[t].push_back( call( m.get_sym( "tls_local_value" ), 0 ) );
+                results[t].push_back( call( m.get_sym( "tls_address" ), 0 ) );
+            }
+        } );
+    }
+    
+    while ( ready < 4 )
+    {
+        std::this_thread::yield();
+    }
+    
+    modules.emplace_back( "32bit/libtls1_ie.so", get_symlibc );
+    loaded = true;
+    
+    for ( std::thread & t : threads )
+    {
+        t.join();
+    }
+    
+    std::vector< int > addresses;
+    
+    for ( int t = 0; t < 4; ++t )
+    {
+        BOOST_TEST_CONTEXT( "thread " << t )
+        {
+            BOOST_REQUIRE( results[t].size() == 6u );
+            
+            for ( int m = 0; m < 2; ++m )
+            {
+                BOOST_TEST( results[t][3 * m] == 5 + 1000 * ( t + 1 ) );
+                BOOST_TEST( results[t][3 * m + 1] == 2000 * ( t + 1 ) );
+                addresses.push_back( results[t][3 * m + 2] );
+            }
+        }
+    }
+    
+    // A block per thread and per module
+    std::sort( addresses.begin(), addresses.end() );
+    BOOST_TEST( ( std::unique( addresses.begin(), addresses.end() ) == addresses.end() ) );
+    
+    // This thread starts from the initial image, after the others are gone
+    BOOST_TEST( call( modules[1].get_sym( "tls_bump" ), 1 ) == 6 );
+}
+
+BOOST_AUTO_TEST_CASE(test_guest_tls_failure)
+{
+    elf::loader tls( "32bit/libtls1_pic.so", get_symlibc );
+    e32_function_ptr tls_bump = tls.get_sym( "tls_bump" );
+    
+    bool filtered = false;
+    int res = 0;
+    int error = 0;
+    
+    std::thread( [&]
+    {
+        // This thread only: modify_ldt fails with EPERM
+        struct sock_filter filter[] =
+        {
+            BPF_STMT( BPF_LD | BPF_W | BPF_ABS, offsetof( struct seccomp_data, arch ) ),
+            BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0 ),
+            BPF_STMT( BPF_RET | BPF_K, SECCOMP_RET_ALLOW ),
+            BPF_STMT( BPF_LD | BPF_W | BPF_ABS, offsetof( struct seccomp_data, nr ) ),
+            BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, SYS_modify_ldt, 0, 1 ),
+            BPF_STMT( BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM ),
+            BPF_STMT( BPF_RET | BPF_K, SECCOMP_RET_ALLOW ),
+        };
+        struct sock_fprog prog = { sizeof(filter) / sizeof(filter[0]), filter };
+        
+        filtered = prctl( PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0 ) == 0 &&
+                   prctl( PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog ) == 0;
+        
+        if ( !filtered )
+        {
+            return;
+        }
+        
+        struct data_t
+        {
+            e32_function_ptr method;
+            int res;
+            int error;
+        } data = { tls_bump, 0, 0 };
+        
+        e32_stack_jump( 1024 * 1024,
+                        +[]( void * p )
+                        {
+                            data_t * d = reinterpret_cast<data_t*>(p);
+                            errno = 0;
+                            d->res = e32_enter32_i( d->method, 1 );
+                            d->error = errno;
+                        },
+                        &data );
+        
+        res = data.res;
+        error = data.error;
+    } ).join();
+    
+    if ( !filtered )
+    {
+        BOOST_TEST_MESSAGE( "seccomp is not available, skipped" );
+        return;
+    }
+    
+    // The call fails instead of running with a stale %gs
+    BOOST_TEST( res == -1 );
+    BOOST_TEST( error == EPERM );
+    
+    // Other threads are not affected
+    BOOST_TEST( call( tls_bump, 1 ) == 6 );
+}
+
+BOOST_AUTO_TEST_CASE(test_symbol_namespace)
+{
+    elf::symbol_namespace ns;
+    
+    elf::loader base( "32bit/libbase1.so", get_symlibc );
+    elf::loader base_pic( "32bit/libbase1_pic.so", get_symlibc );
+    
+    const elf::symbol_namespace::module_id base_id = ns.add( "base1", base );
+    const elf::symbol_namespace::module_id base_pic_id = ns.add( "base1_pic", base_pic );
+    
+    // The first module keeps the name, imports are not exports
+    BOOST_TEST( ns.find( "foo" ) == base.get_sym( "foo" ) );
+    BOOST_TEST( ns.find( "abs" ) == 0u );
+    BOOST_TEST( ns.find( "missing" ) == 0u );
+    
+    elf::loader link( "32bit/liblink1.so", ns.resolver( get_symlibc ) );
+    BOOST_TEST( call( link.get_sym( "link_foo" ), 10 ) == 46 );
+    
+    BOOST_TEST( ns.remove( base_id ) );
+    BOOST_TEST( !ns.remove( base_id ) );
+    BOOST_TEST( ns.find( "foo" ) == base_pic.get_sym( "foo" ) );
+    
+    // Lookups racing with loads and unloads see either module, never a freed table
+    std::atomic< bool > stop( false );
+    std::atomic< int > errors( 0 );
+    std::vector< std::thread > readers;
+    
+    const uint32_t foo = base.get_sym( "foo" );
+    const uint32_t foo_pic = base_pic.get_sym( "foo" );
+    
+    for ( int t = 0; t < 4; ++t )
+    {
+        readers.emplace_back( [&]
+        {
+            while ( !stop )
+            {
+                const uint32_t ans = ns.find( "foo" );
+                errors += ans != foo && ans != foo_pic;
+                errors += ns.find( "foo_atoi" ) == 0;
+            }
+        } );
+    }
+    
+    elf::symbol_namespace::module_id pic_id = base_pic_id;
+    
+    for ( int i = 0; i < 50; ++i )
+    {
+        const elf::symbol_namespace::module_id id = ns.add( "base1", base );
+        BOOST_REQUIRE( ns.remove( pic_id ) );
+        
+        BOOST_REQUIRE( ns.find( "foo" ) == foo );
+        
+        pic_id = ns.add( "base1_pic", base_pic );
+        BOOST_REQUIRE( ns.remove( id ) );
+    }
+    
+    stop = true;
+    
+    for ( std::thread & t : readers )
+    {
+        t.join();
+    }
+    
+    BOOST_TEST( errors == 0 );
+}
+
+std::atomic< bool > executor_gate( true );
+
+int gated_mix3( int a, int b, int c )
+{
+    while ( !executor_gate )
+    {
+        std::this_thread::yield();
+    }
+    
+    return host_mix3( a, b, c );
+}
+
+BOOST_AUTO_TEST_CASE(test_executor)
+{
+    BOOST_TEST( e32_executor_create( 1, 3, nullptr ) == nullptr );
+    BOOST_TEST( e32_executor_create( 0, 4, nullptr ) == nullptr );
+    
+    elf::loader base( "32bit/libbase1.so", get_symlibc );
+    
+    const e32_function_ptr mix3 = e32_make_wrapper_cc( reinterpret_cast<void*>( &gated_mix3 ), 3, E32_CC_REGPARM3 );
+    const e32_function_ptr fast4 = e32_make_wrapper_cc( reinterpret_cast<void*>( &host_fast4 ), 4, E32_CC_FASTCALL );
+    
+    elf::loader regparm( "32bit/libregparm1.so", [&]( std::experimental::string_view name ) -> uint32_t
+    {
+        if ( name == "host_mix3" )
+        {
+            return mix3;
+        }
+        
+        return name == "host_fast4" ? fast4 : get_symlibc( name );
+    } );
+    
+    const int cpus[] = { 0, 0 };
+    e32_executor * executor = e32_executor_create( 2, 64, cpus );
+    BOOST_REQUIRE( executor != nullptr );
+    
+    // Submitters never switch to guest code themselves
+    std::vector< std::thread > submitters;
+    std::atomic< int > errors( 0 );
+    
+    for ( int t = 0; t < 4; ++t )
+    {
+        submitters.emplace_back( [&, t]
+        {
+            std::vector< e32_call > calls( 16 );
+            
+            for ( int round = 0; round < 50; ++round )
+            {
+                for ( size_t i = 0; i < calls.size(); ++i )
+                {
+                    e32_call & c = calls[i];
+                    const int n = round + int(i) + t;
+                    
+                    c = e32_call();
+                    if ( i % 2 == 0 )
+                    {
+                        c.method = base.get_sym( "foo_abs" );
+                        c.argc = 1;
+                        c.args[0] = -n;
+                    }
+                    else
+                    {
+                        c.method = regparm.get_sym( "fastcall_call" );
+                        c.callconv = E32_CC_FASTCALL;
+                        c.argc = 4;
+                        c.args[0] = n % 10; c.args[1] = 2; c.args[2] = 3; c.args[3] = 4;
+                    }
+                    
+                    while ( e32_executor_submit( executor, &c ) != 0 )
+                    {
+                        std::this_thread::yield();
+                    }
+                }
+                
+                for ( size_t i = 0; i < calls.size(); ++i )
+                {
+                    const int n = round + int(i) + t;
+                    const int expected = i % 2 == 0 ? n * ( n - 1 ) / 2 : host_fast4( n % 10, 2, 3, 4 ) - 4;
+                    
+                    errors += e32_call_wait( &calls[i] ) != expected;
+                    errors += !e32_call_done( &calls[i] );
+                }
+            }
+        } );
+    }
+    
+    for ( std::thread & t : submitters )
+    {
+        t.join();
+    }
+    
+    BOOST_TEST( errors == 0 );
+    
+    e32_executor_destroy( executor );
+    
+    // A busy executor and a full queue: submission fails instead of blocking
+    executor = e32_executor_create( 1, 2, nullptr );
+    BOOST_REQUIRE( executor != nullptr );
+    
+    executor_gate = false;
+    
+    std::vector< e32_call > calls( 4 );
+    size_t accepted = 0;
+    
+    for ( e32_call & c : calls )
+    {
+        c = e32_call();
+        c.method = regparm.get_sym( "regparm_call" );
+        c.callconv = E32_CC_REGPARM3;
+        c.argc = 4;
+        c.args[0] = 1; c.args[1] = 2; c.args[2] = 3; c.args[3] = 4;
+        
+        if ( e32_executor_submit( executor, &c ) != 0 )
+        {
+            break;
+        }
+        
+        ++accepted;
+    }
+    
+    BOOST_TEST( accepted < calls.size() );
+    
+    executor_gate = true;
+    
+    for ( size_t i = 0; i < accepted; ++i )
+    {
+        BOOST_TEST( e32_call_wait( &calls[i] ) == host_mix3( 1, 2, 3 ) + host_fast4( 4, 3, 2, 1 ) );
+    }
+    
+    e32_executor_destroy( executor );
+}
+
+BOOST_AUTO_TEST_CASE(test_counters)
+{
+    elf::loader base( "32bit/libbase1.so", get_symlibc );
+    
+    const e32_function_ptr foo = base.get_sym( "foo" );
+    const e32_function_ptr foo_abs = base.get_sym( "foo_abs" );
+    
+    // Not measured while disabled
+    call( foo, 3 );
+    
+    e32_counters_enable();
+    BOOST_TEST( e32_counters_enabled() );
+    
+    // Counters of the hardware this runs on, without any rdtsc alone
+    const unsigned available = e32_counters_available();
+    BOOST_TEST( ( available & ~( ( 1u << E32_COUNTER_COUNT ) - 1 ) ) == 0u );
+    
+    for ( int i = 0; i < 10; ++i )
+    {
+        BOOST_TEST( call( foo_abs, -i ) == i * ( i - 1 ) / 2 );
+    }
+    
+    // An exited thread still counts
+    std::thread( [&] { BOOST_TEST( call( foo_abs, 4 ) == 6 ); } ).join();
+    
+    const int args[] = { 1, 2, 3, 4 };
+    int results[4];
+    std::pair< const int *, int * > batch_args( args, results );
+    e32_stack_jump( 1024 * 1024,
+                    +[]( void * data )
+                    {
+                        auto p = reinterpret_cast< std::pair< const int *, int * > * >( data );
+                        e32_enter32_batch( e32_libc_resolve( "abs" ), p->first, 1, p->second, 4 );
+                    },
+                    &batch_args );
+    BOOST_TEST( results[3] == 4 );
+    
+    e32_counters_disable();
+    call( foo, 3 );
+    
+    auto rows = elf::counters_report( { &base } );
+    
+    auto find = [&rows]( std::string const & name )
+    {
+        return std::find_if( rows.begin(), rows.end(), [&]( elf::counters_row const & r ) { return r.symbol == name; } );
+    };
+    
+    BOOST_TEST( ( find( "foo" ) == rows.end() ) );
+    
+    auto row = find( "foo_abs" );
+    BOOST_REQUIRE( ( row != rows.end() ) );
+    BOOST_TEST( row->stats.method == foo_abs );
+    BOOST_TEST( row->stats.calls == 11u );
+    BOOST_TEST( row->stats.tsc > 0u );
+    BOOST_TEST( ( row->stats.available & ~available ) == 0u );
+    
+    if ( row->stats.available & ( 1u << E32_COUNTER_INSTRUCTIONS ) )
+    {
+        BOOST_TEST( row->stats.counters[E32_COUNTER_INSTRUCTIONS] > 0u );
+    }
+    
+    // The batch counts once per element, and is named by its address outside of the modules
+    auto batch = std::find_if( rows.begin(), rows.end(), []( elf::counters_row const & r )
+    {
+        return r.stats.method == e32_libc_resolve( "abs" );
+    } );
+    BOOST_REQUIRE( ( batch != rows.end() ) );
+    BOOST_TEST( batch->stats.calls == 4u );
+    BOOST_TEST( batch->symbol.compare( 0, 2, "0x" ) == 0 );
+    
+    BOOST_TEST( std::is_sorted( rows.begin(), rows.end(), []( elf::counters_row const & a, elf::counters_row const & b )
+    {
+        return a.stats.tsc > b.stats.tsc;
+    } ) );
+    
+    std::ostringstream report;
+    elf::print_counters_report( report, rows );
+    BOOST_TEST( report.str().find( "foo_abs" ) != std::string::npos );
+}